@@ -0,0 +1,158 @@
+#!/usr/bin/python
+# -*- mode: python; coding: utf-8 -*-
+
+# This software is under the terms of Apache License v2 or later.
+
+from __future__ import print_function
+
+import sys
+import time
+from threading import Event, Thread
+from gattlib import GATTRequester, ATTPeer
+
+
+class Requester(GATTRequester):
+    def __init__(self, *args):
+        GATTRequester.__init__(self, *args)
+        self.notifications = 0
+
+    def on_notification(self, handle, data):
+        self.notifications += 1
+
+
+class Benchmark(object):
+    def __init__(self, count, mtu):
+        self.count = count
+
+        self.peer = ATTPeer(mtu)
+        self.peer.set_attribute(0x10, "x" * (mtu - 3))
+        self.peer.set_attribute(0x20, "n" * (mtu - 3))
+        self.polled = list(range(0x30, 0x38))
+        for handle in self.polled:
+            self.peer.set_attribute(handle, "st")
+
+        # No adapter needed, talk to the in-process peer
+        self.requester = Requester("00:00:00:00:00:00", False, "")
+        self.requester.attach(self.peer.client_fd(), mtu)
+
+    def measure(self, name, func):
+        start = time.time()
+        func()
+        elapsed = time.time() - start
+        print("{:<24} {:>10.0f} PDUs/s  {:>8.1f} us/op".format(
+            name, self.count / elapsed, elapsed * 1e6 / self.count))
+
+    def read(self):
+        for i in range(self.count):
+            self.requester.read_by_handle(0x10)
+
+    def poll_single(self):
+        for i in range(self.count // len(self.polled)):
+            for handle in self.polled:
+                self.requester.read_by_handle(handle)
+
+    def poll_multiple(self):
+        for i in range(self.count // len(self.polled)):
+            self.requester.read_multiple(self.polled, [2])
+
+    def poll_variable(self):
+        for i in range(self.count // len(self.polled)):
+            self.requester.read_multiple_variable(self.polled)
+
+    def write(self):
+        for i in range(self.count):
+            self.requester.write_by_handle(0x10, "abc")
+
+    def write_cmd(self):
+        sent = self.peer.pdus_received()
+        for i in range(self.count):
+            self.requester.write_cmd_by_handle(0x10, "abc")
+        while self.peer.pdus_received() - sent < self.count:
+            time.sleep(0.001)
+
+    def write_cmd_threads(self, threads):
+        def producer(count):
+            for i in range(count):
+                self.requester.write_cmd_by_handle(0x10, "abc")
+
+        sent = self.peer.pdus_received()
+        workers = [Thread(target=producer, args=(self.count // threads,))
+                   for i in range(threads)]
+        for worker in workers:
+            worker.start()
+        for worker in workers:
+            worker.join()
+
+        total = (self.count // threads) * threads
+        while self.peer.pdus_received() - sent < total:
+            time.sleep(0.001)
+
+    def notify_batched(self, rate, seconds):
+        received = [0]
+
+        def on_batch(records):
+            received[0] += len(records)
+
+        self.requester.set_notification_batch(on_batch, 64, 10)
+        self.peer.start_notifications(0x20, rate)
+        time.sleep(seconds)
+        self.peer.stop_notifications()
+        self.requester.set_notification_batch(None)
+        print("{:<24} {:>10.0f} PDUs/s".format(
+            "notify batched @{}/s".format(rate), received[0] / float(seconds)))
+
+    def notify_ring(self, rate, seconds):
+        received = 0
+        self.requester.enable_ring(1024)
+        self.peer.start_notifications(0x20, rate)
+        end = time.time() + seconds
+        while time.time() < end:
+            first, count = self.requester.ring_poll()
+            if count == 0:
+                time.sleep(0.001)
+                continue
+            received += count
+            self.requester.ring_release(count)
+        self.peer.stop_notifications()
+        self.requester.disable_ring()
+        print("{:<24} {:>10.0f} PDUs/s".format(
+            "notify ring @{}/s".format(rate), received / float(seconds)))
+
+    def notify(self, rate, seconds):
+        self.peer.start_notifications(0x20, rate)
+        time.sleep(seconds)
+        self.peer.stop_notifications()
+        print("{:<24} {:>10.0f} PDUs/s".format(
+            "notify @{}/s".format(rate),
+            self.requester.notifications / float(seconds)))
+
+    def run(self):
+        self.measure("read_by_handle", self.read)
+        self.measure("poll 8 x read_by_handle", self.poll_single)
+        self.measure("poll 8 x read_multiple", self.poll_multiple)
+        self.measure("poll 8 x read_multiple_variable", self.poll_variable)
+        self.measure("write_by_handle", self.write)
+        self.measure("write_cmd_by_handle", self.write_cmd)
+        for threads in (2, 4, 8):
+            self.measure("write_cmd x{} threads".format(threads),
+                         lambda: self.write_cmd_threads(threads))
+        self.notify(10000, 2)
+        self.notify_batched(10000, 2)
+        self.notify_ring(10000, 2)
+        self.latency()
+
+    def latency(self):
+        # ATT Read Request, as issued by read_by_handle
+        read = self.requester.stats()["latency"][0x0a]
+        for stage in ("queue", "response", "callback", "total"):
+            print("read {:<19} p50 {:>6} us  p99 {:>6} us  max {:>6} us".format(
+                stage, read[stage]["p50"], read[stage]["p99"],
+                read[stage]["max"]))
+
+
+if __name__ == '__main__':
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 10000
+    mtu = int(sys.argv[2]) if len(sys.argv) > 2 else 23
+
+    Benchmark(count, mtu).run()
+    print("Done.")
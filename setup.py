@@ -29,12 +29,21 @@ if sys.platform.startswith('linux'):
              'src/beacon.cpp',
              'src/bindings.cpp',
              'src/gattlib.cpp',
+             'src/ioservice.cpp',
+             'src/connection.cpp',
+             'src/client.cpp',
+             'src/gattcache.cpp',
+             'src/recorder.cpp',
+             'src/attpeer.cpp',
+             'src/asyncbridge.cpp',
              'src/bluez/lib/uuid.c',
              'src/bluez/attrib/gatt.c',
              'src/bluez/attrib/gattrib.c',
              'src/bluez/attrib/utils.c',
              'src/bluez/attrib/att.c',
              'src/bluez/src/shared/crypto.c',
+             'src/bluez/src/shared/timer-wheel.c',
+             'src/bluez/src/shared/histogram.c',
              'src/bluez/src/log.c',
              'src/bluez/btio/btio.c'],
 
@@ -0,0 +1,133 @@
+// -*- mode: c++; coding: utf-8 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+#include <boost/python/extract.hpp>
+#include <boost/python/handle.hpp>
+
+#include "asyncbridge.h"
+
+// Runs with the GIL held, as Python builds it
+AsyncBridge::AsyncBridge(boost::python::object loop) :
+    _loop(loop) {
+
+    _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_fd < 0) {
+        std::string msg = std::string("Could not create eventfd: ") +
+            std::string(strerror(errno));
+        throw std::runtime_error(msg);
+    }
+
+    // Borrowed reference, the reader goes away with the bridge
+    boost::python::object self(boost::python::ptr(this));
+    _loop.attr("add_reader")(_fd, self.attr("dispatch"));
+}
+
+AsyncBridge::~AsyncBridge() {
+    try {
+        _loop.attr("remove_reader")(_fd);
+    } catch (boost::python::error_already_set const&) {
+        PyErr_Clear();
+    }
+
+    close(_fd);
+}
+
+boost::python::object
+AsyncBridge::loop() const {
+    return _loop;
+}
+
+int
+AsyncBridge::fileno() const {
+    return _fd;
+}
+
+// Called by the event loop thread, no Python in here
+void
+AsyncBridge::complete(AsyncResponse* response) {
+    bool wakeup;
+    {
+        boost::lock_guard<boost::mutex> lock(_lock);
+        wakeup = _completed.empty();
+        _completed.push_back(response);
+    }
+
+    if (wakeup) {
+        uint64_t one = 1;
+        ssize_t ret = write(_fd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+// Called by asyncio when the eventfd is readable
+void
+AsyncBridge::dispatch() {
+    uint64_t count;
+    ssize_t ret = read(_fd, &count, sizeof(count));
+    (void)ret;
+
+    {
+        boost::lock_guard<boost::mutex> lock(_lock);
+        _completed.swap(_dispatching);
+    }
+
+    for (AsyncResponse* response : _dispatching) {
+        // Dropped last, it may be the only reference left
+        boost::python::object pin = response->_self;
+        response->_self = boost::python::object();
+        response->_dispatched = true;
+
+        // Cancelled from Python meanwhile
+        if (boost::python::extract<bool>(response->_future.attr("done")()))
+            continue;
+
+        try {
+            response->check_status();
+            response->_future.attr("set_result")(response->received());
+        } catch (std::runtime_error& e) {
+            boost::python::object error(boost::python::handle<>(
+                    boost::python::borrowed(PyExc_RuntimeError)));
+            response->_future.attr("set_exception")(error(e.what()));
+        }
+    }
+
+    _dispatching.clear();
+}
+
+AsyncResponse::AsyncResponse(AsyncBridge& bridge) :
+    _bridge(bridge),
+    _future(bridge.loop().attr("create_future")()) {
+}
+
+// The status is kept by GATTResponse, the future gets it on dispatch
+void
+AsyncResponse::notify(uint8_t status) {
+    GATTResponse::notify(status);
+
+    if (!_completed.exchange(true))
+        _bridge.complete(this);
+}
+
+boost::python::object
+AsyncResponse::future() const {
+    return _future;
+}
+
+boost::python::object
+AsyncResponse::await() {
+    return _future.attr("__await__")();
+}
+
+// Keeps self alive until dispatch(), unless that already ran, as it may
+// when the request was sent from another thread
+void
+AsyncResponse::pin(boost::python::object self) {
+    if (!_dispatched)
+        _self = self;
+}
@@ -0,0 +1,71 @@
+// -*- mode: c++; coding: utf-8; tab-width: 4 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#ifndef _ASYNCBRIDGE_H_
+#define _ASYNCBRIDGE_H_
+
+#include <boost/python/object.hpp>
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <vector>
+
+#include "gattlib.h"
+
+class AsyncResponse;
+
+/*
+ * Hands completed responses over to an asyncio loop. The event loop
+ * queues them and writes an eventfd only when the queue was empty; the
+ * asyncio loop, watching that fd, resolves every queued future in a single
+ * dispatch(). However many requests complete, each asyncio iteration
+ * costs at most one wakeup.
+ */
+class AsyncBridge {
+public:
+	AsyncBridge(boost::python::object loop);
+	virtual ~AsyncBridge();
+
+	boost::python::object loop() const;
+	int fileno() const;
+	void dispatch();
+
+	void complete(AsyncResponse* response);
+
+private:
+	boost::python::object _loop;
+	int _fd{-1};
+
+	boost::mutex _lock;
+	std::vector<AsyncResponse*> _completed;
+	std::vector<AsyncResponse*> _dispatching;
+};
+
+/*
+ * GATTResponse backed by an asyncio future, usable with any *_async
+ * method and awaited for the received list. The bindings pin it once a
+ * request has it, so an abandoned await does not free it under the loop;
+ * dispatch() lets go.
+ */
+class AsyncResponse : public GATTResponse {
+public:
+	AsyncResponse(AsyncBridge& bridge);
+
+	void notify(uint8_t status);
+	boost::python::object future() const;
+	boost::python::object await();
+	void pin(boost::python::object self);
+
+	friend class AsyncBridge;
+
+private:
+	AsyncBridge& _bridge;
+	boost::python::object _future;
+	std::atomic<bool> _completed{false};
+
+	// Reference to the Python object while in flight, GIL held for both
+	boost::python::object _self;
+	bool _dispatched{false};
+};
+
+#endif // _ASYNCBRIDGE_H_
@@ -0,0 +1,485 @@
+// -*- mode: c++; coding: utf-8 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+
+#include <bluetooth/bluetooth.h>
+
+#include "attpeer.h"
+
+// Notification source granularity; high rates send several PDUs per tick
+#define NOTIFY_TICK_MS 1
+
+gboolean
+peer_received_cb(GIOChannel* io, GIOCondition cond, gpointer userp) {
+    ATTPeer* peer = (ATTPeer*)userp;
+    uint8_t buf[ATT_MAX_VALUE_LEN + 3];
+
+    if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+        peer->_read_watch = 0;
+        return false;
+    }
+
+    // Drain everything queued, the client may have pipelined requests
+    for (;;) {
+        ssize_t len = recv(peer->_server_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+
+        if (len <= 0) {
+            peer->_read_watch = 0;
+            return false;
+        }
+
+        peer->_received++;
+        peer->handle_request(buf, len);
+    }
+}
+
+gboolean
+peer_delay_cb(gpointer userp) {
+    ATTPeer* peer = (ATTPeer*)userp;
+
+    peer->_delay_watch = 0;
+    peer->flush_delayed();
+    return false;
+}
+
+gboolean
+peer_notify_cb(gpointer userp) {
+    ATTPeer* peer = (ATTPeer*)userp;
+
+    peer->send_notifications();
+    return true;
+}
+
+ATTPeer::ATTPeer(int mtu) :
+    _mtu(mtu) {
+
+    if (mtu < ATT_DEFAULT_LE_MTU || mtu > ATT_MAX_VALUE_LEN + 3)
+        throw std::runtime_error("Invalid MTU");
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        std::string msg = std::string("Could not create socket pair: ") +
+            std::string(strerror(errno));
+        throw std::runtime_error(msg);
+    }
+
+    _server_fd = fds[0];
+    _client_fd = fds[1];
+
+    _io = g_io_channel_unix_new(_server_fd);
+    g_io_channel_set_encoding(_io, NULL, NULL);
+    g_io_channel_set_buffered(_io, FALSE);
+
+    _read_watch = g_io_add_watch(_io,
+            (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL),
+            peer_received_cb, (gpointer)this);
+}
+
+ATTPeer::~ATTPeer() {
+    // The watches are on the default context, served by loop 0 from its
+    // own thread: drop them there, so none of them runs meanwhile. Loop 0
+    // may be waiting for the GIL.
+    PyThreadState* save = NULL;
+    if (Py_IsInitialized() && PyGILState_Check())
+        save = PyEval_SaveThread();
+
+    IOServicePool::instance().get(0)->invoke([this]() {
+        stop_notifications();
+
+        if (_delay_watch > 0)
+            g_source_remove(_delay_watch);
+
+        if (_read_watch > 0)
+            g_source_remove(_read_watch);
+    });
+
+    if (save != NULL)
+        PyEval_RestoreThread(save);
+
+    if (_io != NULL)
+        g_io_channel_unref(_io);
+
+    close(_client_fd);
+    close(_server_fd);
+}
+
+int
+ATTPeer::client_fd() const {
+    return _client_fd;
+}
+
+void
+ATTPeer::set_attribute(uint16_t handle, std::string value) {
+    if (value.size() > ATT_MAX_VALUE_LEN)
+        throw std::runtime_error("Attribute value too long");
+
+    boost::lock_guard<boost::mutex> lock(_lock);
+    _attributes[handle] = value;
+}
+
+std::string
+ATTPeer::get_attribute(uint16_t handle) {
+    boost::lock_guard<boost::mutex> lock(_lock);
+
+    auto it = _attributes.find(handle);
+    if (it == _attributes.end())
+        throw std::runtime_error("Unknown handle");
+
+    return it->second;
+}
+
+void
+ATTPeer::set_mtu(int mtu) {
+    if (mtu < ATT_DEFAULT_LE_MTU || mtu > ATT_MAX_VALUE_LEN + 3)
+        throw std::runtime_error("Invalid MTU");
+
+    _mtu = mtu;
+}
+
+int
+ATTPeer::mtu() const {
+    return _mtu;
+}
+
+void
+ATTPeer::set_response_delay(int msec) {
+    _delay = msec < 0 ? 0 : msec;
+}
+
+void
+ATTPeer::set_read_multiple_variable(bool supported) {
+    _read_vl = supported;
+}
+
+void
+ATTPeer::start_notifications(uint16_t handle, int rate, bool indicate) {
+    if (rate <= 0)
+        throw std::runtime_error("Invalid notification rate");
+
+    stop_notifications();
+
+    _notify_handle = handle;
+    _notify_rate = rate;
+    _indicate = indicate;
+    _waiting_confirmation = false;
+    _notify_start = g_get_monotonic_time();
+    _notify_count = 0;
+    _notify_watch = g_timeout_add(NOTIFY_TICK_MS, peer_notify_cb,
+            (gpointer)this);
+}
+
+void
+ATTPeer::stop_notifications() {
+    if (_notify_watch > 0)
+        g_source_remove(_notify_watch);
+    _notify_watch = 0;
+}
+
+unsigned long
+ATTPeer::pdus_received() const {
+    return _received;
+}
+
+unsigned long
+ATTPeer::pdus_sent() const {
+    return _sent;
+}
+
+void
+ATTPeer::send_pdu(const uint8_t* pdu, size_t len) {
+    if (send(_server_fd, pdu, len, MSG_NOSIGNAL) == (ssize_t)len)
+        _sent++;
+}
+
+void
+ATTPeer::respond(const uint8_t* pdu, size_t len) {
+    if (_delay == 0) {
+        send_pdu(pdu, len);
+        return;
+    }
+
+    gint64 due = g_get_monotonic_time() + (gint64)_delay * 1000;
+    _delayed.push_back(std::make_pair(due, std::string((const char*)pdu, len)));
+
+    if (_delay_watch == 0)
+        _delay_watch = g_timeout_add(_delay, peer_delay_cb, (gpointer)this);
+}
+
+void
+ATTPeer::flush_delayed() {
+    gint64 now = g_get_monotonic_time();
+
+    while (!_delayed.empty() && _delayed.front().first <= now) {
+        const std::string& pdu = _delayed.front().second;
+        send_pdu((const uint8_t*)pdu.data(), pdu.size());
+        _delayed.pop_front();
+    }
+
+    if (_delayed.empty())
+        return;
+
+    guint wait = (_delayed.front().first - now + 999) / 1000;
+    _delay_watch = g_timeout_add(wait, peer_delay_cb, (gpointer)this);
+}
+
+void
+ATTPeer::send_notifications() {
+    uint8_t pdu[ATT_MAX_VALUE_LEN + 3];
+    std::string value;
+
+    {
+        boost::lock_guard<boost::mutex> lock(_lock);
+        auto it = _attributes.find(_notify_handle);
+        if (it != _attributes.end())
+            value = it->second;
+    }
+
+    size_t vlen = std::min(value.size(), (size_t)_mtu - 3);
+
+    if (_indicate) {
+        if (_waiting_confirmation)
+            return;
+
+        uint16_t plen = enc_indication(_notify_handle,
+                (uint8_t*)value.data(), vlen, pdu, sizeof(pdu));
+        send_pdu(pdu, plen);
+        _waiting_confirmation = true;
+        return;
+    }
+
+    uint16_t plen = enc_notification(_notify_handle, (uint8_t*)value.data(),
+            vlen, pdu, sizeof(pdu));
+
+    gint64 elapsed = g_get_monotonic_time() - _notify_start;
+    uint64_t due = (uint64_t)elapsed * _notify_rate / G_USEC_PER_SEC;
+
+    while (_notify_count < due) {
+        // Let the client catch up when its socket buffer is full
+        if (send(_server_fd, pdu, plen, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+            break;
+
+        _sent++;
+        _notify_count++;
+    }
+}
+
+void
+ATTPeer::handle_request(const uint8_t* pdu, size_t len) {
+    uint8_t opdu[ATT_MAX_VALUE_LEN + 3];
+    uint8_t value[ATT_MAX_VALUE_LEN + 3];
+    size_t vlen;
+    uint16_t handle = 0, offset, mtu;
+    uint16_t olen = 0;
+    uint8_t status = 0;
+
+    boost::lock_guard<boost::mutex> lock(_lock);
+
+    switch (pdu[0]) {
+    case ATT_OP_MTU_REQ:
+        if (!dec_mtu_req(pdu, len, &mtu)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+        olen = enc_mtu_resp(_mtu, opdu, _mtu);
+        break;
+
+    case ATT_OP_READ_REQ: {
+        if (!dec_read_req(pdu, len, &handle)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+
+        auto it = _attributes.find(handle);
+        if (it == _attributes.end()) {
+            status = ATT_ECODE_INVALID_HANDLE;
+            break;
+        }
+
+        olen = enc_read_resp((uint8_t*)it->second.data(), it->second.size(),
+                opdu, _mtu);
+        break;
+    }
+
+    case ATT_OP_READ_BLOB_REQ: {
+        if (!dec_read_blob_req(pdu, len, &handle, &offset)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+
+        auto it = _attributes.find(handle);
+        if (it == _attributes.end()) {
+            status = ATT_ECODE_INVALID_HANDLE;
+            break;
+        }
+
+        if (offset > it->second.size()) {
+            status = ATT_ECODE_INVALID_OFFSET;
+            break;
+        }
+
+        olen = enc_read_blob_resp((uint8_t*)it->second.data(),
+                it->second.size(), offset, opdu, _mtu);
+        break;
+    }
+
+    case ATT_OP_READ_MULTI_REQ: {
+        uint16_t handles[(ATT_MAX_VALUE_LEN + 3) / 2];
+        size_t count = sizeof(handles) / sizeof(handles[0]);
+
+        if (!dec_read_multi_req(pdu, len, handles, &count)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+
+        // Values back to back, whatever exceeds the MTU is dropped
+        opdu[0] = ATT_OP_READ_MULTI_RESP;
+        olen = 1;
+        for (size_t i = 0; i < count; i++) {
+            auto it = _attributes.find(handles[i]);
+            if (it == _attributes.end()) {
+                handle = handles[i];
+                status = ATT_ECODE_INVALID_HANDLE;
+                break;
+            }
+
+            vlen = std::min(it->second.size(), (size_t)_mtu - olen);
+            memcpy(opdu + olen, it->second.data(), vlen);
+            olen += vlen;
+        }
+        break;
+    }
+
+    case ATT_OP_READ_MULT_VL_REQ: {
+        uint16_t handles[(ATT_MAX_VALUE_LEN + 3) / 2];
+        const uint8_t* values[(ATT_MAX_VALUE_LEN + 3) / 2];
+        uint16_t vlens[(ATT_MAX_VALUE_LEN + 3) / 2];
+        size_t count = sizeof(handles) / sizeof(handles[0]);
+
+        // Behave like a peer older than Bluetooth 5.2
+        if (!_read_vl) {
+            status = ATT_ECODE_REQ_NOT_SUPP;
+            break;
+        }
+
+        if (!dec_read_multi_vl_req(pdu, len, handles, &count)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            auto it = _attributes.find(handles[i]);
+            if (it == _attributes.end()) {
+                handle = handles[i];
+                status = ATT_ECODE_INVALID_HANDLE;
+                break;
+            }
+
+            values[i] = (const uint8_t*)it->second.data();
+            vlens[i] = it->second.size();
+        }
+
+        if (status == 0)
+            olen = enc_read_multi_vl_resp(values, vlens, count, opdu, _mtu);
+        break;
+    }
+
+    case ATT_OP_WRITE_REQ:
+        if (!dec_write_req(pdu, len, &handle, value, &vlen)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+
+        _attributes[handle] = std::string((const char*)value, vlen);
+        olen = enc_write_resp(opdu);
+        break;
+
+    case ATT_OP_PREP_WRITE_REQ:
+        if (!dec_prep_write_req(pdu, len, &handle, &offset, value, &vlen)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+
+        if (_attributes.find(handle) == _attributes.end()) {
+            status = ATT_ECODE_INVALID_HANDLE;
+            break;
+        }
+
+        // Keep parts as they come, offsets are checked on execute
+        _prepared.push_back(Prepared{handle, offset,
+                std::string((const char*)value, vlen)});
+        olen = enc_prep_write_resp(handle, offset, value, vlen, opdu, _mtu);
+        break;
+
+    case ATT_OP_EXEC_WRITE_REQ: {
+        uint8_t flags;
+
+        if (!dec_exec_write_req(pdu, len, &flags)) {
+            status = ATT_ECODE_INVALID_PDU;
+            break;
+        }
+
+        std::map<uint16_t, std::string> written;
+        for (const auto& part : _prepared) {
+            if (flags != ATT_WRITE_ALL_PREP_WRITES)
+                break;
+
+            auto it = written.find(part.handle);
+            std::string current = it != written.end() ? it->second
+                                                      : _attributes[part.handle];
+
+            if (part.offset > current.size()) {
+                handle = part.handle;
+                status = ATT_ECODE_INVALID_OFFSET;
+                break;
+            }
+
+            written[part.handle] = current.substr(0, part.offset) + part.value;
+        }
+
+        // All or nothing
+        if (status == 0) {
+            for (const auto& write : written)
+                _attributes[write.first] = write.second;
+        }
+
+        _prepared.clear();
+        if (status == 0)
+            olen = enc_exec_write_resp(opdu);
+        break;
+    }
+
+    case ATT_OP_WRITE_CMD:
+        if (dec_write_cmd(pdu, len, &handle, value, &vlen))
+            _attributes[handle] = std::string((const char*)value, vlen);
+        return;
+
+    case ATT_OP_HANDLE_CNF:
+        _waiting_confirmation = false;
+        return;
+
+    default:
+        // Commands and unexpected responses are silently dropped
+        if (pdu[0] & 0x40 || pdu[0] & 0x01)
+            return;
+
+        status = ATT_ECODE_REQ_NOT_SUPP;
+    }
+
+    if (status)
+        olen = enc_error_resp(pdu[0], handle, status, opdu, sizeof(opdu));
+
+    respond(opdu, olen);
+}
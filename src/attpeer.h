@@ -0,0 +1,93 @@
+// -*- mode: c++; coding: utf-8; tab-width: 4 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#ifndef _ATTPEER_H_
+#define _ATTPEER_H_
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <glib.h>
+
+#include "gattlib.h"
+
+/*
+ * In-process ATT server running on one end of a SOCK_SEQPACKET socketpair.
+ * The other end is handed to GATTRequester::attach(), so the full
+ * GAttrib read/write/notify path can be driven without a radio. It serves
+ * from a configurable attribute table, with optional response delay and a
+ * periodic notification (or indication) source.
+ */
+class ATTPeer {
+public:
+	ATTPeer(int mtu=ATT_DEFAULT_LE_MTU);
+	virtual ~ATTPeer();
+
+	int client_fd() const;
+
+	void set_attribute(uint16_t handle, std::string value);
+	std::string get_attribute(uint16_t handle);
+
+	void set_mtu(int mtu);
+	int mtu() const;
+	void set_response_delay(int msec);
+	void set_read_multiple_variable(bool supported);
+
+	void start_notifications(uint16_t handle, int rate, bool indicate=false);
+	void stop_notifications();
+
+	unsigned long pdus_received() const;
+	unsigned long pdus_sent() const;
+
+	friend gboolean peer_received_cb(GIOChannel*, GIOCondition, gpointer);
+	friend gboolean peer_delay_cb(gpointer);
+	friend gboolean peer_notify_cb(gpointer);
+
+private:
+	void handle_request(const uint8_t* pdu, size_t len);
+	void respond(const uint8_t* pdu, size_t len);
+	void send_pdu(const uint8_t* pdu, size_t len);
+	void flush_delayed();
+	void send_notifications();
+
+	int _server_fd{-1};
+	int _client_fd{-1};
+	GIOChannel* _io{nullptr};
+	guint _read_watch{0};
+
+	boost::mutex _lock;
+	std::map<uint16_t, std::string> _attributes;
+
+	// Prepare Write queue, applied by Execute Write
+	struct Prepared {
+		uint16_t handle;
+		uint16_t offset;
+		std::string value;
+	};
+	std::vector<Prepared> _prepared;
+	int _mtu;
+
+	bool _read_vl{true};
+	int _delay{0};
+	guint _delay_watch{0};
+	std::deque<std::pair<gint64, std::string> > _delayed;
+
+	guint _notify_watch{0};
+	uint16_t _notify_handle{0};
+	int _notify_rate{0};
+	bool _indicate{false};
+	bool _waiting_confirmation{false};
+	gint64 _notify_start{0};
+	uint64_t _notify_count{0};
+
+	std::atomic<unsigned long> _received{0};
+	std::atomic<unsigned long> _sent{0};
+};
+
+#endif // _ATTPEER_H_
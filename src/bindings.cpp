@@ -12,6 +12,8 @@
 #include "gattlib.h"
 #include "gattservices.h"
 #include "beacon.h"
+#include "attpeer.h"
+#include "asyncbridge.h"
 
 using namespace boost::python;
 
@@ -53,6 +55,20 @@ public:
         self_.GATTResponse::on_response(data);
     }
 
+    void on_chunk(uint16_t offset, const std::string data) {
+        try {
+            PyGILGuard guard;
+            call_method<void>(self, "on_chunk", offset, data);
+        } catch(error_already_set const&) {
+            PyErr_Print();
+        }
+    }
+
+    static void default_on_chunk(GATTResponse& self_, uint16_t offset,
+            const std::string data) {
+        self_.GATTResponse::on_chunk(offset, data);
+    }
+
 private:
     PyObject* self;
 };
@@ -60,8 +76,8 @@ private:
 class GATTRequesterCb : public GATTRequester {
 public:
     GATTRequesterCb(PyObject* p, std::string address,
-            bool do_connect=true, std::string device="hci0") :
-        GATTRequester(address, do_connect, device),
+            bool do_connect=true, std::string device="hci0", int loop=-1) :
+        GATTRequester(address, do_connect, device, loop),
         self(p) {
     }
 
@@ -105,6 +121,94 @@ private:
     PyObject* self;
 };
 
+// Event loop pool, configured at module level
+static void
+set_event_loops(int count) {
+    IOServicePool::instance().resize(count);
+}
+
+static int
+event_loops() {
+    return IOServicePool::instance().size();
+}
+
+static void
+set_loop_policy(std::string policy) {
+    IOServicePool::instance().set_policy(policy);
+}
+
+static std::string
+loop_policy() {
+    return IOServicePool::instance().policy();
+}
+
+static void
+set_loop_cpu(int loop, int cpu) {
+    IOServicePool::instance().get(loop)->set_cpu(cpu);
+}
+
+static boost::python::list
+loop_stats() {
+    IOServicePool& pool = IOServicePool::instance();
+    boost::python::list result;
+
+    for (int i = 0; i < pool.size(); i++) {
+        IOService* loop = pool.get(i);
+        boost::python::dict stats;
+        stats["connections"] = loop->connections();
+        stats["iterations"] = loop->iterations();
+        stats["busy_ms"] = loop->busy_ms();
+        stats["cpu"] = loop->cpu();
+        result.append(stats);
+    }
+
+    return result;
+}
+
+static void
+set_cache_dir(std::string path) {
+    GATTCache::set_directory(path);
+}
+
+static std::string
+cache_dir() {
+    return GATTCache::directory();
+}
+
+static object
+pass_through(object const& o) {
+    return o;
+}
+
+// The view keeps the requester, and so the ring, alive
+static object
+ring_buffer(object self) {
+    GATTRequester& requester = extract<GATTRequester&>(self);
+    return requester.ring_buffer(self);
+}
+
+/*
+ * Call policy for the *_async methods: once the request is sent, an
+ * AsyncResponse passed as argument response_arg (self is 1) holds a
+ * reference to itself until AsyncBridge::dispatch() resolves it.
+ */
+template <std::size_t response_arg, class BasePolicy = default_call_policies>
+struct pin_async_response : BasePolicy {
+    template <class ArgumentPackage>
+    static PyObject* postcall(ArgumentPackage const& args, PyObject* result) {
+        result = BasePolicy::postcall(args, result);
+        if (result == 0)
+            return 0;
+
+        PyObject* arg = detail::get_prev<response_arg>::execute(args, result);
+        extract<AsyncResponse&> response(arg);
+        if (response.check())
+            response().pin(object(handle<>(borrowed(arg))));
+
+        return result;
+    }
+};
+
 BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
         start_advertising, BeaconService::start_advertising, 0, 5)
 
@@ -116,45 +220,232 @@ BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
         GATTRequester_discover_characteristics_async_overloads,
         GATTRequester::discover_characteristics_async, 1, 4)
 
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_attach_overloads, GATTRequester::attach, 1, 2)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_read_by_handle_async_overloads,
+        GATTRequester::read_by_handle_async, 2, 3)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_read_multiple_async_overloads,
+        GATTRequester::read_multiple_async, 3, 4)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_set_notification_batch_overloads,
+        GATTRequester::set_notification_batch, 1, 3)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_enable_ring_overloads,
+        GATTRequester::enable_ring, 0, 2)
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_record_overloads,
+        GATTRequester::record, 1, 4)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_subscribe_overloads,
+        GATTRequester::subscribe, 2, 3)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTTransaction_commit_async_overloads,
+        GATTTransaction::commit_async, 1, 2)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_read_long_async_overloads,
+        GATTRequester::read_long_async, 2, 4)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_read_long_overloads,
+        GATTRequester::read_long, 1, 3)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_read_multiple_variable_async_overloads,
+        GATTRequester::read_multiple_variable_async, 2, 3)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_read_handles_overloads,
+        GATTRequester::read_handles, 1, 2)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_read_by_uuid_async_overloads,
+        GATTRequester::read_by_uuid_async, 2, 3)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        GATTRequester_write_by_handle_async_overloads,
+        GATTRequester::write_by_handle_async, 3, 4)
+
+BOOST_PYTHON_MEMBER_FUNCTION_OVERLOADS(
+        ATTPeer_start_notifications_overloads,
+        ATTPeer::start_notifications, 2, 3)
+
 BOOST_PYTHON_MODULE(gattlib) {
 
+    // Loops call back into Python from their own threads
+    if (!PyEval_ThreadsInitialized())
+        PyEval_InitThreads();
+
     to_python_converter<std::vector<char>, bytes_vector_to_python_bytes>();
 
+    def("set_event_loops", set_event_loops, args("count"),
+            "runs count event loops, connections are spread among them");
+    def("event_loops", event_loops);
+    def("set_loop_policy", set_loop_policy, args("policy"),
+            "round_robin or least_loaded");
+    def("loop_policy", loop_policy);
+    def("set_loop_cpu", set_loop_cpu, args("loop", "cpu"),
+            "pins an event loop thread to a CPU");
+    def("loop_stats", loop_stats);
+    def("set_cache_dir", set_cache_dir, args("path"),
+            "keeps discovered attribute tables there, empty disables it");
+    def("cache_dir", cache_dir);
+
     register_ptr_to_python<GATTRequester*>();
 
     class_<GATTRequester, boost::noncopyable, GATTRequesterCb> ("GATTRequester",
-            init<std::string, optional<bool, std::string> >())
+            init<std::string, optional<bool, std::string, int> >())
 
         .def("connect", boost::python::raw_function(GATTRequester::connect_kwarg,1))
+        .def("attach", &GATTRequester::attach, GATTRequester_attach_overloads())
         .def("is_connected", &GATTRequester::is_connected)
         .def("disconnect", &GATTRequester::disconnect)
         .def("read_by_handle", &GATTRequester::read_by_handle)
-        .def("read_by_handle_async", &GATTRequester::read_by_handle_async)
+        .def("read_by_handle_async", &GATTRequester::read_by_handle_async,
+                GATTRequester_read_by_handle_async_overloads()[
+                    pin_async_response<3>()])
+        .def("read_long", &GATTRequester::read_long,
+                GATTRequester_read_long_overloads(
+                    args("handle", "offset", "size_hint"),
+                    "reads a long value from offset on"))
+        .def("read_long_async", &GATTRequester::read_long_async,
+                GATTRequester_read_long_async_overloads(
+                    args("handle", "response", "offset", "timeout"),
+                    "streams a long value to response.on_chunk")[
+                    pin_async_response<3>()])
+        .def("read_multiple", &GATTRequester::read_multiple,
+                "reads several fixed size values, packed in as few"
+                " Read Multiple requests as the MTU allows")
+        .def("read_multiple_async", &GATTRequester::read_multiple_async,
+                GATTRequester_read_multiple_async_overloads()[
+                    pin_async_response<4>()])
+        .def("read_multiple_variable",
+                &GATTRequester::read_multiple_variable,
+                "reads several values of any size, with Read Multiple"
+                " Variable Length requests when the peer supports them")
+        .def("read_multiple_variable_async",
+                &GATTRequester::read_multiple_variable_async,
+                GATTRequester_read_multiple_variable_async_overloads()[
+                    pin_async_response<3>()])
+        .def("read_handles", &GATTRequester::read_handles,
+                GATTRequester_read_handles_overloads(
+                    args("handles", "timeout"),
+                    "reads each handle with its own request, all queued at"
+                    " once; returns (handle, status, data) per handle"))
         .def("read_by_uuid", &GATTRequester::read_by_uuid)
-        .def("read_by_uuid_async", &GATTRequester::read_by_uuid_async)
+        .def("read_by_uuid_async", &GATTRequester::read_by_uuid_async,
+                GATTRequester_read_by_uuid_async_overloads()[
+                    pin_async_response<3>()])
         .def("write_by_handle", &GATTRequester::write_by_handle)
-        .def("write_by_handle_async", &GATTRequester::write_by_handle_async)
+        .def("write_by_handle_async", &GATTRequester::write_by_handle_async,
+                GATTRequester_write_by_handle_async_overloads()[
+                    pin_async_response<4>()])
         .def("write_cmd_by_handle", &GATTRequester::write_cmd_by_handle)
         .def("on_notification", &GATTRequesterCb::default_on_notification)
         .def("on_indication", &GATTRequesterCb::default_on_indication)
         .def("exchange_mtu", &GATTRequester::exchange_mtu)
         .def("mtu", &GATTRequester::mtu)
+        .def("connect_latency", &GATTRequester::connect_latency,
+                "milliseconds the last connect() took to be ready")
+        .def("loop", &GATTRequester::loop)
+        .def("stats", &GATTRequester::stats,
+                "returns connection counters and per opcode latencies")
+        .def("subscribe", &GATTRequester::subscribe,
+                GATTRequester_subscribe_overloads(
+                    args("value_handle", "callback", "indications"),
+                    "enables notifications of a characteristic, delivered"
+                    " to callback(handle, data)"))
+        .def("unsubscribe", &GATTRequester::unsubscribe)
+        .def("set_notification_batch", &GATTRequester::set_notification_batch,
+                GATTRequester_set_notification_batch_overloads(
+                    args("callback", "max_count", "max_delay"),
+                    "delivers notifications in batches, None disables it"))
+        .def("enable_ring", &GATTRequester::enable_ring,
+                GATTRequester_enable_ring_overloads(
+                    args("slots", "value_size"),
+                    "copies notifications into a ring read with ring_buffer()"))
+        .def("disable_ring", &GATTRequester::disable_ring)
+        .def("ring_buffer", &ring_buffer,
+                "returns a read-only memoryview of the notification ring")
+        .def("ring_slot_size", &GATTRequester::ring_slot_size)
+        .def("ring_poll", &GATTRequester::ring_poll,
+                "returns (first, count) of the slots ready to be read")
+        .def("ring_release", &GATTRequester::ring_release)
+        .def("ring_dropped", &GATTRequester::ring_dropped)
+        .def("record", &GATTRequester::record,
+                GATTRequester_record_overloads(
+                    args("path", "handles", "size", "segments"),
+                    "writes notifications to a binary log, see RecordReader"))
+        .def("stop_recording", &GATTRequester::stop_recording)
+        .def("invalidate_cache", &GATTRequester::invalidate_cache,
+                "forgets the cached attribute table of the device")
         .def("discover_primary", &GATTRequester::discover_primary,
                 "returns a list with of primary services,"
                 " with their handles and UUIDs.")
-        .def("discover_primary_async", &GATTRequester::discover_primary_async)
+        .def("discover_primary_async", &GATTRequester::discover_primary_async,
+                pin_async_response<2>())
         .def("discover_characteristics",
                 &GATTRequester::discover_characteristics,
                 GATTRequester_discover_characteristics_overloads())
         .def("discover_characteristics_async",
                 &GATTRequester::discover_characteristics_async,
-                GATTRequester_discover_characteristics_async_overloads());
+                GATTRequester_discover_characteristics_async_overloads()[
+                    pin_async_response<2>()])
+        .def("discover_all", &GATTRequester::discover_all,
+                "returns every service with its included services,"
+                " characteristics and descriptors")
+        .def("discover_all_async", &GATTRequester::discover_all_async,
+                pin_async_response<2>());
 
     register_ptr_to_python<GATTResponse*>();
 
     class_<GATTResponse, boost::noncopyable, GATTResponseCb>("GATTResponse")
             .def("received", &GATTResponse::received)
-            .def("on_response", &GATTResponseCb::default_on_response);
+            .def("wait", &GATTResponse::wait, args("timeout"),
+                    "waits up to timeout milliseconds for the response,"
+                    " without holding the GIL")
+            .def("on_response", &GATTResponseCb::default_on_response)
+            .def("on_chunk", &GATTResponseCb::default_on_chunk);
+
+    class_<AsyncBridge, boost::noncopyable>("AsyncBridge", init<object>())
+            .def("fileno", &AsyncBridge::fileno)
+            .def("loop", &AsyncBridge::loop)
+            .def("dispatch", &AsyncBridge::dispatch,
+                    "resolves the futures of the completed responses,"
+                    " called by the asyncio loop");
+
+    class_<AsyncResponse, bases<GATTResponse>, boost::noncopyable>(
+            "AsyncResponse", init<AsyncBridge&>()[
+                with_custodian_and_ward<1, 2>()])
+            .add_property("future", &AsyncResponse::future)
+            .def("__await__", &AsyncResponse::await);
+
+    class_<GATTTransaction, boost::noncopyable>("GATTTransaction",
+            init<GATTRequester&, optional<bool> >()[
+                with_custodian_and_ward<1, 2>()])
+            .def("write", &GATTTransaction::write,
+                    "queues a write, sent on commit")
+            .def("size", &GATTTransaction::size)
+            .def("clear", &GATTTransaction::clear)
+            .def("commit", &GATTTransaction::commit,
+                    "applies all queued writes at once, or none")
+            .def("commit_async", &GATTTransaction::commit_async,
+                    GATTTransaction_commit_async_overloads()[
+                        pin_async_response<2>()]);
+
+    class_<RecordReader, boost::noncopyable>("RecordReader",
+            init<std::string>())
+            .def("__iter__", &pass_through)
+            .def("__next__", &RecordReader::next)
+            .def("read", &RecordReader::read, (arg("count")=0),
+                    "returns the records available, up to count if not 0");
 
     class_<DiscoveryService>("DiscoveryService", init<optional<std::string> >())
             .def("discover", &DiscoveryService::discover);
@@ -166,4 +457,21 @@ BOOST_PYTHON_MODULE(gattlib) {
                         args("uuid", "major", "minor", "txpower", "interval"),
                         "starts advertising beacon packets"))
             .def("stop_advertising", &BeaconService::stop_advertising);
+
+    class_<ATTPeer, boost::noncopyable>("ATTPeer", init<optional<int> >())
+            .def("client_fd", &ATTPeer::client_fd)
+            .def("set_attribute", &ATTPeer::set_attribute)
+            .def("get_attribute", &ATTPeer::get_attribute)
+            .def("set_mtu", &ATTPeer::set_mtu)
+            .def("mtu", &ATTPeer::mtu)
+            .def("set_response_delay", &ATTPeer::set_response_delay)
+            .def("set_read_multiple_variable",
+                    &ATTPeer::set_read_multiple_variable)
+            .def("start_notifications", &ATTPeer::start_notifications,
+                    ATTPeer_start_notifications_overloads(
+                        args("handle", "rate", "indicate"),
+                        "sends the value of handle rate times per second"))
+            .def("stop_notifications", &ATTPeer::stop_notifications)
+            .def("pdus_received", &ATTPeer::pdus_received)
+            .def("pdus_sent", &ATTPeer::pdus_sent);
 }
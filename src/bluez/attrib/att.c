@@ -764,6 +764,132 @@ uint16_t dec_read_blob_req(const uint8_t *pdu, size_t len, uint16_t *handle,
 	return min_len;
 }
 
+static uint16_t enc_handle_set(uint8_t opcode, const uint16_t *handles,
+					size_t count, uint8_t *pdu, size_t len)
+{
+	size_t i;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	/* The Set Of Handles holds two or more handles */
+	if (count < 2 || len < 1 + count * sizeof(handles[0]))
+		return 0;
+
+	pdu[0] = opcode;
+
+	for (i = 0; i < count; i++)
+		put_le16(handles[i], &pdu[1 + i * 2]);
+
+	return 1 + count * 2;
+}
+
+static uint16_t dec_handle_set(uint8_t opcode, const uint8_t *pdu, size_t len,
+					uint16_t *handles, size_t *count)
+{
+	size_t i, n;
+
+	if (pdu == NULL || handles == NULL || count == NULL)
+		return 0;
+
+	if (len < 1 || pdu[0] != opcode)
+		return 0;
+
+	n = (len - 1) / 2;
+	if (n < 2 || (len - 1) % 2 || n > *count)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		handles[i] = get_le16(&pdu[1 + i * 2]);
+
+	*count = n;
+
+	return len;
+}
+
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t count,
+						uint8_t *pdu, size_t len)
+{
+	return enc_handle_set(ATT_OP_READ_MULTI_REQ, handles, count, pdu, len);
+}
+
+/* On entry *count is the room in handles, on return the handles decoded */
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								size_t *count)
+{
+	return dec_handle_set(ATT_OP_READ_MULTI_REQ, pdu, len, handles, count);
+}
+
+uint16_t enc_read_multi_vl_req(const uint16_t *handles, size_t count,
+						uint8_t *pdu, size_t len)
+{
+	return enc_handle_set(ATT_OP_READ_MULT_VL_REQ, handles, count, pdu,
+									len);
+}
+
+uint16_t dec_read_multi_vl_req(const uint8_t *pdu, size_t len,
+					uint16_t *handles, size_t *count)
+{
+	return dec_handle_set(ATT_OP_READ_MULT_VL_REQ, pdu, len, handles,
+									count);
+}
+
+/*
+ * Each value goes as a Length Value Tuple. Values are cut when the PDU is
+ * full, the length field still carries their full size.
+ */
+uint16_t enc_read_multi_vl_resp(const uint8_t **values, const uint16_t *vlens,
+				size_t count, uint8_t *pdu, size_t len)
+{
+	size_t i, off = 1, n;
+
+	if (pdu == NULL || len < 1)
+		return 0;
+
+	pdu[0] = ATT_OP_READ_MULT_VL_RESP;
+
+	for (i = 0; i < count && off + 2 <= len; i++) {
+		put_le16(vlens[i], &pdu[off]);
+		off += 2;
+
+		n = MIN(vlens[i], len - off);
+		memcpy(&pdu[off], values[i], n);
+		off += n;
+	}
+
+	return off;
+}
+
+/*
+ * Walks the tuples of a Read Multiple Variable Length Response, *offset
+ * starts at 0. Returns the octets of the value present in the PDU, which
+ * may be fewer than *vlen for the last tuple, or -1 when done.
+ */
+ssize_t dec_read_multi_vl_resp(const uint8_t *pdu, size_t len, size_t *offset,
+				const uint8_t **value, uint16_t *vlen)
+{
+	size_t off;
+	ssize_t n;
+
+	if (pdu == NULL || offset == NULL || value == NULL || vlen == NULL)
+		return -1;
+
+	if (len < 1 || pdu[0] != ATT_OP_READ_MULT_VL_RESP)
+		return -1;
+
+	off = *offset ? *offset : 1;
+	if (off + 2 > len)
+		return -1;
+
+	*vlen = get_le16(&pdu[off]);
+	*value = &pdu[off + 2];
+
+	n = MIN((size_t) *vlen, len - off - 2);
+	*offset = off + 2 + n;
+
+	return n;
+}
+
 uint16_t enc_read_resp(uint8_t *value, size_t vlen, uint8_t *pdu, size_t len)
 {
 	if (pdu == NULL)
@@ -1174,7 +1300,7 @@ uint16_t dec_prep_write_resp(const uint8_t *pdu, size_t len, uint16_t *handle,
 	if (len < min_len)
 		return 0;
 
-	if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+	if (pdu[0] != ATT_OP_PREP_WRITE_RESP)
 		return 0;
 
 	*handle = get_le16(&pdu[1]);
@@ -55,6 +55,8 @@
 #define ATT_OP_HANDLE_NOTIFY		0x1B
 #define ATT_OP_HANDLE_IND		0x1D
 #define ATT_OP_HANDLE_CNF		0x1E
+#define ATT_OP_READ_MULT_VL_REQ		0x20
+#define ATT_OP_READ_MULT_VL_RESP	0x21
 #define ATT_OP_SIGNED_WRITE_CMD		0xD2
 
 /* Error codes for Error response PDU */
@@ -157,6 +159,18 @@ uint16_t enc_read_blob_req(uint16_t handle, uint16_t offset, uint8_t *pdu,
 uint16_t dec_read_req(const uint8_t *pdu, size_t len, uint16_t *handle);
 uint16_t dec_read_blob_req(const uint8_t *pdu, size_t len, uint16_t *handle,
 							uint16_t *offset);
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t count,
+						uint8_t *pdu, size_t len);
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								size_t *count);
+uint16_t enc_read_multi_vl_req(const uint16_t *handles, size_t count,
+						uint8_t *pdu, size_t len);
+uint16_t dec_read_multi_vl_req(const uint8_t *pdu, size_t len,
+					uint16_t *handles, size_t *count);
+uint16_t enc_read_multi_vl_resp(const uint8_t **values, const uint16_t *vlens,
+				size_t count, uint8_t *pdu, size_t len);
+ssize_t dec_read_multi_vl_resp(const uint8_t *pdu, size_t len, size_t *offset,
+				const uint8_t **value, uint16_t *vlen);
 uint16_t enc_read_resp(uint8_t *value, size_t vlen, uint8_t *pdu, size_t len);
 uint16_t enc_read_blob_resp(uint8_t *value, size_t vlen, uint16_t offset,
 						uint8_t *pdu, size_t len);
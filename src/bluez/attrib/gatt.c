@@ -658,9 +658,15 @@ guint gatt_read_char_by_uuid(GAttrib *attrib, uint16_t start, uint16_t end,
 struct read_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
+	gatt_chunk_cb_t chunk;
 	gpointer user_data;
+	GDestroyNotify notify;
 	guint8 *buffer;
-	guint16 size;
+	size_t capacity;
+	guint16 size;		/* Octets in buffer, opcode included */
+	guint16 start;		/* Offset the read began at */
+	guint16 offset;		/* Offset of the next blob */
+	guint16 size_hint;
 	guint16 handle;
 	guint id;
 	int ref;
@@ -673,57 +679,144 @@ static void read_long_destroy(gpointer user_data)
 	if (__sync_sub_and_fetch(&long_read->ref, 1) > 0)
 		return;
 
+	if (long_read->notify)
+		long_read->notify(long_read->user_data);
+
 	if (long_read->buffer != NULL)
 		g_free(long_read->buffer);
 
 	g_free(long_read);
 }
 
-static void read_blob_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
-							gpointer user_data)
+/*
+ * Hands a blob to the chunk callback, or appends it to the buffer. The
+ * buffer is sized from the hint (or the largest valid value) up front and
+ * doubled when a peer goes beyond it, so a long read stays linear.
+ */
+static gboolean read_long_append(struct read_long_data *long_read,
+					const guint8 *value, guint16 vlen)
+{
+	size_t needed;
+	guint8 *tmp;
+
+	if (long_read->offset + vlen > G_MAXUINT16)
+		return FALSE;
+
+	if (long_read->chunk != NULL) {
+		long_read->chunk(long_read->offset, value, vlen,
+						long_read->user_data);
+		long_read->offset += vlen;
+		return TRUE;
+	}
+
+	needed = long_read->size + vlen;
+	if (needed > long_read->capacity) {
+		size_t capacity = MAX(long_read->capacity * 2, needed);
+
+		tmp = g_try_realloc(long_read->buffer, capacity);
+		if (tmp == NULL)
+			return FALSE;
+
+		long_read->buffer = tmp;
+		long_read->capacity = capacity;
+	}
+
+	memcpy(&long_read->buffer[long_read->size], value, vlen);
+	long_read->size += vlen;
+	long_read->offset += vlen;
+
+	return TRUE;
+}
+
+static gboolean read_long_init(struct read_long_data *long_read,
+							guint8 opcode)
+{
+	if (long_read->chunk != NULL)
+		return TRUE;
+
+	long_read->capacity = 1 + (long_read->size_hint ?
+				long_read->size_hint : ATT_MAX_VALUE_LEN);
+	long_read->buffer = g_try_malloc(long_read->capacity);
+	if (long_read->buffer == NULL)
+		return FALSE;
+
+	long_read->buffer[0] = opcode;
+	long_read->size = 1;
+
+	return TRUE;
+}
+
+static void read_long_done(struct read_long_data *long_read, guint8 status)
+{
+	if (long_read->chunk != NULL)
+		long_read->func(status, NULL, 0, long_read->user_data);
+	else
+		long_read->func(status, long_read->buffer, long_read->size,
+							long_read->user_data);
+}
+
+static void read_blob_helper(guint8 status, const guint8 *rpdu,
+					guint16 rlen, gpointer user_data);
+
+static guint read_long_next(struct read_long_data *long_read)
 {
-	struct read_long_data *long_read = user_data;
 	uint8_t *buf;
 	size_t buflen;
-	guint8 *tmp;
 	guint16 plen;
 	guint id;
 
-	if (status != 0 || rlen == 1) {
-		status = 0;
+	buf = g_attrib_get_buffer(long_read->attrib, &buflen);
+	plen = enc_read_blob_req(long_read->handle, long_read->offset,
+								buf, buflen);
+
+	/* The loop may answer and release it before g_attrib_send() returns */
+	__sync_fetch_and_add(&long_read->ref, 1);
+	id = g_attrib_send(long_read->attrib, long_read->id, buf, plen,
+				read_blob_helper, long_read, read_long_destroy);
+	if (id == 0)
+		__sync_fetch_and_sub(&long_read->ref, 1);
+
+	return id;
+}
+
+static void read_blob_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data)
+{
+	struct read_long_data *long_read = user_data;
+	size_t buflen;
+
+	/*
+	 * Once some of the value is in, these only mean it ended on a blob
+	 * boundary. Anything else (disconnect, deadline, abort) fails the
+	 * read, which can then be resumed from the offset reached.
+	 */
+	if (status != 0) {
+		if (long_read->offset != long_read->start &&
+				(status == ATT_ECODE_ATTR_NOT_LONG ||
+				 status == ATT_ECODE_INVALID_OFFSET))
+			status = 0;
 		goto done;
 	}
 
-	tmp = g_try_realloc(long_read->buffer, long_read->size + rlen - 1);
+	if (rlen <= 1)
+		goto done;
 
-	if (tmp == NULL) {
+	if (!read_long_append(long_read, &rpdu[1], rlen - 1)) {
 		status = ATT_ECODE_INSUFF_RESOURCES;
 		goto done;
 	}
 
-	memcpy(&tmp[long_read->size], &rpdu[1], rlen - 1);
-	long_read->buffer = tmp;
-	long_read->size += rlen - 1;
-
-	buf = g_attrib_get_buffer(long_read->attrib, &buflen);
+	g_attrib_get_buffer(long_read->attrib, &buflen);
 	if (rlen < buflen)
 		goto done;
 
-	plen = enc_read_blob_req(long_read->handle, long_read->size - 1,
-								buf, buflen);
-	id = g_attrib_send(long_read->attrib, long_read->id, buf, plen,
-				read_blob_helper, long_read, read_long_destroy);
-
-	if (id != 0) {
-		__sync_fetch_and_add(&long_read->ref, 1);
+	if (read_long_next(long_read) != 0)
 		return;
-	}
 
 	status = ATT_ECODE_IO;
 
 done:
-	long_read->func(status, long_read->buffer, long_read->size,
-							long_read->user_data);
+	read_long_done(long_read, status);
 }
 
 static void read_char_helper(guint8 status, const guint8 *rpdu,
@@ -731,39 +824,65 @@ static void read_char_helper(guint8 status, const guint8 *rpdu,
 {
 	struct read_long_data *long_read = user_data;
 	size_t buflen;
-	uint8_t *buf = g_attrib_get_buffer(long_read->attrib, &buflen);
-	guint16 plen;
-	guint id;
 
-	if (status != 0 || rlen < buflen)
+	g_attrib_get_buffer(long_read->attrib, &buflen);
+
+	if (status != 0)
+		goto done;
+
+	/* Short values skip the buffer entirely */
+	if (rlen < buflen && long_read->chunk == NULL)
 		goto done;
 
-	long_read->buffer = g_malloc(rlen);
-	if (long_read->buffer == NULL) {
+	if (!read_long_init(long_read, rpdu[0]) ||
+			!read_long_append(long_read, &rpdu[1], rlen - 1)) {
 		status = ATT_ECODE_INSUFF_RESOURCES;
 		goto done;
 	}
 
-	memcpy(long_read->buffer, rpdu, rlen);
-	long_read->size = rlen;
-
-	plen = enc_read_blob_req(long_read->handle, rlen - 1, buf, buflen);
-
-	id = g_attrib_send(long_read->attrib, long_read->id, buf, plen,
-				read_blob_helper, long_read, read_long_destroy);
-	if (id != 0) {
-		__sync_fetch_and_add(&long_read->ref, 1);
+	if (rlen < buflen) {
+		read_long_done(long_read, 0);
 		return;
 	}
 
-	status = ATT_ECODE_IO;
+	if (read_long_next(long_read) != 0)
+		return;
+
+	read_long_done(long_read, ATT_ECODE_IO);
+	return;
 
 done:
-	long_read->func(status, rpdu, rlen, long_read->user_data);
+	if (long_read->chunk != NULL)
+		long_read->func(status, NULL, 0, long_read->user_data);
+	else
+		long_read->func(status, rpdu, rlen, long_read->user_data);
 }
 
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 							gpointer user_data)
+{
+	return gatt_read_char_full(attrib, handle, func, user_data, NULL);
+}
+
+/* notify runs once the whole long read is over, even if it is cancelled */
+guint gatt_read_char_full(GAttrib *attrib, uint16_t handle,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
+{
+	return gatt_read_long(attrib, handle, 0, 0, NULL, func, user_data,
+								notify);
+}
+
+/*
+ * Reads a value from offset on, a non zero offset resumes an interrupted
+ * read with Read Blob requests. size_hint presizes the buffer. With a
+ * chunk callback every blob is handed over as it arrives and nothing is
+ * kept: func then only reports the final status, with a NULL pdu.
+ */
+guint gatt_read_long(GAttrib *attrib, uint16_t handle, uint16_t offset,
+				uint16_t size_hint, gatt_chunk_cb_t chunk,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
 {
 	uint8_t *buf;
 	size_t buflen;
@@ -778,27 +897,89 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 
 	long_read->attrib = attrib;
 	long_read->func = func;
+	long_read->chunk = chunk;
 	long_read->user_data = user_data;
+	long_read->notify = notify;
 	long_read->handle = handle;
+	long_read->start = offset;
+	long_read->offset = offset;
+	long_read->size_hint = size_hint;
+
+	/* Every blob goes out under this id, one cancel stops the read */
+	long_read->id = g_attrib_reserve_id(attrib);
+
+	if (offset > 0) {
+		if (!read_long_init(long_read, ATT_OP_READ_BLOB_RESP)) {
+			g_free(long_read);
+			return 0;
+		}
+
+		id = read_long_next(long_read);
+		if (id == 0) {
+			g_free(long_read->buffer);
+			g_free(long_read);
+		}
+
+		return id;
+	}
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 	plen = enc_read_req(handle, buf, buflen);
-	id = g_attrib_send(attrib, 0, buf, plen, read_char_helper,
+
+	long_read->ref = 1;
+	id = g_attrib_send(attrib, long_read->id, buf, plen, read_char_helper,
 						long_read, read_long_destroy);
 	if (id == 0)
 		g_free(long_read);
-	else {
-		__sync_fetch_and_add(&long_read->ref, 1);
-		long_read->id = id;
-	}
 
 	return id;
 }
 
+/*
+ * One Read Multiple Request; the response carries the values back to back,
+ * only the caller knows where each one ends. notify runs even if the
+ * request is cancelled, so the caller can keep its state alive until then.
+ */
+guint gatt_read_multiple(GAttrib *attrib, const uint16_t *handles, int count,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint16 plen;
+
+	buf = g_attrib_get_buffer(attrib, &buflen);
+	plen = enc_read_multi_req(handles, count, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	return g_attrib_send(attrib, 0, buf, plen, func, user_data, notify);
+}
+
+/* Like gatt_read_multiple(), values come back as Length Value Tuples */
+guint gatt_read_multiple_vl(GAttrib *attrib, const uint16_t *handles,
+				int count, GAttribResultFunc func,
+				gpointer user_data, GDestroyNotify notify)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint16 plen;
+
+	buf = g_attrib_get_buffer(attrib, &buflen);
+	plen = enc_read_multi_vl_req(handles, count, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	return g_attrib_send(attrib, 0, buf, plen, func, user_data, notify);
+}
+
 struct write_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
 	gpointer user_data;
+	GDestroyNotify notify;
+	int refs;			/* Prepare Write requests in flight */
+	gboolean executed;		/* notify passed on to Execute Write */
 	guint16 handle;
 	uint16_t offset;
 	uint8_t *value;
@@ -806,7 +987,8 @@ struct write_long_data {
 };
 
 static guint execute_write(GAttrib *attrib, uint8_t flags,
-				GAttribResultFunc func, gpointer user_data)
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
 {
 	uint8_t *buf;
 	size_t buflen;
@@ -817,11 +999,25 @@ static guint execute_write(GAttrib *attrib, uint8_t flags,
 	if (plen == 0)
 		return 0;
 
-	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
+	return g_attrib_send(attrib, 0, buf, plen, func, user_data, notify);
 }
 
 static guint prepare_write(struct write_long_data *long_write);
 
+static void write_long_unref(gpointer user_data)
+{
+	struct write_long_data *long_write = user_data;
+
+	if (--long_write->refs > 0)
+		return;
+
+	if (!long_write->executed && long_write->notify)
+		long_write->notify(long_write->user_data);
+
+	g_free(long_write->value);
+	g_free(long_write);
+}
+
 static void prepare_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
 							gpointer user_data)
 {
@@ -836,17 +1032,21 @@ static void prepare_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
 	long_write->offset += rlen - 5;
 
 	if (long_write->offset == long_write->vlen) {
-		execute_write(long_write->attrib, ATT_WRITE_ALL_PREP_WRITES,
-				long_write->func, long_write->user_data);
-		g_free(long_write->value);
-		g_free(long_write);
-
+		if (execute_write(long_write->attrib, ATT_WRITE_ALL_PREP_WRITES,
+					long_write->func, long_write->user_data,
+					long_write->notify) != 0)
+			long_write->executed = TRUE;
+		else
+			long_write->func(ATT_ECODE_IO, NULL, 0,
+							long_write->user_data);
 		return;
 	}
 
-	prepare_write(long_write);
+	if (prepare_write(long_write) == 0)
+		long_write->func(ATT_ECODE_IO, NULL, 0, long_write->user_data);
 }
 
+/* Each request holds a reference, released by write_long_unref() */
 static guint prepare_write(struct write_long_data *long_write)
 {
 	GAttrib *attrib = long_write->attrib;
@@ -855,6 +1055,7 @@ static guint prepare_write(struct write_long_data *long_write)
 	uint8_t *buf, *value = long_write->value + offset;
 	size_t buflen, vlen = long_write->vlen - offset;
 	guint16 plen;
+	guint id;
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
@@ -862,16 +1063,35 @@ static guint prepare_write(struct write_long_data *long_write)
 	if (plen == 0)
 		return 0;
 
-	return g_attrib_send(attrib, 0, buf, plen, prepare_write_cb, long_write,
-									NULL);
+	long_write->refs++;
+	id = g_attrib_send(attrib, 0, buf, plen, prepare_write_cb, long_write,
+							write_long_unref);
+	if (id == 0)
+		long_write->refs--;
+
+	return id;
 }
 
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 			size_t vlen, GAttribResultFunc func, gpointer user_data)
+{
+	return gatt_write_char_full(attrib, handle, value, vlen, func,
+							user_data, NULL);
+}
+
+/*
+ * Like gatt_write_char(); notify runs once nothing refers to user_data
+ * any more, also when a long write is cut short.
+ */
+guint gatt_write_char_full(GAttrib *attrib, uint16_t handle,
+				const uint8_t *value, size_t vlen,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
 {
 	uint8_t *buf;
 	size_t buflen;
 	struct write_long_data *long_write;
+	guint id;
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
@@ -885,7 +1105,7 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 			return 0;
 
 		return g_attrib_send(attrib, 0, buf, plen, func, user_data,
-									NULL);
+									notify);
 	}
 
 	/* Write Long Characteristic Values */
@@ -896,23 +1116,50 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 	long_write->attrib = attrib;
 	long_write->func = func;
 	long_write->user_data = user_data;
+	long_write->notify = notify;
 	long_write->handle = handle;
 	long_write->value = g_memdup(value, vlen);
 	long_write->vlen = vlen;
 
-	return prepare_write(long_write);
+	id = prepare_write(long_write);
+	if (id == 0) {
+		g_free(long_write->value);
+		g_free(long_write);
+	}
+
+	return id;
 }
 
 guint gatt_execute_write(GAttrib *attrib, uint8_t flags,
 				GAttribResultFunc func, gpointer user_data)
 {
-	return execute_write(attrib, flags, func, user_data);
+	return execute_write(attrib, flags, func, user_data, NULL);
+}
+
+guint gatt_execute_write_full(GAttrib *attrib, uint8_t flags,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
+{
+	return execute_write(attrib, flags, func, user_data, notify);
 }
 
 guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
 					const uint8_t *value, size_t vlen,
 					GAttribResultFunc func,
 					gpointer user_data)
+{
+	return gatt_prepare_write(attrib, handle, 0, value, vlen, func,
+							user_data, NULL);
+}
+
+/*
+ * Queues (part of) a value on the server, at offset. Nothing is written
+ * until an Execute Write; the response echoes the part for verification.
+ */
+guint gatt_prepare_write(GAttrib *attrib, uint16_t handle, uint16_t offset,
+				const uint8_t *value, size_t vlen,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
 {
 	uint8_t *buf;
 	guint16 plen;
@@ -920,11 +1167,11 @@ guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
-	plen = enc_prep_write_req(handle, 0, value, vlen, buf, buflen);
+	plen = enc_prep_write_req(handle, offset, value, vlen, buf, buflen);
 	if (!plen)
 		return 0;
 
-	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
+	return g_attrib_send(attrib, 0, buf, plen, func, user_data, notify);
 }
 
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
@@ -1053,6 +1300,138 @@ guint gatt_discover_desc(GAttrib *attrib, uint16_t start, uint16_t end,
 				discover_desc_ref(dd), discover_desc_unref);
 }
 
+struct find_cccd {
+	GAttrib *attrib;
+	gatt_handle_cb_t cb;
+	gpointer user_data;
+	GDestroyNotify notify;
+	guint id;
+	int ref;
+};
+
+static void find_cccd_unref(gpointer user_data)
+{
+	struct find_cccd *fc = user_data;
+
+	if (__sync_sub_and_fetch(&fc->ref, 1) > 0)
+		return;
+
+	if (fc->notify)
+		fc->notify(fc->user_data);
+
+	g_free(fc);
+}
+
+static guint find_cccd_next(struct find_cccd *fc, uint16_t start);
+
+/*
+ * Walks the descriptors after a characteristic value, up to the next
+ * declaration: the CCCD can only be among them.
+ */
+static void find_cccd_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
+							gpointer user_data)
+{
+	struct find_cccd *fc = user_data;
+	struct att_data_list *list;
+	uint16_t last = 0xffff, type;
+	guint8 format;
+	unsigned int i;
+
+	if (status) {
+		fc->cb(status, 0, fc->user_data);
+		return;
+	}
+
+	list = dec_find_info_resp(ipdu, iplen, &format);
+	if (list == NULL) {
+		fc->cb(ATT_ECODE_IO, 0, fc->user_data);
+		return;
+	}
+
+	for (i = 0; i < list->num; i++) {
+		uint8_t *value = list->data[i];
+
+		last = get_le16(value);
+		if (format != ATT_FIND_INFO_RESP_FMT_16BIT)
+			continue;
+
+		type = get_le16(&value[2]);
+		if (type == GATT_CLIENT_CHARAC_CFG_UUID) {
+			att_data_list_free(list);
+			fc->cb(0, last, fc->user_data);
+			return;
+		}
+
+		if (type == GATT_PRIM_SVC_UUID || type == GATT_SND_SVC_UUID ||
+				type == GATT_INCLUDE_UUID ||
+				type == GATT_CHARAC_UUID) {
+			att_data_list_free(list);
+			fc->cb(ATT_ECODE_ATTR_NOT_FOUND, 0, fc->user_data);
+			return;
+		}
+	}
+
+	att_data_list_free(list);
+
+	if (last == 0xffff || find_cccd_next(fc, last + 1) == 0)
+		fc->cb(ATT_ECODE_ATTR_NOT_FOUND, 0, fc->user_data);
+}
+
+static guint find_cccd_next(struct find_cccd *fc, uint16_t start)
+{
+	size_t buflen;
+	uint8_t *buf = g_attrib_get_buffer(fc->attrib, &buflen);
+	guint16 plen;
+	guint id;
+
+	plen = enc_find_info_req(start, 0xffff, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	/* The loop may answer and release it before g_attrib_send() returns */
+	__sync_fetch_and_add(&fc->ref, 1);
+	id = g_attrib_send(fc->attrib, fc->id, buf, plen, find_cccd_cb, fc,
+							find_cccd_unref);
+	if (id == 0)
+		__sync_fetch_and_sub(&fc->ref, 1);
+
+	return id;
+}
+
+/*
+ * Finds the Client Characteristic Configuration descriptor of the
+ * characteristic with that value handle. func gets ATT_ECODE_ATTR_NOT_FOUND
+ * if it has none; notify runs once the search is over.
+ */
+guint gatt_find_cccd(GAttrib *attrib, uint16_t value_handle,
+				gatt_handle_cb_t func, gpointer user_data,
+				GDestroyNotify notify)
+{
+	struct find_cccd *fc;
+	guint id;
+
+	if (value_handle == 0xffff)
+		return 0;
+
+	fc = g_try_new0(struct find_cccd, 1);
+	if (fc == NULL)
+		return 0;
+
+	fc->attrib = attrib;
+	fc->cb = func;
+	fc->user_data = user_data;
+	fc->notify = notify;
+
+	/* Follow-ups reuse the id, so one cancel stops the search */
+	fc->id = g_attrib_reserve_id(attrib);
+
+	id = find_cccd_next(fc, value_handle + 1);
+	if (id == 0)
+		g_free(fc);
+
+	return id;
+}
+
 guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 			int vlen, GDestroyNotify notify, gpointer user_data)
 {
@@ -47,6 +47,10 @@
 #define GATT_CLIENT_CHARAC_CFG_IND_BIT		0x0002
 
 typedef void (*gatt_cb_t) (uint8_t status, GSList *l, void *user_data);
+typedef void (*gatt_handle_cb_t) (uint8_t status, uint16_t handle,
+							void *user_data);
+typedef void (*gatt_chunk_cb_t) (uint16_t offset, const uint8_t *value,
+					uint16_t vlen, void *user_data);
 
 struct gatt_primary {
 	char uuid[MAX_LEN_UUID_STR + 1];
@@ -86,10 +90,32 @@ guint gatt_discover_char(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 							gpointer user_data);
 
+guint gatt_read_char_full(GAttrib *attrib, uint16_t handle,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify);
+
+guint gatt_read_long(GAttrib *attrib, uint16_t handle, uint16_t offset,
+				uint16_t size_hint, gatt_chunk_cb_t chunk,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify);
+
+guint gatt_read_multiple(GAttrib *attrib, const uint16_t *handles, int count,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify);
+
+guint gatt_read_multiple_vl(GAttrib *attrib, const uint16_t *handles,
+				int count, GAttribResultFunc func,
+				gpointer user_data, GDestroyNotify notify);
+
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 					size_t vlen, GAttribResultFunc func,
 					gpointer user_data);
 
+guint gatt_write_char_full(GAttrib *attrib, uint16_t handle,
+				const uint8_t *value, size_t vlen,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify);
+
 guint gatt_discover_desc(GAttrib *attrib, uint16_t start, uint16_t end,
 						bt_uuid_t *uuid, gatt_cb_t func,
 						gpointer user_data);
@@ -99,9 +125,22 @@ guint gatt_reliable_write_char(GAttrib *attrib, uint16_t handle,
 					GAttribResultFunc func,
 					gpointer user_data);
 
+guint gatt_prepare_write(GAttrib *attrib, uint16_t handle, uint16_t offset,
+				const uint8_t *value, size_t vlen,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify);
+
 guint gatt_execute_write(GAttrib *attrib, uint8_t flags,
 				GAttribResultFunc func, gpointer user_data);
 
+guint gatt_execute_write_full(GAttrib *attrib, uint8_t flags,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify);
+
+guint gatt_find_cccd(GAttrib *attrib, uint16_t value_handle,
+				gatt_handle_cb_t func, gpointer user_data,
+				GDestroyNotify notify);
+
 guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, const uint8_t *value,
 			int vlen, GDestroyNotify notify, gpointer user_data);
 
@@ -22,13 +22,23 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <glib.h>
 
 #include <stdio.h>
@@ -38,39 +48,139 @@
 #include "btio/btio.h"
 #include "lib/uuid.h"
 #include "src/shared/util.h"
+#include "src/shared/timer-wheel.h"
+#include "src/shared/mpsc.h"
+#include "src/shared/histogram.h"
 #include "src/log.h"
 #include "attrib/att.h"
 #include "attrib/gattrib.h"
 
 #define GATT_TIMEOUT 30
 
+/*
+ * Incoming PDUs are drained with recvmmsg() into a ring of RX_BATCH slots.
+ * Slots keep the historical 512 byte receive size, so g_attrib_set_mtu()
+ * never has to reallocate them underneath the reader.
+ */
+#define RX_BATCH 16
+#define RX_SLOT_SIZE 512
+
+/* Idle commands kept per GAttrib for reuse by g_attrib_send() */
+#define POOL_MAX 64
+
+/* Upper bound of PDUs handed to a single sendmmsg() call */
+#define TX_BATCH 32
+
+/*
+ * Calls made off the loop thread are not applied in place, they are pushed
+ * on attrib->submissions and replayed by the loop when submit_fd fires.
+ */
+enum submit_op {
+	SUBMIT_SEND,
+	SUBMIT_CANCEL,
+	SUBMIT_CANCEL_ALL,
+	SUBMIT_CANCEL_MATCHING,
+	SUBMIT_DEADLINE,
+	SUBMIT_REGISTER,
+	SUBMIT_UNREGISTER,
+	SUBMIT_UNREGISTER_ALL,
+};
+
+struct submission {
+	struct mpsc_node node;
+	enum submit_op op;
+	guint id;
+	guint msec;
+	gpointer data;
+	GAttribMatchFunc match;
+};
+
+/* Lets a SUBMIT_CANCEL caller wait until the loop has applied it */
+struct submit_wait {
+	GMutex lock;
+	GCond cond;
+	bool done;
+	gboolean ret;
+};
+
+/* Per thread encode buffer handed out by g_attrib_get_buffer() */
+struct thread_buf {
+	size_t size;
+	uint8_t data[];
+};
+
+static GPrivate thread_buf = G_PRIVATE_INIT(g_free);
+
+/* Per opcode latency, allocated on the first sample */
+struct latency {
+	struct histogram *stage[GATTRIB_LATENCY_STAGES];
+};
+
+struct rx_ring {
+	struct mmsghdr msgs[RX_BATCH];
+	struct iovec iov[RX_BATCH];
+	uint8_t slots[RX_BATCH][RX_SLOT_SIZE];
+};
+
 struct _GAttrib {
 	GIOChannel *io;
 	int refs;
-	uint8_t *buf;
 	size_t buflen;
+	struct rx_ring *rx;
 	guint read_watch;
 	guint write_watch;
 	guint timeout_watch;
 	GQueue *requests;
 	GQueue *responses;
-	GSList *events;
+	GHashTable *event_index;
+	GHashTable *event_ids;
+	GHashTable *command_ids;
 	guint next_cmd_id;
+	guint current_id;
 	GDestroyNotify destroy;
 	gpointer destroy_user_data;
 	bool stale;
+	guint64 flushes;
+	guint64 pdus_sent;
+	guint64 pdus_received;
+	guint64 bytes_sent;
+	guint64 bytes_received;
+	guint64 errors;
+	guint64 timeouts;
+	struct latency *latency[256];
+	GMutex pool_lock;
+	struct command *pool;
+	guint pool_len;
+	guint64 pool_allocs;
+	guint64 pool_reuses;
+	struct timer_wheel *wheel;
+	GMainContext *context;
+	struct mpsc_queue submissions;
+	int submit_fd;
+	guint submit_watch;
+	int submit_pending;
 };
 
+/* The PDU is stored inline, commands are recycled through attrib->pool */
 struct command {
 	guint id;
 	guint8 opcode;
 	guint8 *pdu;
 	guint16 len;
+	guint16 size;
 	guint8 expected;
 	bool sent;
+	gint64 queued_at;
+	gint64 sent_at;
 	GAttribResultFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
+	GQueue *queue;
+	GList *link;
+	struct wheel_timer deadline;
+	struct submission submit;
+	struct command *next_free;
+	guint8 data[];
 };
 
 struct event {
@@ -80,8 +190,21 @@ struct event {
 	GAttribNotifyFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
+	GList *link;
 };
 
+/*
+ * Events are indexed by (opcode, handle). Wildcard registrations live in
+ * their own buckets: (GATTRIB_ALL_REQS, 0) for every request and
+ * (opcode, GATTRIB_ALL_HANDLES) for every handle of an opcode. Buckets keep
+ * registration order, which is also increasing id order.
+ */
+#define EVENT_KEY(opcode, handle) \
+	GUINT_TO_POINTER(((guint) (opcode) << 16) | (handle))
+
+/* Matches dispatched without a heap allocation */
+#define EVENT_BATCH 16
+
 static guint8 opcode2expected(guint8 opcode)
 {
 	switch (opcode) {
@@ -106,6 +229,9 @@ static guint8 opcode2expected(guint8 opcode)
 	case ATT_OP_READ_MULTI_REQ:
 		return ATT_OP_READ_MULTI_RESP;
 
+	case ATT_OP_READ_MULT_VL_REQ:
+		return ATT_OP_READ_MULT_VL_RESP;
+
 	case ATT_OP_READ_BY_GROUP_REQ:
 		return ATT_OP_READ_BY_GROUP_RESP;
 
@@ -136,6 +262,7 @@ static bool is_response(guint8 opcode)
 	case ATT_OP_READ_RESP:
 	case ATT_OP_READ_BLOB_RESP:
 	case ATT_OP_READ_MULTI_RESP:
+	case ATT_OP_READ_MULT_VL_RESP:
 	case ATT_OP_READ_BY_GROUP_RESP:
 	case ATT_OP_WRITE_RESP:
 	case ATT_OP_PREP_WRITE_RESP:
@@ -157,6 +284,7 @@ static bool is_request(guint8 opcode)
 	case ATT_OP_READ_REQ:
 	case ATT_OP_READ_BLOB_REQ:
 	case ATT_OP_READ_MULTI_REQ:
+	case ATT_OP_READ_MULT_VL_REQ:
 	case ATT_OP_READ_BY_GROUP_REQ:
 	case ATT_OP_WRITE_REQ:
 	case ATT_OP_WRITE_CMD:
@@ -182,15 +310,133 @@ GAttrib *g_attrib_ref(GAttrib *attrib)
 	return attrib;
 }
 
-static void command_destroy(struct command *cmd)
+static struct command *command_new(struct _GAttrib *attrib, guint16 len)
+{
+	struct command *cmd;
+	guint16 size;
+
+	g_mutex_lock(&attrib->pool_lock);
+
+	cmd = attrib->pool;
+	if (cmd && cmd->size >= len) {
+		attrib->pool = cmd->next_free;
+		attrib->pool_len--;
+		attrib->pool_reuses++;
+		g_mutex_unlock(&attrib->pool_lock);
+
+		size = cmd->size;
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->size = size;
+		cmd->pdu = cmd->data;
+
+		return cmd;
+	}
+
+	attrib->pool_allocs++;
+	g_mutex_unlock(&attrib->pool_lock);
+
+	/* Size for the MTU so the command can be recycled for any PDU */
+	size = MAX(len, attrib->buflen);
+
+	cmd = g_try_malloc0(sizeof(*cmd) + size);
+	if (cmd == NULL)
+		return NULL;
+
+	cmd->size = size;
+	cmd->pdu = cmd->data;
+
+	return cmd;
+}
+
+static void command_destroy(struct _GAttrib *attrib, struct command *cmd)
 {
+	if (cmd->deadline.pprev)
+		timer_wheel_del(attrib->wheel, &cmd->deadline);
+
 	if (cmd->notify)
 		cmd->notify(cmd->user_data);
 
-	g_free(cmd->pdu);
+	g_mutex_lock(&attrib->pool_lock);
+
+	/* Commands sized for an older, smaller MTU are not worth keeping */
+	if (attrib->pool_len < POOL_MAX && cmd->size >= attrib->buflen) {
+		cmd->next_free = attrib->pool;
+		attrib->pool = cmd;
+		attrib->pool_len++;
+		cmd = NULL;
+	}
+
+	g_mutex_unlock(&attrib->pool_lock);
+
 	g_free(cmd);
 }
 
+/*
+ * Every queued command is indexed by id and remembers its queue link, so
+ * lookup and removal never scan the queues. Ids given by the caller may
+ * repeat (long reads reuse theirs), the index follows the newest command.
+ */
+static void command_enqueue(struct _GAttrib *attrib, GQueue *queue,
+					struct command *cmd, bool head)
+{
+	if (head) {
+		g_queue_push_head(queue, cmd);
+		cmd->link = g_queue_peek_head_link(queue);
+	} else {
+		g_queue_push_tail(queue, cmd);
+		cmd->link = g_queue_peek_tail_link(queue);
+	}
+
+	cmd->queue = queue;
+	g_hash_table_insert(attrib->command_ids, GUINT_TO_POINTER(cmd->id),
+									cmd);
+}
+
+static void command_unlink(struct _GAttrib *attrib, struct command *cmd)
+{
+	if (cmd->link == NULL)
+		return;
+
+	g_queue_delete_link(cmd->queue, cmd->link);
+	cmd->link = NULL;
+	cmd->queue = NULL;
+
+	if (g_hash_table_lookup(attrib->command_ids,
+					GUINT_TO_POINTER(cmd->id)) == cmd)
+		g_hash_table_remove(attrib->command_ids,
+						GUINT_TO_POINTER(cmd->id));
+}
+
+static struct command *command_lookup(struct _GAttrib *attrib, guint id)
+{
+	if (attrib->command_ids == NULL)
+		return NULL;
+
+	return g_hash_table_lookup(attrib->command_ids, GUINT_TO_POINTER(id));
+}
+
+static struct command *command_pop(struct _GAttrib *attrib, GQueue *queue)
+{
+	struct command *cmd = g_queue_peek_head(queue);
+
+	if (cmd)
+		command_unlink(attrib, cmd);
+
+	return cmd;
+}
+
+static void pool_free(struct _GAttrib *attrib)
+{
+	struct command *cmd;
+
+	while ((cmd = attrib->pool)) {
+		attrib->pool = cmd->next_free;
+		g_free(cmd);
+	}
+
+	attrib->pool_len = 0;
+}
+
 static void event_destroy(struct event *evt)
 {
 	if (evt->notify)
@@ -199,16 +445,130 @@ static void event_destroy(struct event *evt)
 	g_free(evt);
 }
 
+/*
+ * Every source of an attrib is attached to attrib->context, so each loop
+ * of a sharded application only ever sees its own connections.
+ */
+static guint attrib_add_source(struct _GAttrib *attrib, GSource *source,
+					GSourceFunc func, gpointer data,
+					GDestroyNotify notify)
+{
+	guint id;
+
+	g_source_set_callback(source, func, data, notify);
+	id = g_source_attach(source, attrib->context);
+	g_source_unref(source);
+
+	return id;
+}
+
+static guint attrib_add_watch(struct _GAttrib *attrib, GIOChannel *io,
+					GIOCondition cond, GIOFunc func,
+					gpointer data, GDestroyNotify notify)
+{
+	return attrib_add_source(attrib, g_io_create_watch(io, cond),
+					(GSourceFunc) func, data, notify);
+}
+
+static void attrib_remove_source(struct _GAttrib *attrib, guint id)
+{
+	GSource *source;
+
+	/* g_source_remove() would only look in the default context */
+	source = g_main_context_find_source_by_id(attrib->context, id);
+	if (source)
+		g_source_destroy(source);
+}
+
+static void latency_record(struct _GAttrib *attrib, guint8 opcode,
+				enum gattrib_latency stage, gint64 usec)
+{
+	struct latency *lat = attrib->latency[opcode];
+	int i;
+
+	if (lat == NULL) {
+		lat = g_new0(struct latency, 1);
+		for (i = 0; i < GATTRIB_LATENCY_STAGES; i++)
+			lat->stage[i] = histogram_new();
+
+		/* Readers on other threads must see it initialized */
+		__atomic_store_n(&attrib->latency[opcode], lat,
+							__ATOMIC_RELEASE);
+	}
+
+	if (lat->stage[stage])
+		histogram_record(lat->stage[stage], usec > 0 ? usec : 0);
+}
+
+static void latency_free(struct _GAttrib *attrib)
+{
+	int opcode, i;
+
+	for (opcode = 0; opcode < 256; opcode++) {
+		struct latency *lat = attrib->latency[opcode];
+
+		if (lat == NULL)
+			continue;
+
+		for (i = 0; i < GATTRIB_LATENCY_STAGES; i++)
+			histogram_free(lat->stage[i]);
+
+		g_free(lat);
+	}
+}
+
+static void submit_wait_done(struct submit_wait *wait, gboolean ret)
+{
+	if (wait == NULL)
+		return;
+
+	/* The waiter owns wait, it may be gone as soon as the lock drops */
+	g_mutex_lock(&wait->lock);
+	wait->ret = ret;
+	wait->done = true;
+	g_cond_signal(&wait->cond);
+	g_mutex_unlock(&wait->lock);
+}
+
+static void submissions_discard(struct _GAttrib *attrib)
+{
+	struct mpsc_node *node;
+
+	while ((node = mpsc_pop(&attrib->submissions))) {
+		struct submission *sub = mpsc_entry(node, struct submission,
+									node);
+
+		if (sub->op == SUBMIT_SEND) {
+			command_destroy(attrib, sub->data);
+			continue;
+		}
+
+		if (sub->op == SUBMIT_REGISTER)
+			event_destroy(sub->data);
+
+		if (sub->op == SUBMIT_CANCEL)
+			submit_wait_done(sub->data, FALSE);
+
+		g_free(sub);
+	}
+}
+
 static void attrib_destroy(GAttrib *attrib)
 {
-	GSList *l;
+	GHashTableIter iter;
+	gpointer value;
 	struct command *c;
 
-	while ((c = g_queue_pop_head(attrib->requests)))
-		command_destroy(c);
+	if (attrib->submit_watch > 0)
+		attrib_remove_source(attrib, attrib->submit_watch);
+
+	submissions_discard(attrib);
+
+	while ((c = command_pop(attrib, attrib->requests)))
+		command_destroy(attrib, c);
 
-	while ((c = g_queue_pop_head(attrib->responses)))
-		command_destroy(c);
+	while ((c = command_pop(attrib, attrib->responses)))
+		command_destroy(attrib, c);
 
 	g_queue_free(attrib->requests);
 	attrib->requests = NULL;
@@ -216,25 +576,43 @@ static void attrib_destroy(GAttrib *attrib)
 	g_queue_free(attrib->responses);
 	attrib->responses = NULL;
 
-	for (l = attrib->events; l; l = l->next)
-		event_destroy(l->data);
+	g_hash_table_destroy(attrib->command_ids);
+	attrib->command_ids = NULL;
 
-	g_slist_free(attrib->events);
-	attrib->events = NULL;
+	g_hash_table_iter_init(&iter, attrib->event_ids);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		event_destroy(value);
+
+	g_hash_table_destroy(attrib->event_ids);
+	attrib->event_ids = NULL;
+
+	g_hash_table_destroy(attrib->event_index);
+	attrib->event_index = NULL;
 
 	if (attrib->timeout_watch > 0)
-		g_source_remove(attrib->timeout_watch);
+		attrib_remove_source(attrib, attrib->timeout_watch);
 
 	if (attrib->write_watch > 0)
-		g_source_remove(attrib->write_watch);
+		attrib_remove_source(attrib, attrib->write_watch);
 
 	if (attrib->read_watch > 0)
-		g_source_remove(attrib->read_watch);
+		attrib_remove_source(attrib, attrib->read_watch);
 
 	if (attrib->io)
 		g_io_channel_unref(attrib->io);
 
-	g_free(attrib->buf);
+	pool_free(attrib);
+	g_mutex_clear(&attrib->pool_lock);
+
+	latency_free(attrib);
+
+	timer_wheel_unref(attrib->wheel);
+	g_main_context_unref(attrib->context);
+
+	if (attrib->submit_fd >= 0)
+		close(attrib->submit_fd);
+
+	g_free(attrib->rx);
 
 	if (attrib->destroy)
 		attrib->destroy(attrib->destroy_user_data);
@@ -286,19 +664,21 @@ static gboolean disconnect_timeout(gpointer data)
 
 	g_attrib_ref(attrib);
 
-	c = g_queue_pop_head(attrib->requests);
+	c = command_pop(attrib, attrib->requests);
 	if (c == NULL)
 		goto done;
 
+	attrib->timeouts++;
+
 	if (c->func)
 		c->func(ATT_ECODE_TIMEOUT, NULL, 0, c->user_data);
 
-	command_destroy(c);
+	command_destroy(attrib, c);
 
-	while ((c = g_queue_pop_head(attrib->requests))) {
+	while ((c = command_pop(attrib, attrib->requests))) {
 		if (c->func)
 			c->func(ATT_ECODE_ABORTED, NULL, 0, c->user_data);
-		command_destroy(c);
+		command_destroy(attrib, c);
 	}
 
 done:
@@ -309,63 +689,157 @@ done:
 	return FALSE;
 }
 
-static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
-								gpointer data)
+/*
+ * Gather the PDUs that may go out back to back: every queued response and
+ * the leading requests up to, and including, the first one that expects a
+ * response. Anything behind that request has to wait for its answer.
+ */
+static int collect_batch(struct _GAttrib *attrib, struct command **batch,
+							GQueue **queues)
 {
-	struct _GAttrib *attrib = data;
-	struct command *cmd;
+	GList *l;
+	int n = 0;
+
+	for (l = g_queue_peek_head_link(attrib->responses);
+					l && n < TX_BATCH; l = l->next) {
+		batch[n] = l->data;
+		queues[n++] = attrib->responses;
+	}
+
+	for (l = g_queue_peek_head_link(attrib->requests);
+					l && n < TX_BATCH; l = l->next) {
+		struct command *cmd = l->data;
+
+		/* Verify that we didn't already send this command */
+		if (cmd->sent)
+			break;
+
+		batch[n] = cmd;
+		queues[n++] = attrib->requests;
+
+		if (cmd->expected != 0)
+			break;
+	}
+
+	return n;
+}
+
+static int write_batch(GIOChannel *io, struct command **batch, int n)
+{
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iov[TX_BATCH];
 	GError *gerr = NULL;
-	gsize len;
 	GIOStatus iostat;
-	GQueue *queue;
-
-	if (attrib->stale)
-		return FALSE;
+	gsize len;
+	int i, sent;
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
-		return FALSE;
+	memset(msgs, 0, sizeof(msgs[0]) * n);
 
-	queue = attrib->responses;
-	cmd = g_queue_peek_head(queue);
-	if (cmd == NULL) {
-		queue = attrib->requests;
-		cmd = g_queue_peek_head(queue);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = batch[i]->pdu;
+		iov[i].iov_len = batch[i]->len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	if (cmd == NULL)
-		return FALSE;
 
-	/*
-	 * Verify that we didn't already send this command. This can only
-	 * happen with elementes from attrib->requests.
-	 */
-	if (cmd->sent)
-		return FALSE;
+	sent = sendmmsg(g_io_channel_unix_get_fd(io), msgs, n,
+					MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent >= 0 || (errno != ENOTSOCK && errno != ENOSYS))
+		return sent;
 
-	iostat = g_io_channel_write_chars(io, (char *) cmd->pdu, cmd->len,
-								&len, &gerr);
+	/* Not a socket, fall back to one PDU per wakeup */
+	iostat = g_io_channel_write_chars(io, (char *) batch[0]->pdu,
+						batch[0]->len, &len, &gerr);
 	if (iostat != G_IO_STATUS_NORMAL) {
 		if (gerr) {
 			error("%s", gerr->message);
 			g_error_free(gerr);
 		}
 
-		return FALSE;
+		errno = EIO;
+		return -1;
 	}
 
-	if (cmd->expected == 0) {
-		g_queue_pop_head(queue);
-		command_destroy(cmd);
+	return 1;
+}
 
-		return TRUE;
-	}
+static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
+								gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct command *batch[TX_BATCH];
+	GQueue *queues[TX_BATCH];
+	gint64 now;
+	int i, n, sent;
+
+	if (attrib->stale)
+		return FALSE;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		return FALSE;
 
-	cmd->sent = true;
+	for (;;) {
+		n = collect_batch(attrib, batch, queues);
+		if (n == 0)
+			return FALSE;
 
-	if (attrib->timeout_watch == 0)
-		attrib->timeout_watch = g_timeout_add_seconds(GATT_TIMEOUT,
-						disconnect_timeout, attrib);
+		sent = write_batch(io, batch, n);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+							errno == EINTR)
+				return TRUE;
 
-	return FALSE;
+			if (errno != EIO)
+				error("%s", strerror(errno));
+
+			return FALSE;
+		}
+
+		attrib->flushes++;
+		attrib->pdus_sent += sent;
+		now = g_get_monotonic_time();
+
+		DBG("%p: flushed %d/%d PDUs", attrib, sent, n);
+
+		/*
+		 * Unlink everything first, command_destroy() may run user
+		 * callbacks that queue more PDUs.
+		 */
+		for (i = 0; i < sent; i++) {
+			attrib->bytes_sent += batch[i]->len;
+			latency_record(attrib, batch[i]->opcode,
+					GATTRIB_LATENCY_QUEUE,
+					now - batch[i]->queued_at);
+			batch[i]->sent_at = now;
+
+			if (batch[i]->expected == 0) {
+				command_pop(attrib, queues[i]);
+				continue;
+			}
+
+			batch[i]->sent = true;
+			batch[i] = NULL;
+
+			if (attrib->timeout_watch == 0)
+				attrib->timeout_watch = attrib_add_source(
+					attrib,
+					g_timeout_source_new_seconds(
+								GATT_TIMEOUT),
+					disconnect_timeout, attrib, NULL);
+		}
+
+		for (i = 0; i < sent; i++) {
+			if (batch[i])
+				command_destroy(attrib, batch[i]);
+		}
+
+		/* Socket is full, resume on the next G_IO_OUT */
+		if (sent < n)
+			return TRUE;
+
+		if (attrib->stale)
+			return FALSE;
+	}
 }
 
 static void destroy_sender(gpointer data)
@@ -382,118 +856,284 @@ static void wake_up_sender(struct _GAttrib *attrib)
 		return;
 
 	attrib = g_attrib_ref(attrib);
-	attrib->write_watch = g_io_add_watch_full(attrib->io,
-				G_PRIORITY_DEFAULT, G_IO_OUT,
-				can_write_data, attrib, destroy_sender);
+	attrib->write_watch = attrib_add_watch(attrib, attrib->io, G_IO_OUT,
+					can_write_data, attrib, destroy_sender);
 }
 
-static bool match_event(struct event *evt, const uint8_t *pdu, gsize len)
+static GList *event_bucket_head(struct _GAttrib *attrib, guint8 opcode,
+							guint16 handle)
 {
-	guint16 handle;
+	GQueue *bucket;
 
-	if (is_request(pdu[0]) && evt->expected == GATTRIB_ALL_REQS)
-		return true;
+	bucket = g_hash_table_lookup(attrib->event_index,
+						EVENT_KEY(opcode, handle));
 
-	if (evt->expected == pdu[0] && evt->handle == GATTRIB_ALL_HANDLES)
-		return true;
+	return bucket ? g_queue_peek_head_link(bucket) : NULL;
+}
 
-	if (len < 3)
-		return false;
+static void dispatch_events(struct _GAttrib *attrib, const uint8_t *pdu,
+								gsize len)
+{
+	guint stack_ids[EVENT_BATCH], *ids = stack_ids;
+	guint i, n = 0, max = EVENT_BATCH;
+	GList *lists[3];
+	int j, nlists = 0;
+	guint16 handle;
 
-	handle = get_le16(&pdu[1]);
+	if (is_request(pdu[0]))
+		lists[nlists++] = event_bucket_head(attrib, GATTRIB_ALL_REQS, 0);
 
-	if (evt->expected == pdu[0] && evt->handle == handle)
-		return true;
+	lists[nlists++] = event_bucket_head(attrib, pdu[0],
+							GATTRIB_ALL_HANDLES);
 
-	return false;
-}
+	if (len >= 3) {
+		handle = get_le16(&pdu[1]);
+		if (handle != GATTRIB_ALL_HANDLES)
+			lists[nlists++] = event_bucket_head(attrib, pdu[0],
+								handle);
+	}
 
-static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
-{
-	struct _GAttrib *attrib = data;
-	struct command *cmd = NULL;
-	GSList *l;
-	uint8_t buf[512], status;
-	gsize len;
-	GIOStatus iostat;
+	/* Merge the buckets back into registration order */
+	for (;;) {
+		struct event *next = NULL;
+		int from = -1;
 
-	if (attrib->stale)
-		return FALSE;
+		for (j = 0; j < nlists; j++) {
+			struct event *evt;
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-		struct command *c;
+			if (lists[j] == NULL)
+				continue;
 
-		while ((c = g_queue_pop_head(attrib->requests))) {
-			if (c->func)
-				c->func(ATT_ECODE_IO, NULL, 0, c->user_data);
-			command_destroy(c);
+			evt = lists[j]->data;
+			if (next == NULL || evt->id < next->id) {
+				next = evt;
+				from = j;
+			}
 		}
 
-		attrib->read_watch = 0;
+		if (next == NULL)
+			break;
 
-		return FALSE;
-	}
+		lists[from] = lists[from]->next;
 
-	memset(buf, 0, sizeof(buf));
+		if (n == max) {
+			max *= 2;
+			if (ids == stack_ids) {
+				ids = g_new(guint, max);
+				memcpy(ids, stack_ids, sizeof(stack_ids));
+			} else
+				ids = g_renew(guint, ids, max);
+		}
 
-	iostat = g_io_channel_read_chars(io, (char *) buf, sizeof(buf),
-								&len, NULL);
-	if (iostat != G_IO_STATUS_NORMAL) {
-		status = ATT_ECODE_IO;
-		goto done;
+		ids[n++] = next->id;
 	}
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
+	/* Handlers may unregister events, so resolve each id just in time */
+	for (i = 0; i < n; i++) {
+		struct event *evt = g_hash_table_lookup(attrib->event_ids,
+						GUINT_TO_POINTER(ids[i]));
 
-		if (match_event(evt, buf, len))
-			evt->func(buf, len, evt->user_data);
+		if (evt)
+			evt->func(pdu, len, evt->user_data);
 	}
 
+	if (ids != stack_ids)
+		g_free(ids);
+}
+
+static void deadline_expired(struct wheel_timer *timer, void *user_data);
+
+/*
+ * A request sent again under the id of cmd, while its response was being
+ * handled (the next blob of a long read), inherits what is left of its
+ * deadline, so the deadline bounds the whole exchange.
+ */
+static void deadline_carry(struct _GAttrib *attrib, struct command *cmd)
+{
+	struct command *next;
+	guint64 now;
+	guint msec;
+
+	if (cmd->deadline.pprev == NULL)
+		return;
+
+	next = command_lookup(attrib, cmd->id);
+	if (next == NULL || next == cmd || next->queue != attrib->requests ||
+						next->deadline.pprev)
+		return;
+
+	now = g_get_monotonic_time() / 1000;
+	msec = cmd->deadline.expires > now ? cmd->deadline.expires - now : 1;
+
+	timer_wheel_add(attrib->wheel, &next->deadline, msec, deadline_expired,
+									attrib);
+}
+
+/* Returns false when the read watch should be dropped */
+static bool process_pdu(struct _GAttrib *attrib, const uint8_t *buf, gsize len)
+{
+	struct command *cmd;
+	uint8_t status;
+	gint64 now, done;
+
+	attrib->pdus_received++;
+	attrib->bytes_received += len;
+
+	dispatch_events(attrib, buf, len);
+
 	if (!is_response(buf[0]))
-		return TRUE;
+		return true;
 
 	if (attrib->timeout_watch > 0) {
-		g_source_remove(attrib->timeout_watch);
+		attrib_remove_source(attrib, attrib->timeout_watch);
 		attrib->timeout_watch = 0;
 	}
 
-	cmd = g_queue_pop_head(attrib->requests);
+	cmd = command_pop(attrib, attrib->requests);
 	if (cmd == NULL) {
 		/* Keep the watch if we have events to report */
-		return attrib->events != NULL;
-	}
-
-	if (buf[0] == ATT_OP_ERROR) {
-		status = buf[4];
-		goto done;
+		return g_hash_table_size(attrib->event_ids) > 0;
 	}
 
-	if (cmd->expected != buf[0]) {
+	if (buf[0] == ATT_OP_ERROR)
+		status = len > 4 ? buf[4] : ATT_ECODE_IO;
+	else if (cmd->expected != buf[0])
 		status = ATT_ECODE_IO;
-		goto done;
-	}
+	else
+		status = 0;
 
-	status = 0;
+	if (status)
+		attrib->errors++;
+
+	now = g_get_monotonic_time();
+	latency_record(attrib, cmd->opcode, GATTRIB_LATENCY_RESPONSE,
+							now - cmd->sent_at);
 
-done:
 	if (!g_queue_is_empty(attrib->requests) ||
 					!g_queue_is_empty(attrib->responses))
 		wake_up_sender(attrib);
 
-	if (cmd) {
-		if (cmd->func)
-			cmd->func(status, buf, len, cmd->user_data);
+	if (cmd->func) {
+		/* Sent again under this id from func, it goes first */
+		attrib->current_id = cmd->id;
+		cmd->func(status, buf, len, cmd->user_data);
+		attrib->current_id = 0;
+
+		done = g_get_monotonic_time();
+		latency_record(attrib, cmd->opcode, GATTRIB_LATENCY_CALLBACK,
+								done - now);
+		latency_record(attrib, cmd->opcode, GATTRIB_LATENCY_TOTAL,
+							done - cmd->queued_at);
+	}
+
+	deadline_carry(attrib, cmd);
+	command_destroy(attrib, cmd);
+
+	return true;
+}
+
+/*
+ * Fill the receive ring with every PDU queued on the socket. Returns the
+ * number of slots filled, 0 when nothing is pending and -1 on error.
+ */
+static int receive_batch(struct _GAttrib *attrib, GIOChannel *io)
+{
+	struct rx_ring *rx = attrib->rx;
+	GIOStatus iostat;
+	gsize len;
+	int n;
+
+	n = recvmmsg(g_io_channel_unix_get_fd(io), rx->msgs, RX_BATCH,
+							MSG_DONTWAIT, NULL);
+	if (n >= 0)
+		return n;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return 0;
+
+	if (errno != ENOTSOCK && errno != ENOSYS)
+		return -1;
+
+	/* Not a socket, fall back to one PDU per wakeup */
+	iostat = g_io_channel_read_chars(io, (char *) rx->slots[0],
+					RX_SLOT_SIZE, &len, NULL);
+	if (iostat != G_IO_STATUS_NORMAL)
+		return -1;
+
+	rx->msgs[0].msg_len = len;
+
+	return 1;
+}
+
+static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct rx_ring *rx = attrib->rx;
+	gboolean keep = TRUE;
+	int i, n;
+
+	if (attrib->stale)
+		return FALSE;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		struct command *c;
+
+		while ((c = command_pop(attrib, attrib->requests))) {
+			if (c->func)
+				c->func(ATT_ECODE_IO, NULL, 0, c->user_data);
+			command_destroy(attrib, c);
+		}
 
-		command_destroy(cmd);
+		attrib->read_watch = 0;
+
+		return FALSE;
 	}
 
-	return TRUE;
+	/* Callbacks may drop the last external reference */
+	g_attrib_ref(attrib);
+
+	do {
+		n = receive_batch(attrib, io);
+		if (n < 0) {
+			if (!g_queue_is_empty(attrib->requests) ||
+					!g_queue_is_empty(attrib->responses))
+				wake_up_sender(attrib);
+			break;
+		}
+
+		for (i = 0; i < n && keep; i++) {
+			if (rx->msgs[i].msg_len == 0)
+				continue;
+
+			keep = process_pdu(attrib, rx->slots[i],
+							rx->msgs[i].msg_len);
+
+			if (attrib->stale || attrib->read_watch == 0)
+				keep = FALSE;
+		}
+	} while (keep && n == RX_BATCH);
+
+	if (!keep)
+		attrib->read_watch = 0;
+
+	g_attrib_unref(attrib);
+
+	return keep;
 }
 
+static gboolean submissions_ready(GIOChannel *io, GIOCondition cond,
+							gpointer data);
+
 GAttrib *g_attrib_new(GIOChannel *io, guint16 mtu)
+{
+	return g_attrib_new_full(io, mtu, NULL);
+}
+
+/* All I/O and timers of the attrib run on context, NULL is the default */
+GAttrib *g_attrib_new_full(GIOChannel *io, guint16 mtu, GMainContext *context)
 {
 	struct _GAttrib *attrib;
+	int i;
 
 	g_io_channel_set_encoding(io, NULL, NULL);
 	g_io_channel_set_buffered(io, FALSE);
@@ -502,119 +1142,354 @@ GAttrib *g_attrib_new(GIOChannel *io, guint16 mtu)
 	if (attrib == NULL)
 		return NULL;
 
-	attrib->buf = g_malloc0(mtu);
 	attrib->buflen = mtu;
 
+	g_mutex_init(&attrib->pool_lock);
+	if (context == NULL)
+		context = g_main_context_default();
+
+	attrib->context = g_main_context_ref(context);
+	attrib->wheel = timer_wheel_get(attrib->context);
+
+	mpsc_init(&attrib->submissions);
+	attrib->submit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (attrib->submit_fd >= 0) {
+		GIOChannel *submit_io = g_io_channel_unix_new(attrib->submit_fd);
+
+		attrib->submit_watch = attrib_add_watch(attrib, submit_io,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				submissions_ready, attrib, NULL);
+		g_io_channel_unref(submit_io);
+	} else
+		warn("%s: eventfd: %s", __func__, strerror(errno));
+
+	attrib->rx = g_new0(struct rx_ring, 1);
+	for (i = 0; i < RX_BATCH; i++) {
+		attrib->rx->iov[i].iov_base = attrib->rx->slots[i];
+		attrib->rx->iov[i].iov_len = RX_SLOT_SIZE;
+		attrib->rx->msgs[i].msg_hdr.msg_iov = &attrib->rx->iov[i];
+		attrib->rx->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
 	attrib->io = g_io_channel_ref(io);
 	attrib->requests = g_queue_new();
 	attrib->responses = g_queue_new();
+	attrib->event_index = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL,
+				(GDestroyNotify) g_queue_free);
+	attrib->event_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	attrib->command_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-	attrib->read_watch = g_io_add_watch(attrib->io,
+	attrib->read_watch = attrib_add_watch(attrib, attrib->io,
 			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			received_data, attrib);
+			received_data, attrib, NULL);
 
 	return g_attrib_ref(attrib);
 }
 
+static void command_queue(struct _GAttrib *attrib, struct command *c,
+							bool given_id)
+{
+	GQueue *queue;
+
+	if (is_response(c->opcode))
+		queue = attrib->responses;
+	else
+		queue = attrib->requests;
+
+	/* Don't re-order responses even if an ID is given */
+	command_enqueue(attrib, queue, c, given_id && !is_response(c->opcode));
+
+	/*
+	 * If a command was added to the queue and it was empty before, wake up
+	 * the sender. If the sender was already woken up by the second queue,
+	 * wake_up_sender will just return.
+	 */
+	if (g_queue_get_length(queue) == 1)
+		wake_up_sender(attrib);
+}
+
+/*
+ * The owner of attrib->context is the only thread touching the queues and
+ * the event index. Any other thread gets its call replayed there instead.
+ */
+static bool on_loop_thread(struct _GAttrib *attrib)
+{
+	return g_main_context_is_owner(attrib->context);
+}
+
+static void submit(struct _GAttrib *attrib, struct submission *sub)
+{
+	uint64_t one = 1;
+
+	mpsc_push(&attrib->submissions, &sub->node);
+
+	/* Only the first producer since the last drain pays for the wakeup */
+	if (__atomic_exchange_n(&attrib->submit_pending, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if (write(attrib->submit_fd, &one, sizeof(one)) < 0)
+		warn("%s: %s", __func__, strerror(errno));
+}
+
+static bool submit_op(struct _GAttrib *attrib, enum submit_op op, guint id,
+					guint msec, gpointer data,
+					GAttribMatchFunc match)
+{
+	struct submission *sub;
+
+	if (attrib->submit_fd < 0)
+		return false;
+
+	sub = g_try_new0(struct submission, 1);
+	if (sub == NULL)
+		return false;
+
+	sub->op = op;
+	sub->id = id;
+	sub->msec = msec;
+	sub->data = data;
+	sub->match = match;
+
+	submit(attrib, sub);
+
+	return true;
+}
+
 guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 			GAttribResultFunc func, gpointer user_data,
 			GDestroyNotify notify)
 {
 	struct command *c;
-	GQueue *queue;
-	uint8_t opcode;
+	guint cmd_id;
+	bool local;
 
 	if (attrib->stale)
 		return 0;
 
-	c = g_try_new0(struct command, 1);
-	if (c == NULL)
+	local = on_loop_thread(attrib);
+	if (!local && attrib->submit_fd < 0)
 		return 0;
 
-	opcode = pdu[0];
+	c = command_new(attrib, len);
+	if (c == NULL)
+		return 0;
 
-	c->opcode = opcode;
-	c->expected = opcode2expected(opcode);
-	c->pdu = g_malloc(len);
+	c->opcode = pdu[0];
+	c->expected = opcode2expected(c->opcode);
 	memcpy(c->pdu, pdu, len);
 	c->len = len;
 	c->func = func;
 	c->user_data = user_data;
 	c->notify = notify;
+	c->id = id ? id : __sync_add_and_fetch(&attrib->next_cmd_id, 1);
+	c->queued_at = g_get_monotonic_time();
 
-	if (is_response(opcode))
-		queue = attrib->responses;
-	else
-		queue = attrib->requests;
+	/* c belongs to the loop once queued, it may be gone on return */
+	cmd_id = c->id;
 
-	if (id) {
-		c->id = id;
-		if (!is_response(opcode))
-			g_queue_push_head(queue, c);
-		else
-			/* Don't re-order responses even if an ID is given */
-			g_queue_push_tail(queue, c);
-	} else {
-		c->id = ++attrib->next_cmd_id;
-		g_queue_push_tail(queue, c);
+	if (local) {
+		command_queue(attrib, c, id != 0 && id == attrib->current_id);
+		return cmd_id;
 	}
 
-	/*
-	 * If a command was added to the queue and it was empty before, wake up
-	 * the sender. If the sender was already woken up by the second queue,
-	 * wake_up_sender will just return.
-	 */
-	if (g_queue_get_length(queue) == 1)
-		wake_up_sender(attrib);
+	/* The command itself is the queue node, nothing else to allocate */
+	c->submit.op = SUBMIT_SEND;
+	c->submit.id = id;
+	c->submit.data = c;
+	submit(attrib, &c->submit);
 
-	return c->id;
+	return cmd_id;
 }
 
-static int command_cmp_by_id(gconstpointer a, gconstpointer b)
+/*
+ * An id for a request not sent yet, so the caller knows it before the
+ * first PDU can be answered. Only requests sent again under an id from
+ * the callback of its previous one jump the queue.
+ */
+guint g_attrib_reserve_id(GAttrib *attrib)
+{
+	return __sync_add_and_fetch(&attrib->next_cmd_id, 1);
+}
+
+static gboolean cancel_command(struct _GAttrib *attrib, guint id)
 {
-	const struct command *cmd = a;
-	guint id = GPOINTER_TO_UINT(b);
+	struct command *cmd;
 
-	return cmd->id - id;
+	cmd = command_lookup(attrib, id);
+	if (cmd == NULL)
+		return FALSE;
+
+	if (cmd == g_queue_peek_head(cmd->queue) && cmd->sent)
+		cmd->func = NULL;
+	else {
+		command_unlink(attrib, cmd);
+		command_destroy(attrib, cmd);
+	}
+
+	return TRUE;
 }
 
+/*
+ * Off the loop thread, waits for the loop to apply the cancel: once this
+ * returns, the callback of id is not running and will not run, so its
+ * user_data may be released. The caller must not hold anything the loop
+ * callbacks wait for.
+ */
 gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 {
-	GList *l = NULL;
-	struct command *cmd;
-	GQueue *queue;
+	struct submit_wait wait;
 
 	if (attrib == NULL)
 		return FALSE;
 
-	queue = attrib->requests;
-	if (queue)
-		l = g_queue_find_custom(queue, GUINT_TO_POINTER(id),
-					command_cmp_by_id);
-	if (l == NULL) {
-		queue = attrib->responses;
-		if (!queue)
-			return FALSE;
-		l = g_queue_find_custom(queue, GUINT_TO_POINTER(id),
-					command_cmp_by_id);
+	if (on_loop_thread(attrib))
+		return cancel_command(attrib, id);
+
+	g_mutex_init(&wait.lock);
+	g_cond_init(&wait.cond);
+	wait.done = false;
+	wait.ret = FALSE;
+
+	if (submit_op(attrib, SUBMIT_CANCEL, id, 0, &wait, NULL)) {
+		g_mutex_lock(&wait.lock);
+		while (!wait.done)
+			g_cond_wait(&wait.cond, &wait.lock);
+		g_mutex_unlock(&wait.lock);
 	}
 
-	if (l == NULL)
-		return FALSE;
+	g_mutex_clear(&wait.lock);
+	g_cond_clear(&wait.cond);
+
+	return wait.ret;
+}
+
+static struct command *unlink_matching(struct _GAttrib *attrib,
+					GQueue *queue, GAttribMatchFunc match,
+					gpointer match_data,
+					struct command *cancelled)
+{
+	GList *l, *next;
+
+	for (l = g_queue_peek_head_link(queue); l; l = next) {
+		struct command *cmd = l->data;
+
+		next = l->next;
+
+		if (!match(cmd->id, cmd->opcode, cmd->user_data, match_data))
+			continue;
+
+		if (l == g_queue_peek_head_link(queue) && cmd->sent) {
+			cmd->func = NULL;
+			continue;
+		}
+
+		/* Not queued any more, so next_free is ours to chain with */
+		command_unlink(attrib, cmd);
+		cmd->next_free = cancelled;
+		cancelled = cmd;
+	}
+
+	return cancelled;
+}
+
+static guint cancel_matching(struct _GAttrib *attrib, GAttribMatchFunc match,
+							gpointer match_data)
+{
+	struct command *cancelled = NULL, *cmd;
+	guint count = 0;
+
+	cancelled = unlink_matching(attrib, attrib->requests, match,
+						match_data, cancelled);
+	cancelled = unlink_matching(attrib, attrib->responses, match,
+						match_data, cancelled);
+
+	/* Destroy only once the queues are consistent, notify may requeue */
+	while ((cmd = cancelled)) {
+		cancelled = cmd->next_free;
+		command_destroy(attrib, cmd);
+		count++;
+	}
 
-	cmd = l->data;
+	return count;
+}
+
+/*
+ * Off the loop thread the match runs later on the loop, so 0 is returned
+ * and match_data must stay valid until then.
+ */
+guint g_attrib_cancel_matching(GAttrib *attrib, GAttribMatchFunc match,
+							gpointer match_data)
+{
+	if (attrib == NULL || attrib->requests == NULL)
+		return 0;
+
+	if (!on_loop_thread(attrib)) {
+		submit_op(attrib, SUBMIT_CANCEL_MATCHING, 0, 0, match_data,
+									match);
+		return 0;
+	}
 
-	if (cmd == g_queue_peek_head(queue) && cmd->sent)
+	return cancel_matching(attrib, match, match_data);
+}
+
+static void deadline_expired(struct wheel_timer *timer, void *user_data)
+{
+	struct _GAttrib *attrib = user_data;
+	struct command *cmd = (struct command *) ((char *) timer -
+					offsetof(struct command, deadline));
+	GAttribResultFunc func = cmd->func;
+
+	attrib->timeouts++;
+
+	/*
+	 * A request already on the air keeps its place at the head so the
+	 * late response is consumed and dropped, like g_attrib_cancel() does.
+	 * Only GATT_TIMEOUT decides that the bearer itself is dead.
+	 */
+	if (cmd->sent)
 		cmd->func = NULL;
-	else {
-		g_queue_remove(queue, cmd);
-		command_destroy(cmd);
+	else
+		command_unlink(attrib, cmd);
+
+	if (func)
+		func(ATT_ECODE_TIMEOUT, NULL, 0, cmd->user_data);
+
+	if (!cmd->sent)
+		command_destroy(attrib, cmd);
+}
+
+static gboolean set_deadline(struct _GAttrib *attrib, guint id, guint msec)
+{
+	struct command *cmd;
+
+	cmd = command_lookup(attrib, id);
+	if (cmd == NULL || cmd->queue != attrib->requests)
+		return FALSE;
+
+	if (msec == 0) {
+		timer_wheel_del(attrib->wheel, &cmd->deadline);
+		return TRUE;
 	}
 
+	timer_wheel_add(attrib->wheel, &cmd->deadline, msec, deadline_expired,
+									attrib);
+
 	return TRUE;
 }
 
-static gboolean cancel_all_per_queue(GQueue *queue)
+gboolean g_attrib_set_deadline(GAttrib *attrib, guint id, guint msec)
+{
+	if (attrib == NULL)
+		return FALSE;
+
+	if (!on_loop_thread(attrib))
+		return submit_op(attrib, SUBMIT_DEADLINE, id, msec, NULL, NULL);
+
+	return set_deadline(attrib, id, msec);
+}
+
+static gboolean cancel_all_per_queue(struct _GAttrib *attrib, GQueue *queue)
 {
 	struct command *c, *head = NULL;
 	gboolean first = TRUE;
@@ -622,7 +1497,7 @@ static gboolean cancel_all_per_queue(GQueue *queue)
 	if (queue == NULL)
 		return FALSE;
 
-	while ((c = g_queue_pop_head(queue))) {
+	while ((c = command_pop(attrib, queue))) {
 		if (first && c->sent) {
 			/* If the command was sent ignore its callback ... */
 			c->func = NULL;
@@ -631,12 +1506,12 @@ static gboolean cancel_all_per_queue(GQueue *queue)
 		}
 
 		first = FALSE;
-		command_destroy(c);
+		command_destroy(attrib, c);
 	}
 
 	if (head) {
 		/* ... and put it back in the queue */
-		g_queue_push_head(queue, head);
+		command_enqueue(attrib, queue, head, true);
 	}
 
 	return TRUE;
@@ -649,20 +1524,78 @@ gboolean g_attrib_cancel_all(GAttrib *attrib)
 	if (attrib == NULL)
 		return FALSE;
 
-	ret = cancel_all_per_queue(attrib->requests);
-	ret = cancel_all_per_queue(attrib->responses) && ret;
+	if (!on_loop_thread(attrib))
+		return submit_op(attrib, SUBMIT_CANCEL_ALL, 0, 0, NULL, NULL);
+
+	ret = cancel_all_per_queue(attrib, attrib->requests);
+	ret = cancel_all_per_queue(attrib, attrib->responses) && ret;
 
 	return ret;
 }
 
+/*
+ * Counters are only written by the loop thread. Reading them from another
+ * thread gives a snapshot that may be a few PDUs behind, never torn.
+ */
+gboolean g_attrib_get_stats(GAttrib *attrib, struct gattrib_stats *stats)
+{
+	if (attrib == NULL || stats == NULL)
+		return FALSE;
+
+	stats->pdus_sent = attrib->pdus_sent;
+	stats->pdus_received = attrib->pdus_received;
+	stats->bytes_sent = attrib->bytes_sent;
+	stats->bytes_received = attrib->bytes_received;
+	stats->flushes = attrib->flushes;
+	stats->errors = attrib->errors;
+	stats->timeouts = attrib->timeouts;
+	stats->requests_queued = g_queue_get_length(attrib->requests);
+	stats->responses_queued = g_queue_get_length(attrib->responses);
+
+	g_mutex_lock(&attrib->pool_lock);
+	stats->pool_allocs = attrib->pool_allocs;
+	stats->pool_reuses = attrib->pool_reuses;
+	g_mutex_unlock(&attrib->pool_lock);
+
+	return TRUE;
+}
+
+const struct histogram *g_attrib_get_latency(GAttrib *attrib, guint8 opcode,
+						enum gattrib_latency stage)
+{
+	struct latency *lat;
+
+	if (attrib == NULL || stage >= GATTRIB_LATENCY_STAGES)
+		return NULL;
+
+	lat = __atomic_load_n(&attrib->latency[opcode], __ATOMIC_ACQUIRE);
+	if (lat == NULL)
+		return NULL;
+
+	return lat->stage[stage];
+}
+
+/*
+ * Callers encode into this buffer before g_attrib_send(), which copies the
+ * PDU. It is per thread so concurrent producers never share one.
+ */
 uint8_t *g_attrib_get_buffer(GAttrib *attrib, size_t *len)
 {
+	struct thread_buf *buf;
+
 	if (len == NULL)
 		return NULL;
 
 	*len = attrib->buflen;
 
-	return attrib->buf;
+	buf = g_private_get(&thread_buf);
+	if (buf == NULL || buf->size < *len) {
+		buf = g_malloc0(sizeof(*buf) + *len);
+		buf->size = *len;
+		g_private_replace(&thread_buf, buf);
+	}
+
+	return buf->data;
 }
 
 gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
@@ -670,13 +1603,34 @@ gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
 	if (mtu < ATT_DEFAULT_LE_MTU)
 		return FALSE;
 
-	attrib->buf = g_realloc(attrib->buf, mtu);
-
 	attrib->buflen = mtu;
 
+	g_mutex_lock(&attrib->pool_lock);
+	if (attrib->pool && attrib->pool->size < mtu)
+		pool_free(attrib);
+	g_mutex_unlock(&attrib->pool_lock);
+
 	return TRUE;
 }
 
+static void event_insert(struct _GAttrib *attrib, struct event *event)
+{
+	gpointer key = EVENT_KEY(event->expected, event->handle);
+	GQueue *bucket;
+
+	bucket = g_hash_table_lookup(attrib->event_index, key);
+	if (bucket == NULL) {
+		bucket = g_queue_new();
+		g_hash_table_insert(attrib->event_index, key, bucket);
+	}
+
+	g_queue_push_tail(bucket, event);
+	event->link = g_queue_peek_tail_link(bucket);
+
+	g_hash_table_insert(attrib->event_ids, GUINT_TO_POINTER(event->id),
+									event);
+}
+
 guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 				GAttribNotifyFunc func, gpointer user_data,
 				GDestroyNotify notify)
@@ -688,71 +1642,170 @@ guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 	if (event == NULL)
 		return 0;
 
+	/* Request wildcards ignore the handle */
+	if (opcode == GATTRIB_ALL_REQS)
+		handle = GATTRIB_ALL_HANDLES;
+
 	event->expected = opcode;
 	event->handle = handle;
 	event->func = func;
 	event->user_data = user_data;
 	event->notify = notify;
-	event->id = ++next_evt_id;
+	event->id = __sync_add_and_fetch(&next_evt_id, 1);
 
-	attrib->events = g_slist_append(attrib->events, event);
+	if (on_loop_thread(attrib))
+		event_insert(attrib, event);
+	else if (!submit_op(attrib, SUBMIT_REGISTER, event->id, 0, event,
+									NULL)) {
+		g_free(event);
+		return 0;
+	}
 
 	return event->id;
 }
 
-static int event_cmp_by_id(gconstpointer a, gconstpointer b)
+static void event_unlink(struct _GAttrib *attrib, struct event *evt)
 {
-	const struct event *evt = a;
-	guint id = GPOINTER_TO_UINT(b);
+	gpointer key = EVENT_KEY(evt->expected, evt->handle);
+	GQueue *bucket;
 
-	return evt->id - id;
+	bucket = g_hash_table_lookup(attrib->event_index, key);
+	if (bucket == NULL)
+		return;
+
+	g_queue_delete_link(bucket, evt->link);
+
+	if (g_queue_is_empty(bucket))
+		g_hash_table_remove(attrib->event_index, key);
 }
 
-gboolean g_attrib_unregister(GAttrib *attrib, guint id)
+static gboolean event_remove(struct _GAttrib *attrib, guint id)
 {
 	struct event *evt;
-	GSList *l;
 
+	evt = g_hash_table_lookup(attrib->event_ids, GUINT_TO_POINTER(id));
+	if (evt == NULL)
+		return FALSE;
+
+	g_hash_table_remove(attrib->event_ids, GUINT_TO_POINTER(id));
+	event_unlink(attrib, evt);
+
+	event_destroy(evt);
+
+	return TRUE;
+}
+
+gboolean g_attrib_unregister(GAttrib *attrib, guint id)
+{
 	if (id == 0) {
 		warn("%s: invalid id", __func__);
 		return FALSE;
 	}
 
-	l = g_slist_find_custom(attrib->events, GUINT_TO_POINTER(id),
-							event_cmp_by_id);
-	if (l == NULL)
-		return FALSE;
+	if (!on_loop_thread(attrib))
+		return submit_op(attrib, SUBMIT_UNREGISTER, id, 0, NULL, NULL);
 
-	evt = l->data;
+	return event_remove(attrib, id);
+}
 
-	attrib->events = g_slist_remove(attrib->events, evt);
+static gboolean events_clear(struct _GAttrib *attrib)
+{
+	GHashTableIter iter;
+	gpointer value;
 
-	if (evt->notify)
-		evt->notify(evt->user_data);
+	if (g_hash_table_size(attrib->event_ids) == 0)
+		return FALSE;
 
-	g_free(evt);
+	g_hash_table_iter_init(&iter, attrib->event_ids);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		event_destroy(value);
+
+	g_hash_table_remove_all(attrib->event_ids);
+	g_hash_table_remove_all(attrib->event_index);
 
 	return TRUE;
 }
 
 gboolean g_attrib_unregister_all(GAttrib *attrib)
 {
-	GSList *l;
+	if (!on_loop_thread(attrib))
+		return submit_op(attrib, SUBMIT_UNREGISTER_ALL, 0, 0, NULL,
+									NULL);
 
-	if (attrib->events == NULL)
-		return FALSE;
+	return events_clear(attrib);
+}
+
+static void run_submission(struct _GAttrib *attrib, struct submission *sub)
+{
+	struct command *cmd;
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
+	switch (sub->op) {
+	case SUBMIT_SEND:
+		cmd = sub->data;
 
-		if (evt->notify)
-			evt->notify(evt->user_data);
+		if (!attrib->stale) {
+			command_queue(attrib, cmd, false);
+			return;
+		}
+
+		/* The caller already has an id, so fail it through func */
+		if (cmd->func)
+			cmd->func(ATT_ECODE_ABORTED, NULL, 0, cmd->user_data);
 
-		g_free(evt);
+		command_destroy(attrib, cmd);
+		return;
+	case SUBMIT_CANCEL:
+		submit_wait_done(sub->data, cancel_command(attrib, sub->id));
+		break;
+	case SUBMIT_CANCEL_ALL:
+		g_attrib_cancel_all(attrib);
+		break;
+	case SUBMIT_CANCEL_MATCHING:
+		cancel_matching(attrib, sub->match, sub->data);
+		break;
+	case SUBMIT_DEADLINE:
+		set_deadline(attrib, sub->id, sub->msec);
+		break;
+	case SUBMIT_REGISTER:
+		event_insert(attrib, sub->data);
+		break;
+	case SUBMIT_UNREGISTER:
+		event_remove(attrib, sub->id);
+		break;
+	case SUBMIT_UNREGISTER_ALL:
+		events_clear(attrib);
+		break;
 	}
 
-	g_slist_free(attrib->events);
-	attrib->events = NULL;
+	g_free(sub);
+}
+
+static gboolean submissions_ready(GIOChannel *io, GIOCondition cond,
+								gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct mpsc_node *node;
+	uint64_t count;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		attrib->submit_watch = 0;
+		return FALSE;
+	}
+
+	if (read(attrib->submit_fd, &count, sizeof(count)) < 0 &&
+							errno != EAGAIN)
+		warn("%s: %s", __func__, strerror(errno));
+
+	/* Re-arm first, a producer racing with the drain signals again */
+	__atomic_store_n(&attrib->submit_pending, 0, __ATOMIC_SEQ_CST);
+
+	g_attrib_ref(attrib);
+
+	while ((node = mpsc_pop(&attrib->submissions)))
+		run_submission(attrib, mpsc_entry(node, struct submission,
+									node));
+
+	g_attrib_unref(attrib);
 
 	return TRUE;
 }
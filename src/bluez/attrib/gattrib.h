@@ -34,14 +34,43 @@ extern "C" {
 struct _GAttrib;
 typedef struct _GAttrib GAttrib;
 
+struct histogram;
+
+struct gattrib_stats {
+	guint64 pdus_sent;
+	guint64 pdus_received;
+	guint64 bytes_sent;
+	guint64 bytes_received;
+	guint64 flushes;		/* sender wakeups that wrote PDUs */
+	guint64 errors;			/* requests answered with an error */
+	guint64 timeouts;		/* deadlines and GATT_TIMEOUT */
+	guint64 pool_allocs;		/* commands taken from the heap ... */
+	guint64 pool_reuses;		/* ... versus recycled from the pool */
+	guint requests_queued;
+	guint responses_queued;
+};
+
+/* Stages of a request, each with its own histogram per opcode */
+enum gattrib_latency {
+	GATTRIB_LATENCY_QUEUE,		/* g_attrib_send() to written */
+	GATTRIB_LATENCY_RESPONSE,	/* written to response received */
+	GATTRIB_LATENCY_CALLBACK,	/* time spent in the result callback */
+	GATTRIB_LATENCY_TOTAL,		/* g_attrib_send() to callback done */
+	GATTRIB_LATENCY_STAGES
+};
+
 typedef void (*GAttribResultFunc) (guint8 status, const guint8 *pdu,
 					guint16 len, gpointer user_data);
 typedef void (*GAttribDisconnectFunc)(gpointer user_data);
 typedef void (*GAttribDebugFunc)(const char *str, gpointer user_data);
 typedef void (*GAttribNotifyFunc)(const guint8 *pdu, guint16 len,
 							gpointer user_data);
+typedef gboolean (*GAttribMatchFunc)(guint id, guint8 opcode,
+					gpointer user_data, gpointer match_data);
 
 GAttrib *g_attrib_new(GIOChannel *io, guint16 mtu);
+GAttrib *g_attrib_new_full(GIOChannel *io, guint16 mtu,
+						GMainContext *context);
 GAttrib *g_attrib_ref(GAttrib *attrib);
 void g_attrib_unref(GAttrib *attrib);
 
@@ -54,13 +83,33 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 			GAttribResultFunc func, gpointer user_data,
 			GDestroyNotify notify);
 
+guint g_attrib_reserve_id(GAttrib *attrib);
 gboolean g_attrib_cancel(GAttrib *attrib, guint id);
+
+/*
+ * Fail the queued request id with ATT_ECODE_TIMEOUT unless it completes
+ * within msec milliseconds (0 clears the deadline), set right after
+ * g_attrib_send(). Unlike GATT_TIMEOUT this does not mark the attrib
+ * stale. A request already sent still holds the head of the queue until
+ * its answer, only GATT_TIMEOUT gives up on one that never comes.
+ */
+gboolean g_attrib_set_deadline(GAttrib *attrib, guint id, guint msec);
 gboolean g_attrib_cancel_all(GAttrib *attrib);
 
+/* Cancel every queued command for which match returns TRUE */
+guint g_attrib_cancel_matching(GAttrib *attrib, GAttribMatchFunc match,
+							gpointer match_data);
+
 guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 				GAttribNotifyFunc func, gpointer user_data,
 				GDestroyNotify notify);
 
+gboolean g_attrib_get_stats(GAttrib *attrib, struct gattrib_stats *stats);
+
+/* Latency in microseconds, NULL until the opcode got its first sample */
+const struct histogram *g_attrib_get_latency(GAttrib *attrib, guint8 opcode,
+						enum gattrib_latency stage);
+
 uint8_t *g_attrib_get_buffer(GAttrib *attrib, size_t *len);
 gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu);
 
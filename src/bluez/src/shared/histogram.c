@@ -0,0 +1,156 @@
+/*
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#include "src/shared/histogram.h"
+
+#define SUB_BITS	4
+#define SUB_COUNT	(1 << SUB_BITS)
+#define VALUE_BITS	32
+#define VALUE_MAX	((1ULL << VALUE_BITS) - 1)
+#define BUCKETS		((VALUE_BITS - SUB_BITS + 1) * SUB_COUNT)
+
+struct histogram {
+	guint64 count;
+	guint64 sum;
+	guint64 min;
+	guint64 max;
+	guint32 counts[BUCKETS];
+};
+
+/*
+ * Values below SUB_COUNT map one to one. Above, the position of the most
+ * significant bit picks the group and the SUB_BITS below it the bucket.
+ */
+static unsigned int bucket_index(guint64 value)
+{
+	unsigned int shift;
+
+	if (value < SUB_COUNT)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - SUB_BITS;
+
+	return (shift + 1) * SUB_COUNT + (value >> shift) - SUB_COUNT;
+}
+
+static guint64 bucket_highest(unsigned int index)
+{
+	unsigned int shift;
+	guint64 sub;
+
+	if (index < SUB_COUNT)
+		return index;
+
+	shift = index / SUB_COUNT - 1;
+	sub = index % SUB_COUNT + SUB_COUNT;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+struct histogram *histogram_new(void)
+{
+	struct histogram *hist;
+
+	hist = g_try_new0(struct histogram, 1);
+	if (hist == NULL)
+		return NULL;
+
+	hist->min = VALUE_MAX;
+
+	return hist;
+}
+
+void histogram_free(struct histogram *hist)
+{
+	g_free(hist);
+}
+
+void histogram_record(struct histogram *hist, guint64 value)
+{
+	if (value > VALUE_MAX)
+		value = VALUE_MAX;
+
+	hist->counts[bucket_index(value)]++;
+	hist->count++;
+	hist->sum += value;
+
+	if (value < hist->min)
+		hist->min = value;
+
+	if (value > hist->max)
+		hist->max = value;
+}
+
+void histogram_reset(struct histogram *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = VALUE_MAX;
+}
+
+guint64 histogram_count(const struct histogram *hist)
+{
+	return hist->count;
+}
+
+guint64 histogram_min(const struct histogram *hist)
+{
+	return hist->count ? hist->min : 0;
+}
+
+guint64 histogram_max(const struct histogram *hist)
+{
+	return hist->max;
+}
+
+double histogram_mean(const struct histogram *hist)
+{
+	return hist->count ? (double) hist->sum / hist->count : 0;
+}
+
+guint64 histogram_percentile(const struct histogram *hist, double percentile)
+{
+	guint64 rank, seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	if (percentile >= 100)
+		return hist->max;
+
+	rank = (guint64) (percentile / 100 * hist->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank)
+			break;
+	}
+
+	/* Never report more than was actually seen */
+	return MIN(bucket_highest(i), hist->max);
+}
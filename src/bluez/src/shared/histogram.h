@@ -0,0 +1,47 @@
+/*
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#include <glib.h>
+
+/*
+ * HDR-style log-linear histogram: every power of two is split in 16
+ * linear sub-buckets, so any recorded value is known within 1/16 (about
+ * 6%). Values are unitless, up to 2^32 - 1; larger ones are clamped.
+ * Recording is a few instructions and never allocates.
+ */
+
+struct histogram;
+
+struct histogram *histogram_new(void);
+void histogram_free(struct histogram *hist);
+
+void histogram_record(struct histogram *hist, guint64 value);
+void histogram_reset(struct histogram *hist);
+
+guint64 histogram_count(const struct histogram *hist);
+guint64 histogram_min(const struct histogram *hist);
+guint64 histogram_max(const struct histogram *hist);
+double histogram_mean(const struct histogram *hist);
+
+/* Highest value equivalent to the given percentile, 0 to 100 */
+guint64 histogram_percentile(const struct histogram *hist, double percentile);
+
+#endif
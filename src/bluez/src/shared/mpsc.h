@@ -0,0 +1,96 @@
+/*
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __MPSC_H
+#define __MPSC_H
+
+#include <stddef.h>
+
+/*
+ * Intrusive multi-producer single-consumer queue (Vyukov). Producers
+ * never block each other: a push is one atomic exchange plus a store.
+ * Order is FIFO per producer. mpsc_pop() may return NULL while a push is
+ * halfway done; the producer is expected to signal the consumer after
+ * mpsc_push() returns, so the consumer simply tries again then.
+ */
+
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+	struct mpsc_node *head;		/* Last pushed, shared by producers */
+	struct mpsc_node *tail;		/* Next to pop, consumer only */
+	struct mpsc_node stub;
+};
+
+static inline void mpsc_init(struct mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static inline void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node)
+{
+	struct mpsc_node *prev;
+
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+static inline struct mpsc_node *mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return NULL;
+
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	/* A producer swapped head but has not linked its node yet */
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* tail is the last node, put the stub behind it so it can leave */
+	mpsc_push(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+#define mpsc_entry(node, type, member) \
+	((type *) ((char *) (node) - offsetof(type, member)))
+
+#endif
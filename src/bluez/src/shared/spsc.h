@@ -0,0 +1,122 @@
+/*
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __SPSC_H
+#define __SPSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Single-producer single-consumer ring of fixed size slots, in one block
+ * of memory that can be handed out as is. The producer fills the slot
+ * returned by spsc_reserve() in place and publishes it with
+ * spsc_commit(); the consumer reads slots in order and gives them back
+ * with spsc_release(). Neither side ever blocks or allocates. head and
+ * tail only grow, on their own cache lines.
+ */
+
+struct spsc_ring {
+	uint8_t *slots;
+	size_t slot_size;
+	uint32_t count;			/* Power of two */
+	uint64_t head __attribute__((aligned(64)));	/* Producer */
+	uint64_t tail __attribute__((aligned(64)));	/* Consumer */
+};
+
+static inline int spsc_init(struct spsc_ring *ring, uint32_t count,
+							size_t slot_size)
+{
+	void *slots;
+
+	if (count == 0 || (count & (count - 1)) != 0)
+		return -1;
+
+	/* Slots start on cache lines, so do their timestamps */
+	slot_size = (slot_size + 63) & ~(size_t) 63;
+	if (posix_memalign(&slots, 64, (size_t) count * slot_size) != 0)
+		return -1;
+
+	memset(slots, 0, (size_t) count * slot_size);
+	ring->slots = (uint8_t *) slots;
+	ring->slot_size = slot_size;
+	ring->count = count;
+	ring->head = 0;
+	ring->tail = 0;
+
+	return 0;
+}
+
+static inline void spsc_free(struct spsc_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+static inline size_t spsc_size(const struct spsc_ring *ring)
+{
+	return (size_t) ring->count * ring->slot_size;
+}
+
+/* Producer: next free slot, or NULL if the consumer is a full ring behind */
+static inline uint8_t *spsc_reserve(struct spsc_ring *ring)
+{
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->head - tail >= ring->count)
+		return NULL;
+
+	return ring->slots + (ring->head & (ring->count - 1)) * ring->slot_size;
+}
+
+static inline void spsc_commit(struct spsc_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer: index of the first unread slot and how many follow it
+ * without wrapping around, 0 if there is none.
+ */
+static inline uint32_t spsc_peek(struct spsc_ring *ring, uint32_t *first)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t index = ring->tail & (ring->count - 1);
+	uint64_t ready = head - ring->tail;
+
+	*first = index;
+
+	if (ready > ring->count - index)
+		ready = ring->count - index;
+
+	return ready;
+}
+
+static inline void spsc_release(struct spsc_ring *ring, uint32_t n)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (n > head - ring->tail)
+		n = head - ring->tail;
+
+	__atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <glib.h>
+
+#include "src/shared/timer-wheel.h"
+
+/*
+ * Classic cascading layout: level 0 has one slot per millisecond for the
+ * next 256 ms, each further level covers 64 slots of the level below.
+ * Four levels span 2^26 ms (about 18 hours); longer timeouts are clamped.
+ */
+#define L0_BITS		8
+#define LN_BITS		6
+#define LEVELS		4
+#define L0_SIZE		(1 << L0_BITS)
+#define LN_SIZE		(1 << LN_BITS)
+#define L0_MASK		(L0_SIZE - 1)
+#define LN_MASK		(LN_SIZE - 1)
+#define LEVEL_SHIFT(l)	(L0_BITS + ((l) - 1) * LN_BITS)
+#define WHEEL_SPAN	(1ULL << LEVEL_SHIFT(LEVELS))
+
+struct timer_wheel {
+	int refs;
+	GMainContext *context;
+	GMutex lock;
+	guint64 now;		/* next tick to process */
+	guint count;
+	GSource *source;
+	guint64 wake;
+	struct wheel_timer *expired;
+	struct wheel_timer *l0[L0_SIZE];
+	struct wheel_timer *ln[LEVELS - 1][LN_SIZE];
+};
+
+static GMutex wheels_lock;
+static GHashTable *wheels;
+
+static guint64 now_ms(void)
+{
+	return g_get_monotonic_time() / 1000;
+}
+
+static void slot_link(struct wheel_timer **slot, struct wheel_timer *timer)
+{
+	timer->next = *slot;
+	if (*slot)
+		(*slot)->pprev = &timer->next;
+
+	*slot = timer;
+	timer->pprev = slot;
+}
+
+static void timer_unlink(struct wheel_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static void wheel_insert(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+	guint64 expires = timer->expires;
+	guint64 delta;
+	int level;
+
+	if (expires < wheel->now)
+		expires = wheel->now;
+
+	delta = expires - wheel->now;
+
+	if (delta < L0_SIZE) {
+		slot_link(&wheel->l0[expires & L0_MASK], timer);
+		return;
+	}
+
+	if (delta >= WHEEL_SPAN) {
+		expires = wheel->now + WHEEL_SPAN - 1;
+		timer->expires = expires;
+	}
+
+	for (level = 1; level < LEVELS - 1; level++) {
+		if (delta < 1ULL << LEVEL_SHIFT(level + 1))
+			break;
+	}
+
+	slot_link(&wheel->ln[level - 1][(expires >> LEVEL_SHIFT(level)) &
+							LN_MASK], timer);
+}
+
+/* Re-file one upper level slot, returns its index */
+static int cascade(struct timer_wheel *wheel, int level)
+{
+	int index = (wheel->now >> LEVEL_SHIFT(level)) & LN_MASK;
+	struct wheel_timer *list = wheel->ln[level - 1][index];
+
+	wheel->ln[level - 1][index] = NULL;
+
+	while (list) {
+		struct wheel_timer *next = list->next;
+
+		wheel_insert(wheel, list);
+		list = next;
+	}
+
+	return index;
+}
+
+/* Move everything due up to and including until onto the expired list */
+static void wheel_advance(struct timer_wheel *wheel, guint64 until)
+{
+	if (wheel->count == 0) {
+		if (wheel->now <= until)
+			wheel->now = until + 1;
+		return;
+	}
+
+	while (wheel->now <= until) {
+		int level, index = wheel->now & L0_MASK;
+		struct wheel_timer *list;
+
+		for (level = 1; index == 0 && level < LEVELS; level++) {
+			if (cascade(wheel, level) != 0)
+				break;
+		}
+
+		list = wheel->l0[index];
+		wheel->l0[index] = NULL;
+
+		while (list) {
+			struct wheel_timer *next = list->next;
+
+			slot_link(&wheel->expired, list);
+			list = next;
+		}
+
+		wheel->now++;
+	}
+}
+
+/* First tick that needs attention: an occupied slot or a cascade */
+static guint64 next_expiry(struct timer_wheel *wheel)
+{
+	int i;
+
+	if (wheel->expired)
+		return wheel->now;
+
+	for (i = 0; i < L0_SIZE; i++) {
+		guint64 tick = wheel->now + i;
+
+		if (wheel->l0[tick & L0_MASK])
+			return tick;
+
+		if (i > 0 && (tick & L0_MASK) == 0)
+			return tick;
+	}
+
+	return wheel->now + L0_SIZE;
+}
+
+static gboolean wheel_dispatch(gpointer user_data);
+
+/* Called with the lock held */
+static void wheel_schedule(struct timer_wheel *wheel)
+{
+	guint64 next, now;
+
+	if (wheel->count == 0) {
+		if (wheel->source) {
+			g_source_destroy(wheel->source);
+			g_source_unref(wheel->source);
+			wheel->source = NULL;
+		}
+
+		return;
+	}
+
+	next = next_expiry(wheel);
+
+	if (wheel->source) {
+		if (wheel->wake <= next)
+			return;
+
+		g_source_destroy(wheel->source);
+		g_source_unref(wheel->source);
+	}
+
+	now = now_ms();
+
+	wheel->wake = next;
+	wheel->source = g_timeout_source_new(next > now ? next - now : 0);
+	g_source_set_priority(wheel->source, G_PRIORITY_DEFAULT);
+	g_source_set_callback(wheel->source, wheel_dispatch, wheel, NULL);
+	g_source_attach(wheel->source, wheel->context);
+}
+
+static void wheel_ref(struct timer_wheel *wheel)
+{
+	g_mutex_lock(&wheels_lock);
+	wheel->refs++;
+	g_mutex_unlock(&wheels_lock);
+}
+
+static gboolean wheel_dispatch(gpointer user_data)
+{
+	struct timer_wheel *wheel = user_data;
+	struct wheel_timer *timer;
+
+	/* A callback may drop the last user of the wheel */
+	wheel_ref(wheel);
+
+	g_mutex_lock(&wheel->lock);
+
+	g_source_unref(wheel->source);
+	wheel->source = NULL;
+
+	wheel_advance(wheel, now_ms());
+
+	/* One at a time, a callback may delete timers that are also due */
+	while ((timer = wheel->expired)) {
+		timer_unlink(timer);
+		wheel->count--;
+
+		g_mutex_unlock(&wheel->lock);
+		timer->func(timer, timer->user_data);
+		g_mutex_lock(&wheel->lock);
+	}
+
+	wheel_schedule(wheel);
+
+	g_mutex_unlock(&wheel->lock);
+
+	timer_wheel_unref(wheel);
+
+	return FALSE;
+}
+
+struct timer_wheel *timer_wheel_get(GMainContext *context)
+{
+	struct timer_wheel *wheel;
+
+	if (context == NULL)
+		context = g_main_context_default();
+
+	g_mutex_lock(&wheels_lock);
+
+	if (wheels == NULL)
+		wheels = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	wheel = g_hash_table_lookup(wheels, context);
+	if (wheel == NULL) {
+		wheel = g_new0(struct timer_wheel, 1);
+		wheel->context = g_main_context_ref(context);
+		wheel->now = now_ms();
+		g_mutex_init(&wheel->lock);
+		g_hash_table_insert(wheels, context, wheel);
+	}
+
+	wheel->refs++;
+
+	g_mutex_unlock(&wheels_lock);
+
+	return wheel;
+}
+
+void timer_wheel_unref(struct timer_wheel *wheel)
+{
+	if (wheel == NULL)
+		return;
+
+	g_mutex_lock(&wheels_lock);
+
+	if (--wheel->refs > 0) {
+		g_mutex_unlock(&wheels_lock);
+		return;
+	}
+
+	g_hash_table_remove(wheels, wheel->context);
+
+	g_mutex_unlock(&wheels_lock);
+
+	if (wheel->source) {
+		g_source_destroy(wheel->source);
+		g_source_unref(wheel->source);
+	}
+
+	g_main_context_unref(wheel->context);
+	g_mutex_clear(&wheel->lock);
+	g_free(wheel);
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+					unsigned int msec, wheel_timer_func_t func,
+					void *user_data)
+{
+	g_mutex_lock(&wheel->lock);
+
+	if (timer->pprev) {
+		timer_unlink(timer);
+		wheel->count--;
+	}
+
+	/* Catch up first so the new expiry is filed against current time */
+	wheel_advance(wheel, now_ms() - 1);
+
+	timer->func = func;
+	timer->user_data = user_data;
+	timer->expires = now_ms() + msec;
+
+	wheel_insert(wheel, timer);
+	wheel->count++;
+
+	wheel_schedule(wheel);
+
+	g_mutex_unlock(&wheel->lock);
+}
+
+bool timer_wheel_del(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+	bool pending = false;
+
+	g_mutex_lock(&wheel->lock);
+
+	if (timer->pprev) {
+		timer_unlink(timer);
+		wheel->count--;
+		pending = true;
+	}
+
+	g_mutex_unlock(&wheel->lock);
+
+	return pending;
+}
@@ -0,0 +1,54 @@
+/*
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+/*
+ * Hierarchical timer wheel with millisecond resolution. One wheel is
+ * shared by everything running on a GMainContext and is driven by a
+ * single timeout source, rescheduled to the next occupied slot.
+ */
+
+struct timer_wheel;
+struct wheel_timer;
+
+typedef void (*wheel_timer_func_t)(struct wheel_timer *timer,
+							void *user_data);
+
+/* Embedded in the owner; must be zeroed before first use */
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;
+	guint64 expires;
+	wheel_timer_func_t func;
+	void *user_data;
+};
+
+struct timer_wheel *timer_wheel_get(GMainContext *context);
+void timer_wheel_unref(struct timer_wheel *wheel);
+
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+					unsigned int msec, wheel_timer_func_t func,
+					void *user_data);
+bool timer_wheel_del(struct timer_wheel *wheel, struct wheel_timer *timer);
+
+#endif
@@ -0,0 +1,283 @@
+// -*- mode: c++; coding: utf-8 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#include <stdexcept>
+
+#include <bluetooth/bluetooth.h>
+
+#include "client.h"
+
+// One request in flight; the callback runs once, from the result or,
+// if the request is dropped unanswered, from client_request_free()
+struct ClientRequest {
+    GATTClient::ReadCallback read;
+    GATTClient::StatusCallback status;
+    GATTClient::ChunkCallback chunk;
+    bool done{false};
+};
+
+static void
+client_request_free(gpointer userp) {
+    ClientRequest* request = (ClientRequest*)userp;
+
+    if (!request->done) {
+        if (request->read)
+            request->read(ATT_ECODE_ABORTED, ByteSpan());
+        else if (request->status)
+            request->status(ATT_ECODE_ABORTED);
+    }
+
+    delete request;
+}
+
+static void
+client_read_cb(guint8 status, const guint8* pdu, guint16 size,
+        gpointer userp) {
+    ClientRequest* request = (ClientRequest*)userp;
+
+    // Skip the opcode of the Read Response
+    ByteSpan value;
+    if (status == 0 && pdu != NULL && size > 0)
+        value = ByteSpan(pdu + 1, size - 1);
+
+    request->done = true;
+    request->read(status, value);
+}
+
+static void
+client_chunk_cb(uint16_t offset, const uint8_t* value, uint16_t vlen,
+        void* userp) {
+    ClientRequest* request = (ClientRequest*)userp;
+    request->chunk(offset, ByteSpan(value, vlen));
+}
+
+static void
+client_status_cb(guint8 status, const guint8* pdu, guint16 size,
+        gpointer userp) {
+    ClientRequest* request = (ClientRequest*)userp;
+
+    request->done = true;
+    request->status(status);
+}
+
+GATTClient::GATTClient(const std::string& address, const std::string& device,
+        int loop) :
+    GATTConnection(address, device, loop) {
+}
+
+GATTClient::~GATTClient() {
+    disconnect();
+}
+
+std::string
+GATTClient::error_message(uint8_t status) {
+    return std::string("Characteristic value/descriptor operation failed: ") +
+        att_ecode2str(status);
+}
+
+/*
+ * Starts connecting and returns at once; the future is ready when the
+ * link is up, or holds the error if it could not be established.
+ */
+std::future<void>
+GATTClient::connect(const std::string& channel_type,
+        const std::string& security_level, int psm, int mtu) {
+    GATTConnection::connect(channel_type, security_level, psm, mtu);
+    return std::move(_connect_result);
+}
+
+// Called with _lock held, like the other hooks
+void
+GATTClient::connecting() {
+    _connected = std::promise<void>();
+    _connect_result = _connected.get_future();
+    _connect_pending = true;
+}
+
+void
+GATTClient::attached() {
+    g_attrib_register(_attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES,
+            client_events_cb, (gpointer)this, NULL);
+    g_attrib_register(_attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES,
+            client_events_cb, (gpointer)this, NULL);
+
+    if (_connect_pending) {
+        _connect_pending = false;
+        _connected.set_value();
+    }
+}
+
+void
+GATTClient::failed(const std::string& message) {
+    if (_connect_pending) {
+        _connect_pending = false;
+        _connected.set_exception(std::make_exception_ptr(
+                std::runtime_error(message)));
+    }
+}
+
+void
+client_events_cb(const uint8_t* data, uint16_t size, gpointer userp) {
+    GATTClient* client = (GATTClient*)userp;
+    uint16_t handle = bt_get_le16(&data[1]);
+    ByteSpan value(data + 3, size - 3);
+
+    if (data[0] == ATT_OP_HANDLE_NOTIFY) {
+        if (client->_on_notification)
+            client->_on_notification(handle, value);
+        return;
+    }
+
+    if (client->_on_indication)
+        client->_on_indication(handle, value);
+
+    uint8_t buffer[ATT_DEFAULT_LE_MTU];
+    uint16_t olen = enc_confirmation(buffer, sizeof(buffer));
+    if (olen > 0)
+        g_attrib_send(client->_attrib, 0, buffer, olen, NULL, NULL, NULL);
+}
+
+void
+GATTClient::set_notification_handler(EventCallback callback) {
+    _on_notification = callback;
+}
+
+void
+GATTClient::set_indication_handler(EventCallback callback) {
+    _on_indication = callback;
+}
+
+void
+GATTClient::check_connected() const {
+    if (_state != STATE_CONNECTED)
+        throw std::runtime_error("Not connected");
+}
+
+void
+GATTClient::set_deadline(guint id, int timeout) {
+    if (id && timeout > 0)
+        g_attrib_set_deadline(_attrib, id, timeout);
+}
+
+// timeout is in milliseconds, 0 waits for as long as the link lives
+guint
+GATTClient::read(uint16_t handle, ReadCallback callback, int timeout) {
+    check_connected();
+
+    ClientRequest* request = new ClientRequest();
+    request->read = callback;
+
+    guint id = gatt_read_char_full(_attrib, handle, client_read_cb,
+            (gpointer)request, client_request_free);
+    if (id == 0) {
+        delete request;
+        throw std::runtime_error("Could not send read request");
+    }
+
+    set_deadline(id, timeout);
+    return id;
+}
+
+std::future<std::vector<uint8_t> >
+GATTClient::read(uint16_t handle, int timeout) {
+    auto promise = std::make_shared<std::promise<std::vector<uint8_t> > >();
+
+    read(handle, [promise](uint8_t status, ByteSpan value) {
+        if (status != 0)
+            promise->set_exception(std::make_exception_ptr(
+                    std::runtime_error(error_message(status))));
+        else
+            promise->set_value(
+                std::vector<uint8_t>(value.begin(), value.end()));
+    }, timeout);
+
+    return promise->get_future();
+}
+
+/*
+ * Reads the value from offset on with Read Blob requests, whatever its
+ * length; the callback gets the whole of it. size_hint, if known, saves
+ * growing the buffer on the way.
+ */
+guint
+GATTClient::read_long(uint16_t handle, uint16_t offset, uint16_t size_hint,
+        ReadCallback callback, int timeout) {
+    check_connected();
+
+    ClientRequest* request = new ClientRequest();
+    request->read = callback;
+
+    guint id = gatt_read_long(_attrib, handle, offset, size_hint, NULL,
+            client_read_cb, (gpointer)request, client_request_free);
+    if (id == 0) {
+        delete request;
+        throw std::runtime_error("Could not send read request");
+    }
+
+    set_deadline(id, timeout);
+    return id;
+}
+
+// Like the above, but each blob goes to chunk as it comes, nothing is kept
+guint
+GATTClient::read_long(uint16_t handle, uint16_t offset, ChunkCallback chunk,
+        StatusCallback callback, int timeout) {
+    check_connected();
+
+    ClientRequest* request = new ClientRequest();
+    request->chunk = chunk;
+    request->status = callback;
+
+    guint id = gatt_read_long(_attrib, handle, offset, 0, client_chunk_cb,
+            client_status_cb, (gpointer)request, client_request_free);
+    if (id == 0) {
+        delete request;
+        throw std::runtime_error("Could not send read request");
+    }
+
+    set_deadline(id, timeout);
+    return id;
+}
+
+// Values longer than the MTU allows go out as a long write
+guint
+GATTClient::write(uint16_t handle, ByteSpan value, StatusCallback callback,
+        int timeout) {
+    check_connected();
+
+    ClientRequest* request = new ClientRequest();
+    request->status = callback;
+
+    guint id = gatt_write_char_full(_attrib, handle, value.data(),
+            value.size(), client_status_cb, (gpointer)request,
+            client_request_free);
+    if (id == 0) {
+        delete request;
+        throw std::runtime_error("Could not send write request");
+    }
+
+    set_deadline(id, timeout);
+    return id;
+}
+
+std::future<void>
+GATTClient::write(uint16_t handle, ByteSpan value, int timeout) {
+    auto promise = std::make_shared<std::promise<void> >();
+
+    write(handle, value, [promise](uint8_t status) {
+        if (status != 0)
+            promise->set_exception(std::make_exception_ptr(
+                    std::runtime_error(error_message(status))));
+        else
+            promise->set_value();
+    }, timeout);
+
+    return promise->get_future();
+}
+
+void
+GATTClient::write_cmd(uint16_t handle, ByteSpan value) {
+    check_connected();
+    gatt_write_cmd(_attrib, handle, value.data(), value.size(), NULL, NULL);
+}
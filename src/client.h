@@ -0,0 +1,98 @@
+// -*- mode: c++; coding: utf-8; tab-width: 4 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#ifndef _CLIENT_H_
+#define _CLIENT_H_
+
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <glib.h>
+
+#include "connection.h"
+
+// View of bytes owned by someone else, valid during the callback only
+class ByteSpan {
+public:
+	ByteSpan() {}
+	ByteSpan(const uint8_t* data, size_t size) : _data(data), _size(size) {}
+	ByteSpan(const std::vector<uint8_t>& v) : _data(v.data()), _size(v.size()) {}
+
+	const uint8_t* data() const { return _data; }
+	size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+	const uint8_t* begin() const { return _data; }
+	const uint8_t* end() const { return _data + _size; }
+	uint8_t operator[](size_t i) const { return _data[i]; }
+
+private:
+	const uint8_t* _data{nullptr};
+	size_t _size{0};
+};
+
+void client_events_cb(const uint8_t* data, uint16_t size, gpointer userp);
+
+/*
+ * GATT client for C++ programs, on the same event loops and ATT engine
+ * as the Python module, without Python or its GIL. Callbacks run on the
+ * event loop of the connection and must not block or throw; the other
+ * calls may be used from any thread. Every request gets exactly one
+ * callback: with ATT_ECODE_ABORTED if the connection goes away first.
+ * disconnect() waits for those, so it must not be called holding a lock
+ * the callbacks take. Futures fail with std::runtime_error on ATT errors.
+ */
+class GATTClient : public GATTConnection {
+public:
+	typedef std::function<void(uint8_t status, ByteSpan value)> ReadCallback;
+	typedef std::function<void(uint8_t status)> StatusCallback;
+	typedef std::function<void(uint16_t handle, ByteSpan value)> EventCallback;
+	typedef std::function<void(uint16_t offset, ByteSpan value)> ChunkCallback;
+
+	GATTClient(const std::string& address, const std::string& device="hci0",
+			int loop=-1);
+	virtual ~GATTClient();
+
+	std::future<void> connect(const std::string& channel_type="public",
+			const std::string& security_level="low", int psm=0, int mtu=0);
+
+	// Set before connecting, they are read by the loop without locking
+	void set_notification_handler(EventCallback callback);
+	void set_indication_handler(EventCallback callback);
+
+	// The callback versions return the command id, for g_attrib_cancel()
+	guint read(uint16_t handle, ReadCallback callback, int timeout=0);
+	std::future<std::vector<uint8_t> > read(uint16_t handle, int timeout=0);
+	guint read_long(uint16_t handle, uint16_t offset, uint16_t size_hint,
+			ReadCallback callback, int timeout=0);
+	guint read_long(uint16_t handle, uint16_t offset, ChunkCallback chunk,
+			StatusCallback callback, int timeout=0);
+	guint write(uint16_t handle, ByteSpan value, StatusCallback callback,
+			int timeout=0);
+	std::future<void> write(uint16_t handle, ByteSpan value, int timeout=0);
+	void write_cmd(uint16_t handle, ByteSpan value);
+
+	static std::string error_message(uint8_t status);
+
+	friend void client_events_cb(const uint8_t*, uint16_t, gpointer);
+
+protected:
+	void connecting();
+	void attached();
+	void failed(const std::string& message);
+
+	void check_connected() const;
+	void set_deadline(guint id, int timeout);
+
+private:
+	std::promise<void> _connected;
+	std::future<void> _connect_result;
+	bool _connect_pending{false};
+
+	EventCallback _on_notification;
+	EventCallback _on_indication;
+};
+
+#endif // _CLIENT_H_
@@ -0,0 +1,233 @@
+// -*- mode: c++; coding: utf-8 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#include <stdexcept>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "connection.h"
+
+// Like g_io_add_watch(), but on the connection's own loop
+static guint
+add_watch(GMainContext* context, GIOChannel* channel, GIOCondition cond,
+        GIOFunc func, gpointer userp) {
+    GSource* source = g_io_create_watch(channel, cond);
+    g_source_set_callback(source, (GSourceFunc)func, userp, NULL);
+
+    guint id = g_source_attach(source, context);
+    g_source_unref(source);
+    return id;
+}
+
+GATTConnection::GATTConnection(const std::string& address,
+        const std::string& device, int loop) :
+    _address(address),
+    _device(device),
+    _loop_request(loop) {
+
+    if (loop >= IOServicePool::instance().size())
+        throw std::runtime_error("Invalid event loop");
+}
+
+// Subclasses with hooks disconnect in their own destructor, this one
+// only sees the base part
+GATTConnection::~GATTConnection() {
+    GATTConnection::disconnect();
+}
+
+/*
+ * Starts connecting and returns at once; attached() or failed() follow
+ * from the loop. The connect watch itself stays on the default loop,
+ * connection_connect_cb then moves the attrib over to the assigned one.
+ */
+void
+GATTConnection::connect(const std::string& channel_type,
+        const std::string& security_level, int psm, int mtu) {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (_state == STATE_CONNECTING || _state == STATE_CONNECTED)
+        throw std::runtime_error("Already connecting or connected");
+
+    IOServicePool& pool = IOServicePool::instance();
+    _loop_index = pool.assign(_loop_request);
+    _loop = pool.get(_loop_index);
+
+    connecting();
+    _state = STATE_CONNECTING;
+
+    GError* gerr = NULL;
+    _channel = gatt_connect(_device.c_str(), _address.c_str(),
+            channel_type.c_str(), security_level.c_str(), psm, mtu,
+            connection_connect_cb, &gerr, (gpointer)this);
+
+    if (_channel == NULL) {
+        release();
+        _state = STATE_DISCONNECTED;
+
+        std::string msg(gerr->message);
+        g_error_free(gerr);
+        failed(msg);
+        throw std::runtime_error(msg);
+    }
+
+    _watch = add_watch(_loop->context(), _channel, G_IO_HUP,
+            connection_disconnect_cb, (gpointer)this);
+}
+
+// Any SOCK_SEQPACKET descriptor carrying ATT PDUs; the caller keeps fd
+void
+GATTConnection::attach(int fd, int mtu) {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (_state == STATE_CONNECTING || _state == STATE_CONNECTED)
+        throw std::runtime_error("Already connecting or connected");
+
+    int dupfd = dup(fd);
+    if (dupfd < 0) {
+        std::string msg = std::string("Could not attach: ") +
+            std::string(strerror(errno));
+        throw std::runtime_error(msg);
+    }
+
+    IOServicePool& pool = IOServicePool::instance();
+    _loop_index = pool.assign(_loop_request);
+    _loop = pool.get(_loop_index);
+
+    _channel = g_io_channel_unix_new(dupfd);
+    g_io_channel_set_close_on_unref(_channel, TRUE);
+
+    _watch = add_watch(_loop->context(), _channel, G_IO_HUP,
+            connection_disconnect_cb, (gpointer)this);
+    attach_attrib(_channel, mtu);
+}
+
+void
+connection_connect_cb(GIOChannel* channel, GError* err, gpointer userp) {
+    GATTConnection* conn = (GATTConnection*)userp;
+
+    if (err) {
+        std::string msg(err->message);
+        g_error_free(err);
+
+        std::lock_guard<std::mutex> lock(conn->_lock);
+        if (conn->_state != GATTConnection::STATE_CONNECTING)
+            return;
+
+        conn->release();
+        conn->_state = GATTConnection::STATE_ERROR_CONNECTING;
+        conn->failed(msg);
+        return;
+    }
+
+    GError* gerr = NULL;
+    uint16_t mtu;
+    uint16_t cid;
+    bt_io_get(channel, &gerr,
+              BT_IO_OPT_IMTU, &mtu,
+              BT_IO_OPT_CID, &cid,
+              BT_IO_OPT_INVALID);
+
+    // Can't detect MTU, using default
+    if (gerr) {
+        g_error_free(gerr);
+        mtu = ATT_DEFAULT_LE_MTU;
+    }
+
+    if (cid == ATT_CID) mtu = ATT_DEFAULT_LE_MTU;
+
+    std::lock_guard<std::mutex> lock(conn->_lock);
+    if (conn->_state != GATTConnection::STATE_CONNECTING)
+        return;
+
+    conn->attach_attrib(channel, mtu);
+}
+
+// Called with _lock held
+void
+GATTConnection::attach_attrib(GIOChannel* channel, uint16_t mtu) {
+    _attrib = g_attrib_new_full(channel, mtu, _loop->context());
+    _mtu = mtu;
+    _state = STATE_CONNECTED;
+    attached();
+}
+
+gboolean
+connection_disconnect_cb(GIOChannel* channel, GIOCondition cond,
+        gpointer userp) {
+    GATTConnection* conn = (GATTConnection*)userp;
+    conn->disconnect();
+    return false;
+}
+
+// Requests still pending are aborted on the loop, like any other
+// callback; off the loop, this waits for them
+void
+GATTConnection::disconnect() {
+    GAttrib* attrib;
+    IOService* loop;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (_state == STATE_DISCONNECTED)
+            return;
+
+        loop = _loop;
+        attrib = release();
+
+        bool pending = _state == STATE_CONNECTING;
+        _state = STATE_DISCONNECTED;
+        if (pending)
+            failed("Disconnected while connecting");
+    }
+
+    // Outside the lock, callbacks may call back in
+    if (attrib != NULL)
+        loop->invoke([attrib]() { g_attrib_unref(attrib); });
+}
+
+// Called with _lock held. Drops the watch, the channel and the loop, and
+// hands the GAttrib over to the caller to unref outside the lock.
+GAttrib*
+GATTConnection::release() {
+    GAttrib* attrib = _attrib;
+    _attrib = NULL;
+
+    // The watch refers to this object, which may go away next
+    if (_watch != 0) {
+        GSource* watch = g_main_context_find_source_by_id(_loop->context(),
+                _watch);
+        if (watch != NULL)
+            g_source_destroy(watch);
+        _watch = 0;
+    }
+
+    if (_channel != NULL) {
+        g_io_channel_shutdown(_channel, false, NULL);
+        g_io_channel_unref(_channel);
+        _channel = NULL;
+    }
+
+    if (_loop != NULL) {
+        _loop->release();
+        _loop = NULL;
+        _loop_index = -1;
+    }
+
+    return attrib;
+}
+
+bool
+GATTConnection::is_connected() const {
+    return _state == STATE_CONNECTED;
+}
+
+int
+GATTConnection::mtu() const {
+    return _mtu;
+}
+
+int
+GATTConnection::loop() const {
+    return _loop_index;
+}
@@ -0,0 +1,87 @@
+// -*- mode: c++; coding: utf-8; tab-width: 4 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <glib.h>
+
+extern "C" {
+#include "lib/uuid.h"
+#include "attrib/att.h"
+#include "attrib/gattrib.h"
+#include "attrib/gatt.h"
+#include "attrib/utils.h"
+}
+
+#include "ioservice.h"
+
+void connection_connect_cb(GIOChannel* channel, GError* err, gpointer userp);
+gboolean connection_disconnect_cb(GIOChannel* channel, GIOCondition cond,
+		gpointer userp);
+
+/*
+ * The link under a GATT client: takes an event loop from the pool, opens
+ * the L2CAP channel or wraps a descriptor, and keeps a GAttrib on it until
+ * disconnect(). Both GATTClient and the Python GATTRequester are built on
+ * it. Subclasses hook in below; the hooks run with _lock held, on the loop
+ * or on the thread calling in, and must not block.
+ */
+class GATTConnection {
+public:
+	GATTConnection(const std::string& address, const std::string& device,
+			int loop);
+	virtual ~GATTConnection();
+
+	void attach(int fd, int mtu=ATT_DEFAULT_LE_MTU);
+	virtual void disconnect();
+	bool is_connected() const;
+	int mtu() const;
+	int loop() const;
+
+	friend void connection_connect_cb(GIOChannel*, GError*, gpointer);
+	friend gboolean connection_disconnect_cb(GIOChannel*, GIOCondition,
+			gpointer);
+
+protected:
+	void connect(const std::string& channel_type,
+			const std::string& security_level, int psm, int mtu);
+
+	// A connect() is about to start
+	virtual void connecting() {}
+	// _attrib is up and the state is STATE_CONNECTED
+	virtual void attached() {}
+	// A connect() ended without a link
+	virtual void failed(const std::string& message) {}
+
+	enum State {
+		STATE_DISCONNECTED,
+		STATE_CONNECTING,
+		STATE_CONNECTED,
+		STATE_ERROR_CONNECTING
+	};
+
+	std::string _address;
+	std::string _device;
+	int _loop_request;
+	int _loop_index{-1};
+	IOService* _loop{nullptr};
+
+	std::mutex _lock;
+	std::atomic<int> _state{STATE_DISCONNECTED};
+	GIOChannel* _channel{nullptr};
+	GAttrib* _attrib{nullptr};
+	int _mtu{ATT_DEFAULT_LE_MTU};
+
+private:
+	void attach_attrib(GIOChannel* channel, uint16_t mtu);
+	GAttrib* release();
+
+	guint _watch{0};
+};
+
+#endif // _CONNECTION_H_
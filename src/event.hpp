@@ -5,7 +5,7 @@
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
-#include <iostream>
+#include <boost/thread/thread_time.hpp>
 
 class Event {
 public:
@@ -26,29 +26,33 @@ public:
 		_flag = false;
     }
 
-    bool wait(uint16_t timeout) {
-		if (_flag)
-			return _flag;
+    bool is_set() {
+		boost::lock_guard<boost::mutex> lock(_mutex);
+		return _flag;
+    }
 
-		boost::unique_lock<boost::mutex> lock(_mutex);
-		if (timeout >= 0) {
-			boost::system_time const ts =
-				boost::get_system_time() +
-				boost::posix_time::milliseconds(timeout * 1000);
-
-			try {
-				_cond.timed_wait(lock, ts);
-			} catch(...) {
-				std::cout << "ERROR" << std::endl;
-				std::cout.flush();
-			}
-		}
-		else {
+    // Up to timeout milliseconds, or until set() if it is negative
+    bool wait(int timeout) {
+		if (timeout < 0) {
+			boost::unique_lock<boost::mutex> lock(_mutex);
 			while (!_flag)
 				_cond.wait(lock);
+			return true;
 		}
 
-		return _flag;
+		return wait_until(boost::get_system_time() +
+						  boost::posix_time::milliseconds(timeout));
+    }
+
+    // Spurious wakeups just go back to sleep until the deadline
+    bool wait_until(boost::system_time const& deadline) {
+		boost::unique_lock<boost::mutex> lock(_mutex);
+		while (!_flag) {
+			if (!_cond.timed_wait(lock, deadline))
+				return _flag;
+		}
+
+		return true;
     }
 
 private:
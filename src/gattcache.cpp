@@ -0,0 +1,224 @@
+// -*- mode: c++; coding: utf-8 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+
+#include "gattlib.h"
+#include "gattcache.h"
+
+#define CACHE_MAGIC "GATC"
+#define CACHE_VERSION 2
+#define CACHE_MAX_HASH 16
+
+struct __attribute__((packed)) CacheHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t contents;
+    uint8_t hash_len;           // 0 if the device has no Database Hash
+    uint8_t reserved;
+    uint8_t hash[CACHE_MAX_HASH];
+    uint32_t count;
+};
+
+boost::mutex GATTCache::_lock;
+std::string GATTCache::_directory;
+
+void
+GATTCache::set_directory(std::string path) {
+    if (!path.empty() && mkdir(path.c_str(), 0700) < 0 && errno != EEXIST) {
+        std::string msg = std::string("Could not create cache directory: ") +
+            std::string(strerror(errno));
+        throw std::runtime_error(msg);
+    }
+
+    boost::lock_guard<boost::mutex> lock(_lock);
+    _directory = path;
+}
+
+std::string
+GATTCache::directory() {
+    boost::lock_guard<boost::mutex> lock(_lock);
+    return _directory;
+}
+
+bool
+GATTCache::enabled() {
+    return !directory().empty();
+}
+
+void
+GATTCache::remove(const std::string& address) {
+    std::string dir = directory();
+    if (!dir.empty())
+        unlink((dir + "/" + address + ".gatt").c_str());
+}
+
+GATTCache::GATTCache(const std::string& address) :
+    _address(address) {
+}
+
+GATTCache::~GATTCache() {
+    unmap();
+}
+
+std::string
+GATTCache::path() const {
+    return directory() + "/" + _address + ".gatt";
+}
+
+void
+GATTCache::unmap() {
+    if (_map != nullptr)
+        munmap(_map, _map_size);
+
+    _map = nullptr;
+    _map_size = 0;
+    _entries = nullptr;
+    _count = 0;
+    _contents = 0;
+    _hash.clear();
+}
+
+// Maps the stored table, if there is a sound one
+bool
+GATTCache::load() {
+    unmap();
+
+    if (!enabled())
+        return false;
+
+    int fd = open(path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const CacheHeader* header = (const CacheHeader*)map;
+    if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 ||
+            header->version != CACHE_VERSION ||
+            header->hash_len > CACHE_MAX_HASH ||
+            st.st_size != (off_t)(sizeof(CacheHeader) +
+                                  header->count * sizeof(Entry))) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    _map = map;
+    _map_size = st.st_size;
+    _entries = (const Entry*)(header + 1);
+    _count = header->count;
+    _contents = header->contents;
+    _hash = std::string((const char*)header->hash, header->hash_len);
+    return true;
+}
+
+// Replaces the stored table; the mapping follows the new one
+void
+GATTCache::store(const std::string& hash, int contents,
+        const std::vector<Entry>& entries) {
+    if (!enabled())
+        return;
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.contents = contents;
+    header.hash_len = std::min(hash.size(), (size_t)CACHE_MAX_HASH);
+    memcpy(header.hash, hash.data(), header.hash_len);
+    header.count = entries.size();
+
+    std::string tmp = path() + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+
+    size_t size = entries.size() * sizeof(Entry);
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+        (size == 0 || write(fd, entries.data(), size) == (ssize_t)size);
+    close(fd);
+
+    if (!ok || rename(tmp.c_str(), path().c_str()) < 0) {
+        unlink(tmp.c_str());
+        return;
+    }
+
+    load();
+}
+
+const std::string&
+GATTCache::hash() const {
+    return _hash;
+}
+
+int
+GATTCache::contents() const {
+    return _contents;
+}
+
+const GATTCache::Entry*
+GATTCache::begin() const {
+    return _entries;
+}
+
+const GATTCache::Entry*
+GATTCache::end() const {
+    return _entries + _count;
+}
+
+// The Contents flag covering entries of that type
+int
+GATTCache::contents_of(uint8_t type) {
+    switch (type) {
+    case PRIMARY_SERVICE:
+        return HAS_PRIMARY;
+    case INCLUDED_SERVICE:
+        return HAS_INCLUDES;
+    case CHARACTERISTIC:
+        return HAS_CHARACTERISTICS;
+    case DESCRIPTOR:
+        return HAS_DESCRIPTORS;
+    default:
+        return 0;
+    }
+}
+
+void
+GATTCache::set_uuid(Entry& entry, const std::string& uuid) {
+    bt_uuid_t parsed, uuid128;
+
+    if (bt_string_to_uuid(&parsed, uuid.c_str()) < 0)
+        throw std::runtime_error("Invalid UUID");
+
+    bt_uuid_to_uuid128(&parsed, &uuid128);
+    memcpy(entry.uuid, &uuid128.value.u128, sizeof(entry.uuid));
+}
+
+std::string
+GATTCache::uuid(const Entry& entry) {
+    bt_uuid_t uuid128;
+    char str[MAX_LEN_UUID_STR + 1];
+
+    uuid128.type = bt_uuid_t::BT_UUID128;
+    memcpy(&uuid128.value.u128, entry.uuid, sizeof(entry.uuid));
+    bt_uuid_to_string(&uuid128, str, sizeof(str));
+    return std::string(str);
+}
@@ -0,0 +1,84 @@
+// -*- mode: c++; coding: utf-8; tab-width: 4 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#ifndef _GATTCACHE_H_
+#define _GATTCACHE_H_
+
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * On-disk copy of the attribute table of a device, one file per address
+ * in the cache directory. Files are read through mmap and replaced with a
+ * rename, so other processes never see half of a table. A table is only
+ * used while the Database Hash it was stored with still matches the one
+ * of the device; Service Changed indications drop it.
+ */
+class GATTCache {
+public:
+	enum EntryType {
+		PRIMARY_SERVICE = 1,
+		INCLUDED_SERVICE,
+		CHARACTERISTIC,
+		DESCRIPTOR,
+	};
+
+	// What a table holds, a discovery of the whole handle range each
+	enum Contents {
+		HAS_PRIMARY = 0x01,
+		HAS_CHARACTERISTICS = 0x02,
+		HAS_DESCRIPTORS = 0x04,
+		HAS_INCLUDES = 0x08,
+	};
+
+	struct __attribute__((packed)) Entry {
+		uint8_t type;
+		uint8_t properties;		// Characteristics only
+		uint16_t handle;		// Start or declaration handle
+		uint16_t end;			// End handle, or characteristic value handle
+		uint16_t declaration;	// Included services only
+		uint8_t uuid[16];		// 128 bit, as in bt_uuid_t
+	};
+
+	static int contents_of(uint8_t type);
+
+	static void set_directory(std::string path);
+	static std::string directory();
+	static bool enabled();
+	static void remove(const std::string& address);
+
+	GATTCache(const std::string& address);
+	virtual ~GATTCache();
+
+	bool load();
+	void store(const std::string& hash, int contents,
+			const std::vector<Entry>& entries);
+
+	const std::string& hash() const;
+	int contents() const;
+	const Entry* begin() const;
+	const Entry* end() const;
+
+	static void set_uuid(Entry& entry, const std::string& uuid);
+	static std::string uuid(const Entry& entry);
+
+private:
+	void unmap();
+	std::string path() const;
+
+	std::string _address;
+	std::string _hash;
+	int _contents{0};
+	void* _map{nullptr};
+	size_t _map_size{0};
+	const Entry* _entries{nullptr};
+	size_t _count{0};
+
+	static boost::mutex _lock;
+	static std::string _directory;
+};
+
+#endif // _GATTCACHE_H_
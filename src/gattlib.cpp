@@ -8,6 +8,7 @@
 #include <boost/python/extract.hpp>
 #include <sys/ioctl.h>
 #include <iostream>
+#include <fstream>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
@@ -25,41 +26,66 @@ private:
     PyGILState_STATE _state;
 };
 
-IOService::IOService(bool run) {
-    if (run)
-        start();
+class PyAllowThreads {
+public:
+    PyAllowThreads() { _save = PyEval_SaveThread(); }
+    ~PyAllowThreads() { PyEval_RestoreThread(_save); }
+
+private:
+    PyThreadState* _save;
+};
+
+GATTResponse::GATTResponse() :
+    _status(0) {
 }
 
-void
-IOService::start() {
-    if (!PyEval_ThreadsInitialized()) {
-        PyEval_InitThreads();
-    }
+// Blocks on event without holding the GIL, if the caller has it, so other
+// Python threads go on meanwhile
+static bool
+wait_without_gil(Event& event, int timeout) {
+    if (!Py_IsInitialized() || !PyGILState_Check())
+        return event.wait(timeout);
 
-    boost::thread iothread(*this);
+    PyAllowThreads allow;
+    return event.wait(timeout);
 }
 
-void
-IOService::operator()() {
-    GMainLoop *event_loop = g_main_loop_new(NULL, FALSE);
+// Off the loop thread, g_attrib_cancel() waits for the loop, whose
+// callbacks may need the GIL
+static gboolean
+cancel_without_gil(GAttrib* attrib, guint id) {
+    if (!Py_IsInitialized() || !PyGILState_Check())
+        return g_attrib_cancel(attrib, id);
 
-    g_main_loop_run(event_loop);
-    g_main_loop_unref(event_loop);
+    PyAllowThreads allow;
+    return g_attrib_cancel(attrib, id);
 }
 
-static volatile IOService _instance(true);
+static bool
+wait_without_gil(Event& event, boost::system_time const& deadline) {
+    if (!Py_IsInitialized() || !PyGILState_Check())
+        return event.wait_until(deadline);
 
-GATTResponse::GATTResponse() :
-    _status(0) {
+    PyAllowThreads allow;
+    return event.wait_until(deadline);
 }
 
+// Responses are filled by the loop thread, which has no GIL of its own
 void
 GATTResponse::on_response(const std::string data) {
+    PyGILGuard guard;
     _data.append(data);
 }
 
 void
 GATTResponse::on_response(boost::python::object data) {
+    PyGILGuard guard;
+    _data.append(data);
+}
+
+void
+GATTResponse::on_chunk(uint16_t offset, const std::string data) {
+    PyGILGuard guard;
     _data.append(data);
 }
 
@@ -69,11 +95,25 @@ GATTResponse::notify(uint8_t status) {
     _event.set();
 }
 
+// timeout in milliseconds, negative waits for as long as it takes
+bool
+GATTResponse::wait(int timeout) {
+    if (not wait_without_gil(_event, timeout))
+        return false;
+
+    return check_status();
+}
+
 bool
-GATTResponse::wait(uint16_t timeout) {
-    if (not _event.wait(timeout))
+GATTResponse::wait_until(boost::system_time const& deadline) {
+    if (not wait_without_gil(_event, deadline))
         return false;
 
+    return check_status();
+}
+
+bool
+GATTResponse::check_status() {
     if (_status != 0) {
         std::string msg = "Characteristic value/descriptor operation failed: ";
         msg += att_ecode2str(_status);
@@ -88,16 +128,23 @@ GATTResponse::received() {
     return _data;
 }
 
+uint8_t
+GATTResponse::status() const {
+    return _status;
+}
+
 
 GATTRequester::GATTRequester(std::string address, bool do_connect,
-        std::string device) :
-    _state(STATE_DISCONNECTED),
-    _device(device),
-    _address(address),
-    _hci_socket(-1),
-    _channel(NULL),
-    _attrib(NULL),
-    _mtu(ATT_DEFAULT_LE_MTU) {
+        std::string device, int loop) :
+    GATTClient(address, device, loop),
+    _hci_socket(-1) {
+
+    // No adapter: only attach() to a local transport is possible
+    if (_device.empty()) {
+        if (do_connect)
+            throw std::runtime_error("Invalid device!");
+        return;
+    }
 
     int dev_id = hci_devid(_device.c_str());
     if (dev_id < 0)
@@ -115,17 +162,18 @@ GATTRequester::GATTRequester(std::string address, bool do_connect,
 }
 
 GATTRequester::~GATTRequester() {
-    if (_channel != NULL) {
-        g_io_channel_shutdown(_channel, TRUE, NULL);
-        g_io_channel_unref(_channel);
+    disconnect();
+
+    if (_batch_timer != NULL) {
+        g_source_destroy(_batch_timer);
+        g_source_unref(_batch_timer);
     }
 
+    if (_ring_allocated)
+        spsc_free(&_ring);
+
     if (_hci_socket > -1)
         hci_close_dev(_hci_socket);
-
-    if (_attrib != NULL) {
-        g_attrib_unref(_attrib);
-    }
 }
 
 void
@@ -148,298 +196,1467 @@ GATTRequester::on_indication(const uint16_t handle, const std::string data) {
     printf("\n");
 }
 
+static void
+send_confirmation(GAttrib* attrib) {
+    uint8_t buffer[ATT_DEFAULT_LE_MTU];
+    uint16_t olen = enc_confirmation(buffer, ATT_DEFAULT_LE_MTU);
+
+    if (olen > 0)
+        g_attrib_send(attrib, 0, buffer, olen, NULL, NULL, NULL);
+}
+
 void
 events_handler(const uint8_t* data, uint16_t size, gpointer userp)
 {
     GATTRequester* request = (GATTRequester*)userp;
     uint16_t handle = htobs(bt_get_le16(&data[1]));
 
+    if (data[0] == ATT_OP_HANDLE_IND && handle != 0 &&
+            handle == request->_service_changed)
+        request->invalidate_cache();
+
+    if (data[0] == ATT_OP_HANDLE_NOTIFY &&
+            request->record_notification(handle, data, size)) {
+        request->_notifications++;
+        return;
+    }
+
+    // Those have their own listener, see subscription_handler()
+    if (request->is_subscribed(handle, data[0]))
+        return;
+
     switch(data[0]) {
     case ATT_OP_HANDLE_NOTIFY:
+        request->_notifications++;
+        if (request->ring_notification(data, size))
+            return;
+        if (request->batch_notification(data, size))
+            return;
+
         request->on_notification(handle, std::string((const char*)data, size));
         return;
     case ATT_OP_HANDLE_IND:
+        request->_indications++;
         request->on_indication(handle, std::string((const char*)data, size));
         break;
     default:
         throw std::runtime_error("Invalid event opcode!");
     }
 
-    uint8_t buffer[ATT_DEFAULT_LE_MTU];
-    uint16_t olen = enc_confirmation(buffer, ATT_DEFAULT_LE_MTU);
+    send_confirmation(request->_attrib);
+}
 
-    if (olen > 0)
-        g_attrib_send(request->_attrib, 0, buffer, olen, NULL, NULL, NULL);
+gboolean
+batch_timeout_cb(gpointer userp) {
+    GATTRequester* request = (GATTRequester*)userp;
+    request->flush_batch();
+    return false;
 }
 
+// Runs on the loop thread. The first record of a batch arms the delay.
+bool
+GATTRequester::batch_notification(const uint8_t* data, uint16_t size) {
+    if (!_batching)
+        return false;
 
-void exchange_mtu_cb(guint8 status, const guint8* data,
-        guint16 size, gpointer userp)
-{
-    // Note: first byte is the payload size, remove it
-    GATTResponse* response = (GATTResponse*)userp;
-    if (!status && data) {
-        int mtu = ((*(data + 2)) << 8) | (*(data + 1));
-        std::cout << "MTU = " << mtu << std::endl;
-        response->on_response(boost::python::object(mtu));
-        response->notify(status);
+    bool full;
+    {
+        boost::lock_guard<boost::mutex> lock(_batch_lock);
+        if (!_batching)
+            return false;
+
+        size_t offset = _batch_data.size();
+        _batch_data.insert(_batch_data.end(), data + 3, data + size);
+        _batch.push_back(BatchRecord{(uint16_t)bt_get_le16(&data[1]),
+                    g_get_real_time(), offset, (size_t)size - 3});
+
+        full = _batch.size() >= _batch_max;
+        if (!full && _batch_timer == NULL && _loop != NULL) {
+            _batch_timer = g_timeout_source_new(_batch_delay);
+            g_source_set_callback(_batch_timer, batch_timeout_cb,
+                    (gpointer)this, NULL);
+            g_source_attach(_batch_timer, _loop->context());
+        }
     }
+
+    if (full)
+        flush_batch();
+    return true;
 }
 
-int GATTRequester::exchange_mtu(int mtu)
-{
-    PyGILGuard guard;
+// Hands the batch to Python in a single call, as a list of
+// (handle, timestamp, data) tuples. Only the loop thread flushes, so the
+// spare buffers the records are swapped into are its own.
+void
+GATTRequester::flush_batch() {
+    size_t max;
+    {
+        boost::lock_guard<boost::mutex> lock(_batch_lock);
+        if (_batch_timer != NULL) {
+            g_source_destroy(_batch_timer);
+            g_source_unref(_batch_timer);
+            _batch_timer = NULL;
+        }
 
-    GATTResponse response;
-    auto id = gatt_exchange_mtu(_attrib, mtu, exchange_mtu_cb, &response);
+        if (_batch.empty())
+            return;
 
-    if (!id) throw std::runtime_error("exchange_mtu request failed");
+        _batch.swap(_batch_spare);
+        _batch_data.swap(_batch_data_spare);
+        max = _batch_max;
+    }
 
-    if (not response.wait(MAX_WAIT_FOR_PACKET))
     {
-        g_attrib_cancel(_attrib, id);
-        throw std::runtime_error("exchange_mtu timed out");
+        PyGILGuard guard;
+        try {
+            boost::python::list records;
+            for (const BatchRecord& record : _batch_spare) {
+                const char* value =
+                    (const char*)_batch_data_spare.data() + record.offset;
+                records.append(boost::python::make_tuple(record.handle,
+                            record.timestamp,
+                            std::vector<char>(value, value + record.length)));
+            }
+
+            if (!_batch_callback.is_none())
+                _batch_callback(records);
+        } catch(boost::python::error_already_set const&) {
+            PyErr_Print();
+        }
     }
 
-    auto result = response.received();
-    _mtu = boost::python::extract<int>(result[0]);
-    g_attrib_set_mtu(_attrib, _mtu);
-    return _mtu;
+    _batch_spare.clear();
+    _batch_data_spare.clear();
+    _batch_spare.reserve(max);
+    _batch_data_spare.reserve(max * _mtu);
 }
 
+/*
+ * Opt-in: notifications (not the subscribed ones) are collected on the
+ * loop and passed to callback(records) once max_count of them are in, or
+ * max_delay milliseconds after the first one. None goes back to
+ * on_notification; what is pending is still delivered, by the loop.
+ */
 void
-connect_cb(GIOChannel* channel, GError* err, gpointer userp)
-{
-    GATTRequester* request = (GATTRequester*)userp;
-
-    if (err) {
-        request->_state = GATTRequester::STATE_ERROR_CONNECTING;
-        g_error_free(err);
+GATTRequester::set_notification_batch(boost::python::object callback,
+        int max_count, int max_delay) {
+    boost::lock_guard<boost::mutex> lock(_batch_lock);
+
+    if (callback.is_none()) {
+        _batching = false;
+        if (!_batch.empty() && _batch_timer == NULL && _loop != NULL) {
+            _batch_timer = g_timeout_source_new(0);
+            g_source_set_callback(_batch_timer, batch_timeout_cb,
+                    (gpointer)this, NULL);
+            g_source_attach(_batch_timer, _loop->context());
+        }
         return;
     }
 
-    GError *gerr = NULL;
-    uint16_t mtu;
-    uint16_t cid;
-    bt_io_get(channel, &gerr,
-              BT_IO_OPT_IMTU, &mtu,
-              BT_IO_OPT_CID, &cid,
-              BT_IO_OPT_INVALID);
+    if (max_count < 1 || max_delay < 1)
+        throw std::runtime_error("Invalid batch limits");
+
+    // Called with the GIL held, as the loop reads it
+    _batch_callback = callback;
+    _batch_max = max_count;
+    _batch_delay = max_delay;
+    _batch.reserve(max_count);
+    _batch_data.reserve(max_count * _mtu);
+    _batching = true;
+}
+
+/*
+ * Opt-in: notifications (not the subscribed ones) are copied by the loop
+ * straight from the received PDU into a ring of fixed size slots, that
+ * Python reads through ring_buffer() without any object per notification.
+ * Each slot is a RingSlot header followed by value_size bytes; values that
+ * do not fit are cut and flagged. When the ring is full, notifications are
+ * dropped and counted. value_size defaults to the largest value of the
+ * current MTU.
+ */
+void
+GATTRequester::enable_ring(int slots, int value_size) {
+    if (_ring_allocated)
+        throw std::runtime_error("Notification ring already allocated");
+
+    if (value_size == 0)
+        value_size = _mtu - 3;
+
+    if (value_size < 1 || value_size > ATT_MAX_VALUE_LEN)
+        throw std::runtime_error("Invalid ring value size");
+
+    if (spsc_init(&_ring, slots, sizeof(RingSlot) + value_size) < 0)
+        throw std::runtime_error("Invalid ring size, must be a power of two");
+
+    _ring_value_size = _ring.slot_size - sizeof(RingSlot);
+    _ring_allocated = true;
+    _ring_enabled = true;
+}
+
+// Back to on_notification; the ring and what it holds stay readable
+void
+GATTRequester::disable_ring() {
+    _ring_enabled = false;
+}
+
+// Runs on the loop thread, the only producer
+bool
+GATTRequester::ring_notification(const uint8_t* data, uint16_t size) {
+    if (!_ring_enabled)
+        return false;
 
-    // Can't detect MTU, using default
-    if (gerr) {
-        g_error_free(gerr);
-        mtu = ATT_DEFAULT_LE_MTU;
+    uint8_t* slot = spsc_reserve(&_ring);
+    if (slot == NULL) {
+        _ring_dropped++;
+        return true;
     }
 
-    if (cid == ATT_CID) mtu = ATT_DEFAULT_LE_MTU;
+    RingSlot* header = (RingSlot*)slot;
+    size_t length = size - 3;
+
+    header->handle = bt_get_le16(&data[1]);
+    header->flags = 0;
+    if (length > _ring_value_size) {
+        length = _ring_value_size;
+        header->flags |= RING_TRUNCATED;
+    }
+    header->length = length;
+    header->timestamp = g_get_real_time();
+    memcpy(slot + sizeof(RingSlot), data + 3, length);
 
-    request->_attrib = g_attrib_new(channel, mtu);
+    spsc_commit(&_ring);
+    return true;
+}
 
-    request->_notify_id = g_attrib_register(request->_attrib, ATT_OP_HANDLE_NOTIFY,
-        GATTRIB_ALL_HANDLES, events_handler, userp, NULL);
-    request->_indicate_id = g_attrib_register(request->_attrib, ATT_OP_HANDLE_IND,
-        GATTRIB_ALL_HANDLES,  events_handler, userp, NULL);
+// Exports the ring to memoryview, holding a reference to the Python
+// requester that owns it, so no view outlives the memory
+struct RingExport {
+    PyObject_HEAD
+    PyObject* owner;
+    void* data;
+    Py_ssize_t size;
+};
 
-    request->_state = GATTRequester::STATE_CONNECTED;
+static int
+ring_export_getbuffer(PyObject* self, Py_buffer* view, int flags) {
+    RingExport* ring = (RingExport*)self;
+    return PyBuffer_FillInfo(view, self, ring->data, ring->size, 1, flags);
 }
 
-gboolean
-disconnect_cb(GIOChannel* channel, GIOCondition cond, gpointer userp) {
-    GATTRequester* request = (GATTRequester*)userp;
-    request->disconnect();
-    return false;
+static void
+ring_export_dealloc(PyObject* self) {
+    PyTypeObject* type = Py_TYPE(self);
+
+    Py_XDECREF(((RingExport*)self)->owner);
+    type->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    Py_DECREF(type);
+#endif
 }
 
-void
-GATTRequester::connect(bool wait,
-		std::string channel_type, std::string security_level, int psm, int mtu) {
-    if (_state != STATE_DISCONNECTED)
-        throw std::runtime_error("Already connecting or connected");
-
-    _state = STATE_CONNECTING;
-
-    GError *gerr = NULL;
-    _channel = gatt_connect
-        (_device.c_str(),        // 'hciX'
-         _address.c_str(),       // 'mac address'
-         channel_type.c_str(),   // 'public' '[public | random]'
-         security_level.c_str(), // sec_level, '[low | medium | high]'
-         psm,                      // 0, psm
-         mtu,                      // 0, mtu
-         connect_cb,
-         &gerr,
-         (gpointer)this);
-
-    if (_channel == NULL) {
-        _state = STATE_DISCONNECTED;
-
-        std::string msg(gerr->message);
-        g_error_free(gerr);
-        throw std::runtime_error(msg);
+static PyTypeObject*
+ring_export_type() {
+    static PyObject* type = NULL;
+
+    if (type == NULL) {
+        static PyType_Slot slots[] = {
+            {Py_tp_dealloc, (void*)ring_export_dealloc},
+            {Py_bf_getbuffer, (void*)ring_export_getbuffer},
+            {0, NULL},
+        };
+        static PyType_Spec spec = {
+            "gattlib.RingBuffer", sizeof(RingExport), 0,
+            Py_TPFLAGS_DEFAULT, slots,
+        };
+
+        type = PyType_FromSpec(&spec);
+        if (type == NULL)
+            boost::python::throw_error_already_set();
     }
 
-    g_io_add_watch(_channel, G_IO_HUP, disconnect_cb, (gpointer)this);
-    if (wait)
-        check_channel();
+    return (PyTypeObject*)type;
 }
 
+// Read-only view of the whole ring; owner is the Python requester
 boost::python::object
-GATTRequester::connect_kwarg(boost::python::tuple args, boost::python::dict kwargs)
-{
-	// Static method wrapper around connect. First obtain self/this
-	GATTRequester& self = boost::python::extract<GATTRequester&>(args[0]);
+GATTRequester::ring_buffer(boost::python::object owner) {
+    if (!_ring_allocated)
+        throw std::runtime_error("Notification ring not enabled");
 
-	// Argument default values.
-	bool wait=false;
-	std::string channel_type="public";
-	std::string security_level="low";
-	int psm=0;
-	int mtu=0;
-	int kwargsused = 0;
+    PyTypeObject* type = ring_export_type();
+    RingExport* ring = (RingExport*)type->tp_alloc(type, 0);
+    if (ring == NULL)
+        boost::python::throw_error_already_set();
 
-	// Extract each argument either positionally or from the keyword arguments
-	if (boost::python::len(args) > 1) {
-		wait = boost::python::extract<bool>(args[1]);
-	} else if (kwargs.has_key("wait")) {
-		wait = boost::python::extract<bool>(kwargs.get("wait"));
-		kwargsused++;
-	}
-	if (boost::python::len(args) > 2) {
-		channel_type = boost::python::extract<std::string>(args[2]);
-	} else if (kwargs.has_key("channel_type")) {
-		channel_type = boost::python::extract<std::string>(kwargs.get("channel_type"));
-		kwargsused++;
-	}
-	if (boost::python::len(args) > 3) {
-		security_level = boost::python::extract<std::string>(args[3]);
-	} else if (kwargs.has_key("security_level")) {
-		security_level = boost::python::extract<std::string>(kwargs.get("security_level"));
-		kwargsused++;
-	}
-	if (boost::python::len(args) > 4) {
-		psm = boost::python::extract<int>(args[4]);
-	} else if (kwargs.has_key("psm")) {
-		psm = boost::python::extract<int>(kwargs.get("psm"));
-		kwargsused++;
-	}
-	if (boost::python::len(args) > 5) {
-		mtu = boost::python::extract<int>(args[5]);
-	} else if (kwargs.has_key("mtu")) {
-		mtu = boost::python::extract<int>(kwargs.get("mtu"));
-		kwargsused++;
-	}
+    ring->owner = boost::python::incref(owner.ptr());
+    ring->data = _ring.slots;
+    ring->size = spsc_size(&_ring);
 
-	// Check that we have used all keyword arguments
-	if (kwargsused != boost::python::len(kwargs))
-		throw std::runtime_error("Error in keyword arguments");
+    boost::python::handle<> exporter((PyObject*)ring);
+    PyObject* view = PyMemoryView_FromObject(exporter.get());
+    if (view == NULL)
+        boost::python::throw_error_already_set();
 
-	// Call the real method
-	self.connect(wait, channel_type, security_level, psm, mtu);
+    return boost::python::object(boost::python::handle<>(view));
+}
 
-	return boost::python::object(); // boost-ism for "None"
+int
+GATTRequester::ring_slot_size() const {
+    return _ring_allocated ? _ring.slot_size : 0;
 }
 
-bool
-GATTRequester::is_connected() {
-    return _state == STATE_CONNECTED;
+// (first, count): slots ready to be read, from index first on without
+// wrapping around. They stay untouched until given back with
+// ring_release(count).
+boost::python::tuple
+GATTRequester::ring_poll() {
+    uint32_t first = 0, count = 0;
+
+    if (_ring_allocated)
+        count = spsc_peek(&_ring, &first);
+
+    return boost::python::make_tuple(first, count);
 }
 
 void
-GATTRequester::disconnect() {
-    if (_state == STATE_DISCONNECTED)
-        return;
-
-    g_attrib_unref(_attrib);
-    _attrib = NULL;
+GATTRequester::ring_release(int count) {
+    if (_ring_allocated && count > 0)
+        spsc_release(&_ring, count);
+}
 
-    g_io_channel_shutdown(_channel, false, NULL);
-    g_io_channel_unref(_channel);
-    _channel = NULL;
+unsigned long
+GATTRequester::ring_dropped() const {
+    return _ring_dropped;
+}
 
-    _state = STATE_DISCONNECTED;
+/*
+ * Writes notifications of the given handles (all of them if none is
+ * given) to a binary log at path, from the event loop, without going
+ * through Python. Files are preallocated to size bytes and mapped; once
+ * full, recording goes on in "<path>.1", "<path>.2"... keeping only the
+ * last 'segments' files, unless it is 0. Read them with RecordReader.
+ */
+void
+GATTRequester::record(std::string path, boost::python::list handles,
+        unsigned long size, int segments) {
+    std::vector<uint16_t> wanted;
+    for (int i = 0; i < boost::python::len(handles); i++)
+        wanted.push_back(boost::python::extract<uint16_t>(handles[i]));
+
+    // First, the new log may truncate the files the current one maps
+    stop_recording();
+
+    std::unique_ptr<NotificationRecorder> recorder(
+            new NotificationRecorder(path, size, segments));
+    recorder->set_handles(wanted);
+
+    boost::lock_guard<boost::mutex> lock(_recorder_lock);
+    _recorder = std::move(recorder);
+    _recording = true;
 }
 
-static void
-read_by_handler_cb(guint8 status, const guint8* data,
-        guint16 size, gpointer userp) {
-    // Note: first byte is the payload size, remove it
-    GATTResponse* response = (GATTResponse*)userp;
-    if (!status && data) {
-        response->on_response(std::string((const char*)data + 1, size - 1));
+// Completes the current segment; counters are kept for stats()
+void
+GATTRequester::stop_recording() {
+    std::unique_ptr<NotificationRecorder> recorder;
+    {
+        boost::lock_guard<boost::mutex> lock(_recorder_lock);
+        _recording = false;
+        if (!_recorder)
+            return;
+
+        _recorded += _recorder->recorded();
+        _record_dropped += _recorder->dropped();
+        recorder = std::move(_recorder);
     }
-    response->notify(status);
 }
 
-guint
-GATTRequester::read_by_handle_async(uint16_t handle, GATTResponse* response) {
-    check_channel();
-    return gatt_read_char(_attrib, handle, read_by_handler_cb, (gpointer)response);
-}
+// Runs on the loop thread
+bool
+GATTRequester::record_notification(uint16_t handle, const uint8_t* data,
+        uint16_t size) {
+    if (!_recording)
+        return false;
 
-boost::python::list
-GATTRequester::read_by_handle(uint16_t handle) {
-    GATTResponse response;
-    auto id = read_by_handle_async(handle, &response);
+    boost::lock_guard<boost::mutex> lock(_recorder_lock);
+    if (!_recorder || !_recorder->wants(handle))
+        return false;
 
-    if (!id) throw std::runtime_error("read_by_handle failed");
+    _recorder->append(handle, data + 3, size - 3);
+    return true;
+}
 
-    if (not response.wait(MAX_WAIT_FOR_PACKET))
-    {
-        g_attrib_cancel(_attrib, id);
-        throw std::runtime_error("read_by_handle timed out");
-    }
+bool
+GATTRequester::is_recorded(uint16_t handle) {
+    if (!_recording)
+        return false;
 
-    return response.received();
+    boost::lock_guard<boost::mutex> lock(_recorder_lock);
+    return _recorder && _recorder->wants(handle);
 }
 
+// Listener of one subscribed handle, registered with g_attrib_register()
+struct Subscription {
+    GATTRequester* requester;
+    boost::python::object callback;
+};
+
 static void
-read_by_uuid_cb(guint8 status, const guint8* data,
-        guint16 size, gpointer userp) {
-    GATTResponse* response = (GATTResponse*)userp;
-    if (status || !data) {
-        response->notify(status);
-        return;
-    }
+subscription_free(gpointer userp) {
+    PyGILGuard guard;
+    delete (Subscription*)userp;
+}
 
-    struct att_data_list* list = dec_read_by_type_resp(data, size);
-    if (list == NULL) {
-        response->notify(ATT_ECODE_ABORTED);
-        return;
-    }
+void
+subscription_handler(const uint8_t* data, uint16_t size, gpointer userp) {
+    Subscription* sub = (Subscription*)userp;
+    GATTRequester* request = sub->requester;
+    uint16_t handle = htobs(bt_get_le16(&data[1]));
 
-    for (int i=0; i<list->num; i++) {
-        uint8_t* item = list->data[i];
+    // Already written to disk by events_handler()
+    if (data[0] == ATT_OP_HANDLE_NOTIFY && request->is_recorded(handle))
+        return;
 
-        // Remove handle addr
-        item += 2;
+    if (data[0] == ATT_OP_HANDLE_IND)
+        request->_indications++;
+    else
+        request->_notifications++;
 
-        std::string value((const char*)item, list->len - 2);
-        response->on_response(value);
+    {
+        PyGILGuard guard;
+        try {
+            const std::vector<char> value(data + 3, data + size);
+            sub->callback(handle, value);
+        } catch(boost::python::error_already_set const&) {
+            PyErr_Print();
+        }
     }
 
-    att_data_list_free(list);
-    response->notify(status);
+    if (data[0] == ATT_OP_HANDLE_IND)
+        send_confirmation(request->_attrib);
 }
 
-guint
-GATTRequester::read_by_uuid_async(std::string uuid, GATTResponse* response) {
-    PyGILGuard guard;
-
-    uint16_t start = 0x0001;
-    uint16_t end = 0xffff;
-    bt_uuid_t btuuid;
+// A listener only covers the opcode it was registered for, an indication
+// on a handle subscribed for notifications still needs confirming
+bool
+GATTRequester::is_subscribed(uint16_t handle, uint8_t opcode) const {
+    int kind = opcode == ATT_OP_HANDLE_IND;
+    return _subscribed[kind][handle / 64].load(std::memory_order_relaxed) &
+        ((uint64_t)1 << (handle % 64));
+}
 
-    check_channel();
-    if (bt_string_to_uuid(&btuuid, uuid.c_str()) < 0)
-        throw std::runtime_error("Invalid UUID\n");
+void
+GATTRequester::set_subscribed(uint16_t handle, uint8_t opcode) {
+    int kind = opcode == ATT_OP_HANDLE_IND;
+    _subscribed[kind][handle / 64] |= (uint64_t)1 << (handle % 64);
+}
 
-    return gatt_read_char_by_uuid(_attrib, start, end, &btuuid, read_by_uuid_cb,
-                           (gpointer)response);
+void
+GATTRequester::clear_subscribed(uint16_t handle) {
+    uint64_t bit = (uint64_t)1 << (handle % 64);
 
+    _subscribed[0][handle / 64] &= ~bit;
+    _subscribed[1][handle / 64] &= ~bit;
 }
 
-int GATTRequester::mtu() const { return _mtu; }
+// The listeners themselves go away with the GAttrib
+void
+GATTRequester::clear_subscriptions() {
+    boost::lock_guard<boost::mutex> lock(_subscriptions_lock);
+
+    for (const auto& sub : _subscriptions)
+        clear_subscribed(sub.first);
+    _subscriptions.clear();
+}
+
+// Result of a gatt_find_cccd() call, shared with the loop until notify
+struct CCCDLookup {
+    Event done;
+    uint8_t status{0};
+    uint16_t handle{0};
+    std::atomic<int> refs{2};
+};
+
+static void
+cccd_lookup_unref(gpointer userp) {
+    CCCDLookup* lookup = (CCCDLookup*)userp;
+    if (--lookup->refs == 0)
+        delete lookup;
+}
+
+static void
+cccd_found_cb(uint8_t status, uint16_t handle, void* userp) {
+    CCCDLookup* lookup = (CCCDLookup*)userp;
+    lookup->status = status;
+    lookup->handle = handle;
+    lookup->done.set();
+}
+
+// From the cached table if it has descriptors, else from the device
+uint16_t
+GATTRequester::find_cccd(uint16_t value_handle) {
+    if (check_cache() && (_cache->contents() & GATTCache::HAS_DESCRIPTORS)) {
+        GATTCache::Entry cccd;
+        GATTCache::set_uuid(cccd, "00002902-0000-1000-8000-00805f9b34fb");
+
+        // Descriptors of this characteristic end at the next declaration
+        uint32_t limit = 0x10000;
+        for (auto e = _cache->begin(); e != _cache->end(); e++) {
+            if (e->type != GATTCache::DESCRIPTOR && e->handle > value_handle)
+                limit = std::min(limit, (uint32_t)e->handle);
+        }
+
+        for (auto e = _cache->begin(); e != _cache->end(); e++) {
+            if (e->type == GATTCache::DESCRIPTOR &&
+                    e->handle > value_handle && e->handle < limit &&
+                    memcmp(e->uuid, cccd.uuid, sizeof(cccd.uuid)) == 0)
+                return e->handle;
+        }
+
+        throw std::runtime_error("Characteristic has no CCCD");
+    }
+
+    CCCDLookup* lookup = new CCCDLookup();
+    guint id = gatt_find_cccd(_attrib, value_handle, cccd_found_cb,
+            (gpointer)lookup, cccd_lookup_unref);
+    if (!id) {
+        delete lookup;
+        throw std::runtime_error("CCCD lookup failed");
+    }
+
+    bool found = wait_without_gil(lookup->done, MAX_WAIT_FOR_PACKET);
+
+    if (!found) {
+        _timeouts++;
+        cancel_without_gil(_attrib, id);
+        cccd_lookup_unref(lookup);
+        throw std::runtime_error("CCCD lookup timed out");
+    }
+
+    uint8_t status = lookup->status;
+    uint16_t handle = lookup->handle;
+    cccd_lookup_unref(lookup);
+
+    if (status == ATT_ECODE_ATTR_NOT_FOUND)
+        throw std::runtime_error("Characteristic has no CCCD");
+    if (status) {
+        std::string msg = "CCCD lookup failed: ";
+        msg += att_ecode2str(status);
+        throw std::runtime_error(msg);
+    }
+
+    return handle;
+}
+
+/*
+ * Enables notifications (or indications) of a characteristic, given its
+ * value handle, and has callback(handle, data) called for each one. They
+ * no longer reach on_notification/on_indication.
+ */
+void
+GATTRequester::subscribe(uint16_t value_handle,
+        boost::python::object callback, bool indications) {
+    check_connected();
+
+    {
+        boost::lock_guard<boost::mutex> lock(_subscriptions_lock);
+        if (_subscriptions.count(value_handle))
+            throw std::runtime_error("Already subscribed");
+    }
+
+    uint16_t cccd = find_cccd(value_handle);
+
+    // Listen before enabling, so the first event is not lost
+    uint8_t opcode = indications ? ATT_OP_HANDLE_IND : ATT_OP_HANDLE_NOTIFY;
+    Subscription* sub = new Subscription{this, callback};
+    guint id = g_attrib_register(_attrib, opcode, value_handle,
+            subscription_handler, (gpointer)sub, subscription_free);
+    if (!id) {
+        delete sub;
+        throw std::runtime_error("subscribe failed");
+    }
+
+    set_subscribed(value_handle, opcode);
+
+    uint16_t bits = indications ? GATT_CLIENT_CHARAC_CFG_IND_BIT
+                                : GATT_CLIENT_CHARAC_CFG_NOTIF_BIT;
+    std::string value = {(char)(bits & 0xff), (char)(bits >> 8)};
+
+    try {
+        write_by_handle(cccd, value);
+    } catch (std::runtime_error&) {
+        clear_subscribed(value_handle);
+        g_attrib_unregister(_attrib, id);
+        throw;
+    }
+
+    boost::lock_guard<boost::mutex> lock(_subscriptions_lock);
+    _subscriptions[value_handle] = std::make_pair(id, cccd);
+}
+
+void
+GATTRequester::unsubscribe(uint16_t value_handle) {
+    check_connected();
+
+    std::pair<guint, uint16_t> sub;
+    {
+        boost::lock_guard<boost::mutex> lock(_subscriptions_lock);
+        auto it = _subscriptions.find(value_handle);
+        if (it == _subscriptions.end())
+            throw std::runtime_error("Not subscribed");
+
+        sub = it->second;
+        _subscriptions.erase(it);
+    }
+
+    clear_subscribed(value_handle);
+    g_attrib_unregister(_attrib, sub.first);
+    write_by_handle(sub.second, std::string(2, '\0'));
+}
+
+
+void exchange_mtu_cb(guint8 status, const guint8* data,
+        guint16 size, gpointer userp)
+{
+    // Note: first byte is the payload size, remove it
+    GATTResponse* response = (GATTResponse*)userp;
+    if (!status && data) {
+        int mtu = ((*(data + 2)) << 8) | (*(data + 1));
+        std::cout << "MTU = " << mtu << std::endl;
+        {
+            PyGILGuard guard;
+            response->on_response(boost::python::object(mtu));
+        }
+        response->notify(status);
+    }
+}
+
+int GATTRequester::exchange_mtu(int mtu)
+{
+    PyGILGuard guard;
+
+    GATTResponse response;
+    auto id = gatt_exchange_mtu(_attrib, mtu, exchange_mtu_cb, &response);
+
+    if (!id) throw std::runtime_error("exchange_mtu request failed");
+
+    if (not response.wait(MAX_WAIT_FOR_PACKET))
+    {
+        _timeouts++;
+        cancel_without_gil(_attrib, id);
+        throw std::runtime_error("exchange_mtu timed out");
+    }
+
+    auto result = response.received();
+    _mtu = boost::python::extract<int>(result[0]);
+    g_attrib_set_mtu(_attrib, _mtu);
+    return _mtu;
+}
+
+// Called with _lock held, like the other GATTConnection hooks; these
+// replace GATTClient's, events go to events_handler instead
+void
+GATTRequester::connecting() {
+    _ready.clear();
+    _conn_update = _hci_socket > -1;
+    _connect_start = g_get_monotonic_time();
+}
+
+void
+GATTRequester::attached() {
+    _notify_id = g_attrib_register(_attrib, ATT_OP_HANDLE_NOTIFY,
+        GATTRIB_ALL_HANDLES, events_handler, (gpointer)this, NULL);
+    _indicate_id = g_attrib_register(_attrib, ATT_OP_HANDLE_IND,
+        GATTRIB_ALL_HANDLES,  events_handler, (gpointer)this, NULL);
+
+    // The device may have changed while away
+    _cache_state = CACHE_UNCHECKED;
+
+    if (_connect_start != 0) {
+        _connect_latency = g_get_monotonic_time() - _connect_start;
+        _connect_start = 0;
+    }
+    _ready.set();
+}
+
+// Also when disconnected while connecting, from the HUP watch or not
+void
+GATTRequester::failed(const std::string& message) {
+    _ready.set();
+}
+
+void
+GATTRequester::connect(bool wait,
+		std::string channel_type, std::string security_level, int psm, int mtu) {
+    GATTClient::connect(channel_type, security_level, psm, mtu);
+    if (wait)
+        check_channel();
+}
+
+void
+GATTRequester::attach(int fd, int mtu) {
+    GATTClient::attach(fd, mtu);
+}
+
+boost::python::object
+GATTRequester::connect_kwarg(boost::python::tuple args, boost::python::dict kwargs)
+{
+	// Static method wrapper around connect. First obtain self/this
+	GATTRequester& self = boost::python::extract<GATTRequester&>(args[0]);
+
+	// Argument default values.
+	bool wait=false;
+	std::string channel_type="public";
+	std::string security_level="low";
+	int psm=0;
+	int mtu=0;
+	int kwargsused = 0;
+
+	// Extract each argument either positionally or from the keyword arguments
+	if (boost::python::len(args) > 1) {
+		wait = boost::python::extract<bool>(args[1]);
+	} else if (kwargs.has_key("wait")) {
+		wait = boost::python::extract<bool>(kwargs.get("wait"));
+		kwargsused++;
+	}
+	if (boost::python::len(args) > 2) {
+		channel_type = boost::python::extract<std::string>(args[2]);
+	} else if (kwargs.has_key("channel_type")) {
+		channel_type = boost::python::extract<std::string>(kwargs.get("channel_type"));
+		kwargsused++;
+	}
+	if (boost::python::len(args) > 3) {
+		security_level = boost::python::extract<std::string>(args[3]);
+	} else if (kwargs.has_key("security_level")) {
+		security_level = boost::python::extract<std::string>(kwargs.get("security_level"));
+		kwargsused++;
+	}
+	if (boost::python::len(args) > 4) {
+		psm = boost::python::extract<int>(args[4]);
+	} else if (kwargs.has_key("psm")) {
+		psm = boost::python::extract<int>(kwargs.get("psm"));
+		kwargsused++;
+	}
+	if (boost::python::len(args) > 5) {
+		mtu = boost::python::extract<int>(args[5]);
+	} else if (kwargs.has_key("mtu")) {
+		mtu = boost::python::extract<int>(kwargs.get("mtu"));
+		kwargsused++;
+	}
+
+	// Check that we have used all keyword arguments
+	if (kwargsused != boost::python::len(kwargs))
+		throw std::runtime_error("Error in keyword arguments");
+
+	// Call the real method
+	self.connect(wait, channel_type, security_level, psm, mtu);
+
+	return boost::python::object(); // boost-ism for "None"
+}
+
+// Off the loop, waits for the pending requests to be aborted there, and
+// their callbacks take the GIL
+void
+GATTRequester::disconnect() {
+    clear_subscriptions();
+
+    if (!Py_IsInitialized() || !PyGILState_Check()) {
+        GATTClient::disconnect();
+    } else {
+        PyAllowThreads allow;
+        GATTClient::disconnect();
+    }
+
+    // Threads in check_channel() for an abandoned connect fail right away
+    _ready.set();
+}
+
+// Hands a value from GATTClient over to a GATTResponse
+static GATTClient::ReadCallback
+response_read_cb(GATTResponse* response) {
+    return [response](uint8_t status, ByteSpan value) {
+        if (!status)
+            response->on_response(std::string((const char*)value.data(),
+                    value.size()));
+        response->notify(status);
+    };
+}
+
+guint
+GATTRequester::read_by_handle_async(uint16_t handle, GATTResponse* response,
+                                    int timeout) {
+    check_channel();
+    return read(handle, response_read_cb(response), timeout);
+}
+
+boost::python::list
+GATTRequester::read_by_handle(uint16_t handle) {
+    GATTResponse response;
+    auto id = read_by_handle_async(handle, &response);
+
+    if (!id) throw std::runtime_error("read_by_handle failed");
+
+    if (not response.wait(MAX_WAIT_FOR_PACKET))
+    {
+        _timeouts++;
+        cancel_without_gil(_attrib, id);
+        throw std::runtime_error("read_by_handle timed out");
+    }
+
+    return response.received();
+}
+
+guint
+GATTRequester::read_long_async(uint16_t handle, GATTResponse* response,
+                               uint16_t offset, int timeout) {
+    check_channel();
+    return GATTClient::read_long(handle, offset,
+        [response](uint16_t at, ByteSpan value) {
+            response->on_chunk(at, std::string((const char*)value.data(),
+                    value.size()));
+        },
+        [response](uint8_t status) { response->notify(status); },
+        timeout);
+}
+
+boost::python::list
+GATTRequester::read_long(uint16_t handle, uint16_t offset,
+                         uint16_t size_hint) {
+    GATTResponse response;
+
+    check_channel();
+    auto id = GATTClient::read_long(handle, offset, size_hint,
+                                    response_read_cb(&response));
+
+    if (not response.wait(MAX_WAIT_FOR_PACKET))
+    {
+        _timeouts++;
+        cancel_without_gil(_attrib, id);
+        throw std::runtime_error("read_long timed out");
+    }
+
+    return response.received();
+}
+
+// State shared by the Read Multiple requests of one read_multiple call.
+// Every request holds a reference, dropped by g_attrib when it is done.
+struct ReadMultiple {
+    GATTResponse* response;
+    std::vector<size_t> sizes;
+    std::vector<size_t> ends;   // one past the last handle of each request
+    size_t completed{0};
+    bool done{false};
+    std::atomic<int> refs{1};
+};
+
+static void
+read_multiple_unref(gpointer userp) {
+    ReadMultiple* read = (ReadMultiple*)userp;
+    if (--read->refs == 0)
+        delete read;
+}
+
+static void
+read_multiple_cb(guint8 status, const guint8* data,
+        guint16 size, gpointer userp) {
+    ReadMultiple* read = (ReadMultiple*)userp;
+
+    // Responses come back in request order
+    size_t request = read->completed++;
+    size_t first = request > 0 ? read->ends[request - 1] : 0;
+
+    if (read->done)
+        return;
+
+    if (status || !data) {
+        read->done = true;
+        read->response->notify(status ? status : ATT_ECODE_ABORTED);
+        return;
+    }
+
+    // Note: first byte is the opcode, then the values back to back
+    size_t offset = 1;
+    for (size_t i = first; i < read->ends[request]; i++) {
+        size_t len = std::min(read->sizes[i], (size_t)size - offset);
+        read->response->on_response(
+            std::string((const char*)data + offset, len));
+        offset += len;
+    }
+
+    if (read->completed == read->ends.size()) {
+        read->done = true;
+        read->response->notify(0);
+    }
+}
+
+// Packs as many handles as fit in the MTU, both in the request and in the
+// response, into each Read Multiple Request. A lone handle is sent as a
+// plain Read Request. All of them are queued at once.
+std::vector<guint>
+GATTRequester::send_read_multiple(boost::python::list handles,
+        boost::python::list sizes, GATTResponse* response, int timeout) {
+    size_t count = boost::python::len(handles);
+    size_t nsizes = boost::python::len(sizes);
+
+    if (count == 0)
+        throw std::runtime_error("No handles given");
+    if (nsizes != 1 && nsizes != count)
+        throw std::runtime_error("Give one size, or one size per handle");
+
+    // Before allocating anything, extract() throws on bad arguments
+    std::vector<uint16_t> hvec;
+    std::vector<size_t> svec;
+    for (size_t i = 0; i < count; i++) {
+        hvec.push_back(boost::python::extract<uint16_t>(handles[i]));
+        svec.push_back(boost::python::extract<size_t>(
+                    sizes[nsizes == 1 ? 0 : i]));
+        if (svec.back() == 0)
+            throw std::runtime_error("Value sizes must not be 0");
+    }
+
+    check_channel();
+
+    ReadMultiple* read = new ReadMultiple();
+    read->response = response;
+    read->sizes = svec;
+
+    size_t payload = _mtu - 1;
+    for (size_t first = 0; first < count; ) {
+        size_t last = first, bytes = 0;
+
+        while (last < count && (last - first + 1) * 2 <= payload &&
+                bytes + read->sizes[last] <= payload)
+            bytes += read->sizes[last++];
+
+        // Larger than the MTU on its own, the value will be truncated
+        if (last == first)
+            last++;
+
+        read->ends.push_back(last);
+        first = last;
+    }
+
+    std::vector<guint> ids;
+    size_t first = 0;
+    for (size_t end : read->ends) {
+        guint id;
+        read->refs++;
+
+        if (end - first > 1) {
+            id = gatt_read_multiple(_attrib, &hvec[first], end - first,
+                    read_multiple_cb, (gpointer)read, read_multiple_unref);
+        } else {
+            size_t buflen;
+            uint8_t* buf = g_attrib_get_buffer(_attrib, &buflen);
+            guint16 plen = enc_read_req(hvec[first], buf, buflen);
+            id = g_attrib_send(_attrib, 0, buf, plen, read_multiple_cb,
+                    (gpointer)read, read_multiple_unref);
+        }
+
+        if (!id) {
+            read->refs--;
+            for (guint sent : ids)
+                cancel_without_gil(_attrib, sent);
+            read_multiple_unref(read);
+            throw std::runtime_error("read_multiple failed");
+        }
+
+        set_deadline(id, timeout);
+        ids.push_back(id);
+        first = end;
+    }
+
+    read_multiple_unref(read);
+    return ids;
+}
+
+// The ids of all the requests sent, one per Read Multiple Request
+boost::python::list
+GATTRequester::read_multiple_async(boost::python::list handles,
+        boost::python::list sizes, GATTResponse* response, int timeout) {
+    boost::python::list result;
+    for (guint id : send_read_multiple(handles, sizes, response, timeout))
+        result.append(id);
+    return result;
+}
+
+boost::python::list
+GATTRequester::read_multiple(boost::python::list handles,
+        boost::python::list sizes) {
+    GATTResponse response;
+    auto ids = send_read_multiple(handles, sizes, &response, 0);
+
+    if (not response.wait(MAX_WAIT_FOR_PACKET))
+    {
+        _timeouts++;
+        for (guint id : ids)
+            cancel_without_gil(_attrib, id);
+        throw std::runtime_error("read_multiple timed out");
+    }
+
+    return response.received();
+}
+
+// State of one read_multiple_variable call. Values are collected by
+// position and handed to the response in order once all of them are in.
+// Every request it sends, including those sent again by the loop, is in
+// ids, so a caller that gives up can cancel them all.
+struct ReadVariable {
+    GAttrib* attrib;
+    GATTResponse* response;
+    std::shared_ptr<std::atomic<bool> > vl_supported;
+    int timeout;
+    std::vector<uint16_t> handles;
+    std::vector<std::string> values;
+    size_t pending;
+    std::atomic<bool> done{false};
+    std::atomic<int> refs{1};
+    boost::mutex lock;
+    std::vector<guint> ids;
+};
+
+// One request on behalf of a ReadVariable, for handles [first, last)
+struct ReadVariablePart {
+    ReadVariable* read;
+    size_t first;
+    size_t last;
+};
+
+static void
+read_variable_unref(ReadVariable* read) {
+    if (--read->refs > 0)
+        return;
+
+    g_attrib_unref(read->attrib);
+    delete read;
+}
+
+static void
+read_variable_part_free(gpointer userp) {
+    ReadVariablePart* part = (ReadVariablePart*)userp;
+    read_variable_unref(part->read);
+    delete part;
+}
+
+static void
+read_variable_done(ReadVariable* read, uint8_t status) {
+    if (read->done.exchange(true))
+        return;
+
+    if (status == 0) {
+        for (const std::string& value : read->values)
+            read->response->on_response(value);
+    }
+
+    read->response->notify(status);
+}
+
+static void read_variable_single_cb(guint8, const guint8*, guint16, gpointer);
+static void read_variable_cb(guint8, const guint8*, guint16, gpointer);
+
+// Queues the request for handles [first, last): a Read Multiple Variable
+// Length Request if the peer takes them, else pipelined (long) reads.
+static bool
+read_variable_send(ReadVariable* read, size_t first, size_t last) {
+    bool multiple = last - first > 1 && *read->vl_supported;
+
+    for (size_t i = first; i < last; i++) {
+        ReadVariablePart* part = new ReadVariablePart{read, i, i + 1};
+        if (multiple)
+            part->last = last;
+
+        read->refs++;
+
+        guint id;
+        if (multiple)
+            id = gatt_read_multiple_vl(read->attrib, &read->handles[first],
+                    last - first, read_variable_cb, (gpointer)part,
+                    read_variable_part_free);
+        else
+            id = gatt_read_char_full(read->attrib, read->handles[i],
+                    read_variable_single_cb, (gpointer)part,
+                    read_variable_part_free);
+
+        if (!id) {
+            read->refs--;
+            delete part;
+            return false;
+        }
+
+        if (read->timeout > 0)
+            g_attrib_set_deadline(read->attrib, id, read->timeout);
+
+        {
+            boost::lock_guard<boost::mutex> lock(read->lock);
+            read->ids.push_back(id);
+        }
+
+        if (multiple)
+            break;
+    }
+
+    return true;
+}
+
+// Marks the read done, so callbacks still to come leave the response
+// alone, and cancels whatever is left. Off the loop, the cancel waits for
+// the loop, so a callback already past the done check has returned.
+static void
+read_variable_abandon(ReadVariable* read) {
+    read->done = true;
+
+    std::vector<guint> ids;
+    {
+        boost::lock_guard<boost::mutex> lock(read->lock);
+        ids = read->ids;
+    }
+
+    for (guint id : ids)
+        cancel_without_gil(read->attrib, id);
+}
+
+static void
+read_variable_single_cb(guint8 status, const guint8* data,
+        guint16 size, gpointer userp) {
+    ReadVariablePart* part = (ReadVariablePart*)userp;
+    ReadVariable* read = part->read;
+
+    if (read->done)
+        return;
+
+    if (status || !data) {
+        read_variable_done(read, status ? status : ATT_ECODE_ABORTED);
+        return;
+    }
+
+    // Note: first byte is the opcode
+    read->values[part->first] = std::string((const char*)data + 1, size - 1);
+    if (--read->pending == 0)
+        read_variable_done(read, 0);
+}
+
+static void
+read_variable_cb(guint8 status, const guint8* data,
+        guint16 size, gpointer userp) {
+    ReadVariablePart* part = (ReadVariablePart*)userp;
+    ReadVariable* read = part->read;
+
+    if (read->done)
+        return;
+
+    // Older peers: remember it and read one by one from now on
+    if (status == ATT_ECODE_REQ_NOT_SUPP) {
+        *read->vl_supported = false;
+        if (!read_variable_send(read, part->first, part->last))
+            read_variable_done(read, ATT_ECODE_IO);
+        return;
+    }
+
+    if (status || !data) {
+        read_variable_done(read, status ? status : ATT_ECODE_ABORTED);
+        return;
+    }
+
+    size_t i = part->first, offset = 0;
+    const uint8_t* value;
+    uint16_t vlen;
+    ssize_t n;
+
+    while (i < part->last &&
+            (n = dec_read_multi_vl_resp(data, size, &offset, &value,
+                                        &vlen)) >= 0) {
+        // The PDU was full, the rest of this value needs its own read
+        if (n < vlen)
+            break;
+
+        read->values[i++] = std::string((const char*)value, vlen);
+        read->pending--;
+    }
+
+    if (i == part->last) {
+        if (read->pending == 0)
+            read_variable_done(read, 0);
+        return;
+    }
+
+    // The value at i would fill any PDU it starts, so it gets a long read
+    // of its own, and the handles after it another request
+    if (!read_variable_send(read, i, i + 1) ||
+            (i + 1 < part->last &&
+             !read_variable_send(read, i + 1, part->last)))
+        read_variable_done(read, ATT_ECODE_IO);
+}
+
+// The caller gets its own reference to the returned state
+ReadVariable*
+GATTRequester::send_read_variable(boost::python::list handles,
+        GATTResponse* response, int timeout) {
+    size_t count = boost::python::len(handles);
+    if (count == 0)
+        throw std::runtime_error("No handles given");
+
+    // Before allocating anything, extract() throws on bad arguments
+    std::vector<uint16_t> hvec;
+    for (size_t i = 0; i < count; i++)
+        hvec.push_back(boost::python::extract<uint16_t>(handles[i]));
+
+    check_channel();
+
+    ReadVariable* read = new ReadVariable();
+    read->attrib = g_attrib_ref(_attrib);
+    read->response = response;
+    read->vl_supported = _read_vl_supported;
+    read->timeout = timeout;
+    read->handles = hvec;
+    read->pending = count;
+    read->values.resize(count);
+    read->refs++;
+
+    // Only the request has to fit, values that do not are read again
+    size_t per_request = (_mtu - 1) / 2;
+
+    for (size_t first = 0; first < count; first += per_request) {
+        size_t last = std::min(first + per_request, count);
+
+        if (!read_variable_send(read, first, last)) {
+            read_variable_abandon(read);
+            read_variable_unref(read);
+            read_variable_unref(read);
+            throw std::runtime_error("read_multiple_variable failed");
+        }
+    }
+
+    read_variable_unref(read);
+    return read;
+}
+
+guint
+GATTRequester::read_multiple_variable_async(boost::python::list handles,
+        GATTResponse* response, int timeout) {
+    ReadVariable* read = send_read_variable(handles, response, timeout);
+
+    guint id;
+    {
+        boost::lock_guard<boost::mutex> lock(read->lock);
+        id = read->ids[0];
+    }
+
+    read_variable_unref(read);
+    return id;
+}
+
+boost::python::list
+GATTRequester::read_multiple_variable(boost::python::list handles) {
+    GATTResponse response;
+    ReadVariable* read = send_read_variable(handles, &response, 0);
+
+    if (not response.wait(MAX_WAIT_FOR_PACKET))
+    {
+        _timeouts++;
+        read_variable_abandon(read);
+        read_variable_unref(read);
+        throw std::runtime_error("read_multiple_variable timed out");
+    }
+
+    read_variable_unref(read);
+    return response.received();
+}
+
+// State of one read_handles call. Each handle has a result slot,
+// filled by the loop thread; every request holds a reference.
+struct ReadHandles {
+    boost::mutex lock;
+    std::vector<uint8_t> status;
+    std::vector<std::string> values;
+    size_t pending;
+    Event done;
+    bool timed_out{false};
+    std::atomic<int> refs{1};
+};
+
+struct ReadHandlesPart {
+    ReadHandles* read;
+    size_t index;
+    bool answered;
+};
+
+static void
+read_handles_unref(ReadHandles* read) {
+    if (--read->refs == 0)
+        delete read;
+}
+
+static void
+read_handles_result(ReadHandles* read, size_t index, uint8_t status,
+        std::string value) {
+    boost::lock_guard<boost::mutex> lock(read->lock);
+    read->status[index] = status;
+    read->values[index] = value;
+
+    if (--read->pending == 0)
+        read->done.set();
+}
+
+static void
+read_handles_cb(guint8 status, const guint8* data,
+        guint16 size, gpointer userp) {
+    ReadHandlesPart* part = (ReadHandlesPart*)userp;
+    part->answered = true;
+
+    // Note: first byte is the opcode
+    if (status || !data)
+        read_handles_result(part->read, part->index,
+                status ? status : ATT_ECODE_ABORTED, std::string());
+    else
+        read_handles_result(part->read, part->index, 0,
+                std::string((const char*)data + 1, size - 1));
+}
+
+// Dropped without an answer: cancelled when the call timed out, or the
+// link went down
+static void
+read_handles_part_free(gpointer userp) {
+    ReadHandlesPart* part = (ReadHandlesPart*)userp;
+
+    if (!part->answered) {
+        ReadHandles* read = part->read;
+        bool timed_out;
+        {
+            boost::lock_guard<boost::mutex> lock(read->lock);
+            timed_out = read->timed_out;
+        }
+
+        read_handles_result(read, part->index,
+                timed_out ? ATT_ECODE_TIMEOUT : ATT_ECODE_ABORTED,
+                std::string());
+    }
+
+    read_handles_unref(part->read);
+    delete part;
+}
+
+/*
+ * Reads every handle with its own Read Request, all queued at once, so
+ * each goes out as soon as the previous one is answered. Returns a
+ * (handle, status, data) tuple per handle, in order; status is 0 or the
+ * ATT error of that read, whose data is then empty. timeout, in
+ * milliseconds, bounds the whole call; reads still unanswered then, queued
+ * or on the air, report ATT_ECODE_TIMEOUT.
+ */
+boost::python::list
+GATTRequester::read_handles(boost::python::list handles, int timeout) {
+    size_t count = boost::python::len(handles);
+    std::vector<uint16_t> hvec;
+    for (size_t i = 0; i < count; i++)
+        hvec.push_back(boost::python::extract<uint16_t>(handles[i]));
+
+    boost::python::list result;
+    if (count == 0)
+        return result;
+
+    check_channel();
+
+    ReadHandles* read = new ReadHandles();
+    read->status.assign(count, ATT_ECODE_TIMEOUT);
+    read->values.resize(count);
+    read->pending = count;
+
+    std::vector<guint> ids;
+    for (size_t i = 0; i < count; i++) {
+        ReadHandlesPart* part = new ReadHandlesPart{read, i, false};
+        read->refs++;
+
+        guint id = gatt_read_char_full(_attrib, hvec[i], read_handles_cb,
+                (gpointer)part, read_handles_part_free);
+        if (!id) {
+            read->refs--;
+            delete part;
+            for (guint sent : ids)
+                cancel_without_gil(_attrib, sent);
+            read_handles_unref(read);
+            throw std::runtime_error("read_handles failed");
+        }
+
+        set_deadline(id, timeout);
+        ids.push_back(id);
+    }
+
+    int wait = timeout > 0 ? timeout : MAX_WAIT_FOR_PACKET;
+    if (not wait_without_gil(read->done, wait)) {
+        _timeouts++;
+        {
+            boost::lock_guard<boost::mutex> lock(read->lock);
+            read->timed_out = true;
+        }
+        for (guint id : ids)
+            cancel_without_gil(_attrib, id);
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(read->lock);
+        for (size_t i = 0; i < count; i++)
+            result.append(boost::python::make_tuple(hvec[i], read->status[i],
+                    std::vector<char>(read->values[i].begin(),
+                                      read->values[i].end())));
+    }
+
+    read_handles_unref(read);
+    return result;
+}
+
+static void
+read_by_uuid_cb(guint8 status, const guint8* data,
+        guint16 size, gpointer userp) {
+    GATTResponse* response = (GATTResponse*)userp;
+    if (status || !data) {
+        response->notify(status);
+        return;
+    }
+
+    struct att_data_list* list = dec_read_by_type_resp(data, size);
+    if (list == NULL) {
+        response->notify(ATT_ECODE_ABORTED);
+        return;
+    }
+
+    for (int i=0; i<list->num; i++) {
+        uint8_t* item = list->data[i];
+
+        // Remove handle addr
+        item += 2;
+
+        std::string value((const char*)item, list->len - 2);
+        response->on_response(value);
+    }
+
+    att_data_list_free(list);
+    response->notify(status);
+}
+
+guint
+GATTRequester::read_by_uuid_async(std::string uuid, GATTResponse* response,
+                                  int timeout) {
+    PyGILGuard guard;
+
+    uint16_t start = 0x0001;
+    uint16_t end = 0xffff;
+    bt_uuid_t btuuid;
+
+    check_channel();
+    if (bt_string_to_uuid(&btuuid, uuid.c_str()) < 0)
+        throw std::runtime_error("Invalid UUID\n");
+
+    auto id = gatt_read_char_by_uuid(_attrib, start, end, &btuuid, read_by_uuid_cb,
+                           (gpointer)response);
+    set_deadline(id, timeout);
+    return id;
+}
+
+// Milliseconds from connect() to the link being ready, for the last one
+double
+GATTRequester::connect_latency() const {
+    return _connect_latency / 1000.0;
+}
 
 boost::python::list
 GATTRequester::read_by_uuid(std::string uuid) {
@@ -451,73 +1668,303 @@ GATTRequester::read_by_uuid(std::string uuid) {
 
     if (not response.wait(MAX_WAIT_FOR_PACKET))
     {
-        g_attrib_cancel(_attrib, id);
+        _timeouts++;
+        cancel_without_gil(_attrib, id);
         throw std::runtime_error("read_by_uuid timed out");
     }
 
-    return response.received();
+    return response.received();
+}
+
+guint
+GATTRequester::write_by_handle_async(uint16_t handle, std::string data,
+                                     GATTResponse* response, int timeout) {
+    PyGILGuard guard;
+    check_channel();
+
+    // Python has always received the response PDU, which is its opcode
+    return write(handle, ByteSpan((const uint8_t*)data.data(), data.size()),
+        [response](uint8_t status) {
+            if (!status)
+                response->on_response(std::string(1, (char)ATT_OP_WRITE_RESP));
+            response->notify(status);
+        }, timeout);
+}
+
+boost::python::list
+GATTRequester::write_by_handle(uint16_t handle, std::string data)
+{
+    GATTResponse response;
+
+    auto id = write_by_handle_async(handle, data, &response);
+
+    if (not response.wait(MAX_WAIT_FOR_PACKET))
+    {
+        _timeouts++;
+        cancel_without_gil(_attrib, id);
+        throw std::runtime_error("write_by_handle timed out");
+    }
+
+    return response.received();
+}
+
+// One part of a value, as queued by a Prepare Write request
+struct PreparedWrite {
+    uint16_t handle;
+    uint16_t offset;
+    std::string value;
+};
+
+// State of one commit. Every request holds a reference, dropped by
+// g_attrib when it is done.
+struct PreparedWrites {
+    GAttrib* attrib;
+    GATTResponse* response;
+    bool verify;
+    std::vector<PreparedWrite> parts;
+    size_t acked;
+    uint8_t status;
+    std::atomic<bool> done{false};
+    std::atomic<int> refs{1};
+};
+
+struct PreparedWriteRef {
+    PreparedWrites* writes;
+    size_t index;
+};
+
+static void
+prepared_writes_unref(PreparedWrites* writes) {
+    if (--writes->refs > 0)
+        return;
+
+    g_attrib_unref(writes->attrib);
+    delete writes;
+}
+
+static void
+prepared_write_ref_free(gpointer userp) {
+    PreparedWriteRef* ref = (PreparedWriteRef*)userp;
+    prepared_writes_unref(ref->writes);
+    delete ref;
+}
+
+static void
+prepared_writes_done(PreparedWrites* writes, uint8_t status) {
+    if (writes->done.exchange(true))
+        return;
+
+    writes->response->notify(status);
+}
+
+static void
+execute_write_cb(guint8 status, const guint8* data, guint16 size,
+        gpointer userp) {
+    PreparedWrites* writes = ((PreparedWriteRef*)userp)->writes;
+    prepared_writes_done(writes, writes->status ? writes->status : status);
+}
+
+static void
+prepare_write_cb(guint8 status, const guint8* data, guint16 size,
+        gpointer userp) {
+    PreparedWriteRef* ref = (PreparedWriteRef*)userp;
+    PreparedWrites* writes = ref->writes;
+
+    if (writes->done)
+        return;
+
+    if (status) {
+        if (!writes->status)
+            writes->status = status;
+    } else if (writes->verify) {
+        const PreparedWrite& part = writes->parts[ref->index];
+        uint8_t value[ATT_MAX_VALUE_LEN + 3];
+        uint16_t handle, offset;
+        size_t vlen;
+
+        if (!dec_prep_write_resp(data, size, &handle, &offset, value, &vlen)
+                || handle != part.handle || offset != part.offset
+                || vlen != part.value.size()
+                || memcmp(value, part.value.data(), vlen) != 0) {
+            if (!writes->status)
+                writes->status = ATT_ECODE_UNLIKELY;
+        }
+    }
+
+    // Requests are answered in order, the last one closes the transaction
+    if (++writes->acked < writes->parts.size())
+        return;
+
+    uint8_t flags = writes->status ? ATT_CANCEL_ALL_PREP_WRITES
+                                   : ATT_WRITE_ALL_PREP_WRITES;
+
+    PreparedWriteRef* exec = new PreparedWriteRef{writes, 0};
+    writes->refs++;
+
+    if (!gatt_execute_write_full(writes->attrib, flags, execute_write_cb,
+                (gpointer)exec, prepared_write_ref_free)) {
+        writes->refs--;
+        delete exec;
+        prepared_writes_done(writes,
+                writes->status ? writes->status : ATT_ECODE_IO);
+    }
+}
+
+GATTTransaction::GATTTransaction(GATTRequester& requester, bool verify) :
+    _requester(requester),
+    _verify(verify) {
+}
+
+void
+GATTTransaction::write(uint16_t handle, std::string data) {
+    if (data.size() > ATT_MAX_VALUE_LEN)
+        throw std::runtime_error("Attribute value too long");
+
+    _writes.push_back(std::make_pair(handle, data));
+}
+
+size_t
+GATTTransaction::size() const {
+    return _writes.size();
 }
 
-static void
-write_by_handle_cb(guint8 status, const guint8* data,
-        guint16 size, gpointer userp) {
-    GATTResponse* response = (GATTResponse*)userp;
-    if (!status && data) {
-        response->on_response(std::string((const char*)data, size));
-    }
-    response->notify(status);
+void
+GATTTransaction::clear() {
+    _writes.clear();
 }
 
-guint
-GATTRequester::write_by_handle_async(uint16_t handle, std::string data,
-                                     GATTResponse* response) {
-    PyGILGuard guard;
-    check_channel();
-    auto id = gatt_write_char(_attrib, handle, (const uint8_t*)data.data(), data.size(),
-                    write_by_handle_cb, (gpointer)response);
+// With state, the caller gets a reference to drop with
+// prepared_writes_unref()
+std::vector<guint>
+GATTTransaction::send(GATTResponse* response, int timeout,
+        PreparedWrites** state) {
+    if (_writes.empty())
+        throw std::runtime_error("Nothing to commit");
+
+    _requester.check_channel();
+
+    PreparedWrites* writes = new PreparedWrites();
+    writes->attrib = g_attrib_ref(_requester._attrib);
+    writes->response = response;
+    writes->verify = _verify;
+    writes->acked = 0;
+    writes->status = 0;
+
+    // Split each value in parts that fit a Prepare Write request
+    size_t per_part = _requester._mtu - 5;
+    for (const auto& write : _writes) {
+        size_t offset = 0;
+        do {
+            writes->parts.push_back(PreparedWrite{write.first,
+                    (uint16_t)offset, write.second.substr(offset, per_part)});
+            offset += per_part;
+        } while (offset < write.second.size());
+    }
 
-    if (!id) throw std::runtime_error("write_by_handle_async failed");
+    // All of them are queued at once, g_attrib sends the next as soon
+    // as the previous one is answered
+    std::vector<guint> ids;
+    for (size_t i = 0; i < writes->parts.size(); i++) {
+        const PreparedWrite& part = writes->parts[i];
+        PreparedWriteRef* ref = new PreparedWriteRef{writes, i};
+        writes->refs++;
+
+        guint id = gatt_prepare_write(writes->attrib, part.handle,
+                part.offset, (const uint8_t*)part.value.data(),
+                part.value.size(), prepare_write_cb, (gpointer)ref,
+                prepared_write_ref_free);
+
+        if (!id) {
+            writes->refs--;
+            delete ref;
+            writes->done = true;
+            for (guint id : ids)
+                cancel_without_gil(writes->attrib, id);
+            gatt_execute_write(writes->attrib, ATT_CANCEL_ALL_PREP_WRITES,
+                    NULL, NULL);
+            prepared_writes_unref(writes);
+            throw std::runtime_error("commit failed");
+        }
 
-    return id;
+        _requester.set_deadline(id, timeout);
+        ids.push_back(id);
+    }
+
+    if (state != NULL)
+        *state = writes;
+    else
+        prepared_writes_unref(writes);
+
+    _writes.clear();
+    return ids;
 }
 
+// One id per Prepare Write, a cancel must cover them all
 boost::python::list
-GATTRequester::write_by_handle(uint16_t handle, std::string data)
-{
-    GATTResponse response;
+GATTTransaction::commit_async(GATTResponse* response, int timeout) {
+    boost::python::list result;
+    for (guint id : send(response, timeout))
+        result.append(id);
+    return result;
+}
 
-    auto id = write_by_handle_async(handle, data, &response);
+void
+GATTTransaction::commit() {
+    GATTResponse response;
+    PreparedWrites* writes;
+    auto ids = send(&response, 0, &writes);
+    bool answered;
+
+    try {
+        answered = response.wait(MAX_WAIT_FOR_PACKET);
+    } catch (std::runtime_error&) {
+        prepared_writes_unref(writes);
+        throw;
+    }
 
-    if (not response.wait(MAX_WAIT_FOR_PACKET))
+    if (not answered)
     {
-        g_attrib_cancel(_attrib, id);
-        throw std::runtime_error("write_by_handle timed out");
+        // The Execute Write may be queued already, keep it off response
+        writes->done = true;
+        prepared_writes_unref(writes);
+
+        _requester._timeouts++;
+        for (guint id : ids)
+            cancel_without_gil(_requester._attrib, id);
+        gatt_execute_write(_requester._attrib, ATT_CANCEL_ALL_PREP_WRITES,
+                NULL, NULL);
+        throw std::runtime_error("commit timed out");
     }
 
-    return response.received();
+    prepared_writes_unref(writes);
 }
 
 void
 GATTRequester::write_cmd_by_handle(uint16_t handle, std::string data) {
     check_channel();
-    gatt_write_cmd(_attrib, handle, (const uint8_t*)data.data(), data.size(),
-		   NULL, NULL);
+
+    // Submission is thread safe, let other producers in while encoding
+    PyAllowThreads unlock;
+    write_cmd(handle, ByteSpan((const uint8_t*)data.data(), data.size()));
 }
 
+/*
+ * Blocks until connection_connect_cb() has the link ready, without polling. The first
+ * caller after a connect() also updates the connection parameters.
+ */
 void
 GATTRequester::check_channel() {
-    time_t ts = time(NULL);
-    bool should_update = false;
-
-    while (_channel == NULL || _attrib == NULL) {
-        should_update = true;
+    if (_attrib == NULL) {
+        if (_state == STATE_CONNECTING)
+            wait_without_gil(_ready, MAX_WAIT_FOR_PACKET);
 
-        usleep(1000);
-        if (time(NULL) - ts > MAX_WAIT_FOR_PACKET)
+        if (_state == STATE_ERROR_CONNECTING)
+            throw std::runtime_error("Could not connect");
+        if (_attrib == NULL)
             throw std::runtime_error("Channel or attrib not ready");
     }
 
-    if (should_update) {
+    if (_conn_update.exchange(false)) {
         // Update connection settings (supervisor timeut > 0.42 s)
         int l2cap_sock = g_io_channel_unix_get_fd(_channel);
         struct l2cap_conninfo info;
@@ -545,13 +1992,16 @@ discover_primary_cb(guint8 status, GSList *services, void *userp) {
         return;
     }
 
-    for (GSList * l = services; l; l = l->next) {
-        struct gatt_primary *prim = (gatt_primary*) l->data;
-        boost::python::dict sdescr;
-        sdescr["uuid"] = prim->uuid;
-        sdescr["start"] = prim->range.start;
-        sdescr["end"] = prim->range.end;
-        response->on_response(sdescr);
+    {
+        PyGILGuard guard;
+        for (GSList * l = services; l; l = l->next) {
+            struct gatt_primary *prim = (gatt_primary*) l->data;
+            boost::python::dict sdescr;
+            sdescr["uuid"] = prim->uuid;
+            sdescr["start"] = prim->range.start;
+            sdescr["end"] = prim->range.end;
+            response->on_response(sdescr);
+        }
     }
 
     response->notify(status);
@@ -572,18 +2022,182 @@ GATTRequester::discover_primary_async(GATTResponse* response)
     return id;
 }
 
+#define DATABASE_HASH_UUID "00002b2a-0000-1000-8000-00805f9b34fb"
+#define SERVICE_CHANGED_UUID "00002a05-0000-1000-8000-00805f9b34fb"
+
+// Whether the keys of a device are stored by bluetoothd. Its storage is
+// often only readable by root, then the answer is no.
+static bool
+is_bonded(const std::string& device, const std::string& address) {
+    bdaddr_t ba;
+    char adapter[18];
+    int dev_id = device.empty() ? -1 : hci_devid(device.c_str());
+
+    if (dev_id < 0 || hci_devba(dev_id, &ba) < 0)
+        return false;
+    ba2str(&ba, adapter);
+
+    std::string peer = address;
+    for (char& c : peer)
+        c = toupper(c);
+
+    std::ifstream info(std::string("/var/lib/bluetooth/") + adapter + "/" +
+            peer + "/info");
+    std::string line;
+    while (std::getline(info, line)) {
+        if (line == "[LongTermKey]")
+            return true;
+    }
+
+    return false;
+}
+
+// Whether the cached table can stand in for discovery. The Database Hash
+// is read once per connection; for devices without one, only a Service
+// Changed indication tells the table is stale.
+bool
+GATTRequester::check_cache() {
+    if (!GATTCache::enabled())
+        return false;
+
+    if (_cache_state != CACHE_UNCHECKED)
+        return _cache_state == CACHE_VALID;
+
+    // Only Attribute Not Found means there is no hash. Without an answer,
+    // do without the cache this time and ask again on the next use.
+    GATTResponse response;
+    auto id = read_by_uuid_async(DATABASE_HASH_UUID, &response);
+    if (!id)
+        return false;
+
+    try {
+        if (not response.wait(MAX_WAIT_FOR_PACKET)) {
+            _timeouts++;
+            cancel_without_gil(_attrib, id);
+            return false;
+        }
+    } catch (std::runtime_error&) {
+        if (response.status() != ATT_ECODE_ATTR_NOT_FOUND)
+            return false;
+    }
+
+    _db_hash.clear();
+    boost::python::list hash = response.received();
+    if (boost::python::len(hash) > 0)
+        _db_hash = boost::python::extract<std::string>(hash[0]);
+
+    if (!_cache)
+        _cache.reset(new GATTCache(_address));
+
+    _cache->load();
+    cache_loaded(false);
+    return _cache_state == CACHE_VALID;
+}
+
+// Trusts the mapped table if it was stored for the same database. With
+// no hash to compare, a table from an earlier connection is only trusted
+// for a bonded device, which has to tell of changes.
+void
+GATTRequester::cache_loaded(bool stored) {
+    if (_cache->contents() == 0 || _cache->hash() != _db_hash) {
+        _cache_state = CACHE_STALE;
+        return;
+    }
+
+    if (_db_hash.empty() && !stored && !is_bonded(_device, _address)) {
+        _cache_state = CACHE_STALE;
+        return;
+    }
+
+    GATTCache::Entry changed;
+    GATTCache::set_uuid(changed, SERVICE_CHANGED_UUID);
+    for (auto e = _cache->begin(); e != _cache->end(); e++) {
+        if (e->type == GATTCache::CHARACTERISTIC &&
+                memcmp(e->uuid, changed.uuid, sizeof(changed.uuid)) == 0)
+            _service_changed = e->end;
+    }
+
+    _cache_state = CACHE_VALID;
+}
+
+// Stores a discovery result. A table that is still valid keeps what it
+// had of other kinds, a stale one starts over.
+void
+GATTRequester::cache_entries(int contents,
+        const std::vector<GATTCache::Entry>& entries) {
+    if (!GATTCache::enabled())
+        return;
+
+    check_cache();
+
+    std::vector<GATTCache::Entry> table;
+    int stored = contents;
+
+    if (_cache_state == CACHE_VALID) {
+        stored |= _cache->contents();
+        for (auto e = _cache->begin(); e != _cache->end(); e++) {
+            if (!(GATTCache::contents_of(e->type) & contents))
+                table.push_back(*e);
+        }
+    }
+
+    table.insert(table.end(), entries.begin(), entries.end());
+    _cache->store(_db_hash, stored, table);
+    cache_loaded(true);
+}
+
+// Also run on the loop thread, on a Service Changed indication. The
+// Database Hash is read again before the next use.
+void
+GATTRequester::invalidate_cache() {
+    GATTCache::remove(_address);
+    _cache_state = CACHE_UNCHECKED;
+}
+
 boost::python::list GATTRequester::discover_primary()
 {
+	if (check_cache() && (_cache->contents() & GATTCache::HAS_PRIMARY)) {
+	    boost::python::list services;
+	    for (auto e = _cache->begin(); e != _cache->end(); e++) {
+	        if (e->type != GATTCache::PRIMARY_SERVICE)
+	            continue;
+
+	        boost::python::dict sdescr;
+	        sdescr["uuid"] = GATTCache::uuid(*e);
+	        sdescr["start"] = e->handle;
+	        sdescr["end"] = e->end;
+	        services.append(sdescr);
+	    }
+	    return services;
+	}
+
 	GATTResponse response;
 
 	auto id = discover_primary_async(&response);
 
 	if (not response.wait(5*MAX_WAIT_FOR_PACKET))
 	{
-	    g_attrib_cancel(_attrib, id);
+	    _timeouts++;
+	    cancel_without_gil(_attrib, id);
 		throw std::runtime_error("discover_primary timed out");
 	}
-	return response.received();
+
+	boost::python::list services = response.received();
+	if (GATTCache::enabled()) {
+	    std::vector<GATTCache::Entry> entries;
+	    for (int i = 0; i < boost::python::len(services); i++) {
+	        boost::python::dict sdescr =
+	            boost::python::extract<boost::python::dict>(services[i]);
+	        GATTCache::Entry entry = {GATTCache::PRIMARY_SERVICE, 0,
+	            boost::python::extract<uint16_t>(sdescr["start"]),
+	            boost::python::extract<uint16_t>(sdescr["end"]), 0};
+	        GATTCache::set_uuid(entry,
+	            boost::python::extract<std::string>(sdescr["uuid"]));
+	        entries.push_back(entry);
+	    }
+	    cache_entries(GATTCache::HAS_PRIMARY, entries);
+	}
+	return services;
 }
 
 /* Characteristics Discovery
@@ -597,14 +2211,17 @@ static void discover_char_cb(guint8 status, GSList *characteristics,
         return;
     }
 
-    for (GSList * l = characteristics; l; l = l->next) {
-        struct gatt_char *chars = (gatt_char*) l->data;
-        boost::python::dict adescr;
-        adescr["uuid"] = chars->uuid;
-        adescr["handle"] = chars->handle;
-        adescr["properties"] = chars->properties;
-        adescr["value_handle"] = chars->value_handle;
-        response->on_response(adescr);
+    {
+        PyGILGuard guard;
+        for (GSList * l = characteristics; l; l = l->next) {
+            struct gatt_char *chars = (gatt_char*) l->data;
+            boost::python::dict adescr;
+            adescr["uuid"] = chars->uuid;
+            adescr["handle"] = chars->handle;
+            adescr["properties"] = chars->properties;
+            adescr["value_handle"] = chars->value_handle;
+            response->on_response(adescr);
+        }
     }
 
     response->notify(status);
@@ -635,19 +2252,651 @@ guint GATTRequester::discover_characteristics_async(GATTResponse* response,
 
 boost::python::list GATTRequester::discover_characteristics(int start, int end,
         std::string uuid_str) {
+    if (check_cache() &&
+            (_cache->contents() & GATTCache::HAS_CHARACTERISTICS)) {
+        GATTCache::Entry filter;
+        if (uuid_str.size() > 0)
+            GATTCache::set_uuid(filter, uuid_str);
+
+        boost::python::list characteristics;
+        for (auto e = _cache->begin(); e != _cache->end(); e++) {
+            if (e->type != GATTCache::CHARACTERISTIC ||
+                    e->handle < start || e->handle > end)
+                continue;
+            if (uuid_str.size() > 0 &&
+                    memcmp(e->uuid, filter.uuid, sizeof(filter.uuid)) != 0)
+                continue;
+
+            boost::python::dict adescr;
+            adescr["uuid"] = GATTCache::uuid(*e);
+            adescr["handle"] = e->handle;
+            adescr["properties"] = e->properties;
+            adescr["value_handle"] = e->end;
+            characteristics.append(adescr);
+        }
+        return characteristics;
+    }
+
     GATTResponse response;
     auto id = discover_characteristics_async(&response, start, end, uuid_str);
 
     if (not response.wait(5 * MAX_WAIT_FOR_PACKET))
     {
-        g_attrib_cancel(_attrib, id);
+        _timeouts++;
+        cancel_without_gil(_attrib, id);
         throw std::runtime_error("discover_characteristics timed out");
     }
-    return response.received();
 
+    // Only a discovery of the whole range makes a complete table
+    boost::python::list characteristics = response.received();
+    if (GATTCache::enabled() && start <= 0x0001 && end >= 0xffff &&
+            uuid_str.size() == 0) {
+        std::vector<GATTCache::Entry> entries;
+        for (int i = 0; i < boost::python::len(characteristics); i++) {
+            boost::python::dict adescr =
+                boost::python::extract<boost::python::dict>(characteristics[i]);
+            GATTCache::Entry entry = {GATTCache::CHARACTERISTIC,
+                boost::python::extract<uint8_t>(adescr["properties"]),
+                boost::python::extract<uint16_t>(adescr["handle"]),
+                boost::python::extract<uint16_t>(adescr["value_handle"]), 0};
+            GATTCache::set_uuid(entry,
+                boost::python::extract<std::string>(adescr["uuid"]));
+            entries.push_back(entry);
+        }
+        cache_entries(GATTCache::HAS_CHARACTERISTICS, entries);
+    }
+    return characteristics;
+
+}
+
+/* Full Discovery
+
+   Primary services, then for each one its included services and
+   characteristics, then the descriptors of each characteristic. Every
+   step queues all the requests it can at once, so g_attrib sends the
+   next one as soon as the previous is answered. Results are kept in
+   plain structures, the loop does not touch Python until the end.
+ */
+struct DiscoveredDescriptor {
+    uint16_t handle;
+    std::string uuid;
+};
+
+struct DiscoveredCharacteristic {
+    uint16_t handle;
+    uint8_t properties;
+    uint16_t value_handle;
+    std::string uuid;
+    std::vector<DiscoveredDescriptor> descriptors;
+};
+
+struct DiscoveredInclude {
+    uint16_t handle;
+    uint16_t start;
+    uint16_t end;
+    std::string uuid;
+};
+
+struct DiscoveredService {
+    uint16_t start;
+    uint16_t end;
+    std::string uuid;
+    std::vector<DiscoveredInclude> includes;
+    std::vector<DiscoveredCharacteristic> characteristics;
+};
+
+struct DiscoveryStep;
+
+// lock orders abandoning against notifying the response, and guards the
+// requests still unanswered, by id, that an abandoning caller cancels
+struct Discovery {
+    GAttrib* attrib;
+    GATTResponse* response;
+    bool keep;                  // Leave the results to the caller
+    std::vector<DiscoveredService> services;
+    std::atomic<int> pending;
+    uint8_t status;
+    boost::mutex lock;
+    bool abandoned{false};
+    std::map<guint, DiscoveryStep*> sent;
+    std::atomic<int> refs{2};
+};
+
+struct DiscoveryStep {
+    Discovery* discovery;
+    size_t service;
+    size_t characteristic;
+    guint id;
+};
+
+static void
+discovery_unref(Discovery* discovery) {
+    if (--discovery->refs > 0)
+        return;
+
+    g_attrib_unref(discovery->attrib);
+    delete discovery;
+}
+
+static boost::python::list
+discovered_to_python(const std::vector<DiscoveredService>& services) {
+    boost::python::list result;
+
+    for (const auto& service : services) {
+        boost::python::list includes, characteristics;
+
+        for (const auto& include : service.includes) {
+            boost::python::dict idescr;
+            idescr["uuid"] = include.uuid;
+            idescr["handle"] = include.handle;
+            idescr["start"] = include.start;
+            idescr["end"] = include.end;
+            includes.append(idescr);
+        }
+
+        for (const auto& chr : service.characteristics) {
+            boost::python::list descriptors;
+            for (const auto& desc : chr.descriptors) {
+                boost::python::dict ddescr;
+                ddescr["uuid"] = desc.uuid;
+                ddescr["handle"] = desc.handle;
+                descriptors.append(ddescr);
+            }
+
+            boost::python::dict adescr;
+            adescr["uuid"] = chr.uuid;
+            adescr["handle"] = chr.handle;
+            adescr["properties"] = chr.properties;
+            adescr["value_handle"] = chr.value_handle;
+            adescr["descriptors"] = descriptors;
+            characteristics.append(adescr);
+        }
+
+        boost::python::dict sdescr;
+        sdescr["uuid"] = service.uuid;
+        sdescr["start"] = service.start;
+        sdescr["end"] = service.end;
+        sdescr["includes"] = includes;
+        sdescr["characteristics"] = characteristics;
+        result.append(sdescr);
+    }
+
+    return result;
+}
+
+// The GIL first, an abandoning caller holds it when it takes the lock
+static void
+discovery_step_done(Discovery* discovery) {
+    if (--discovery->pending > 0)
+        return;
+
+    {
+        PyGILGuard guard;
+        boost::lock_guard<boost::mutex> lock(discovery->lock);
+
+        if (!discovery->abandoned) {
+            if (discovery->status == 0 && !discovery->keep) {
+                boost::python::list services =
+                    discovered_to_python(discovery->services);
+                for (int i = 0; i < boost::python::len(services); i++)
+                    discovery->response->on_response(services[i]);
+            }
+
+            discovery->response->notify(discovery->status);
+        }
+    }
+
+    discovery_unref(discovery);
+}
+
+// Its request is answered, it is no longer for the caller to cancel
+static void
+discovery_step_free(DiscoveryStep* step) {
+    Discovery* discovery = step->discovery;
+    {
+        boost::lock_guard<boost::mutex> lock(discovery->lock);
+        auto sent = discovery->sent.find(step->id);
+        if (sent != discovery->sent.end() && sent->second == step)
+            discovery->sent.erase(sent);
+    }
+
+    delete step;
+}
+
+// Called by a caller that gave up: the response is not touched any more
+// and the unanswered requests are cancelled. A cancelled request never
+// gets its callback, so its step is completed here instead.
+static void
+discovery_abandon(Discovery* discovery) {
+    std::map<guint, DiscoveryStep*> sent;
+    {
+        boost::lock_guard<boost::mutex> lock(discovery->lock);
+        discovery->abandoned = true;
+        sent.swap(discovery->sent);
+    }
+
+    for (auto& request : sent) {
+        if (!cancel_without_gil(discovery->attrib, request.first))
+            continue;
+
+        delete request.second;
+        discovery_step_done(discovery);
+    }
+}
+
+// Missing attributes are just an empty result
+static bool
+discovery_failed(Discovery* discovery, uint8_t status) {
+    if (status == 0 || status == ATT_ECODE_ATTR_NOT_FOUND)
+        return discovery->status != 0;
+
+    if (discovery->status == 0)
+        discovery->status = status;
+    return true;
+}
+
+static void discover_all_desc_cb(uint8_t, GSList*, void*);
+static void discover_all_char_cb(uint8_t, GSList*, void*);
+static void discover_all_included_cb(uint8_t, GSList*, void*);
+
+// Sends a step and records its id. Under the lock, so its callback, which
+// takes it to forget the id, cannot run before the id is known.
+static guint
+discovery_send_step(Discovery* discovery, DiscoveryStep* step,
+        guint (*send)(Discovery*, DiscoveryStep*)) {
+    boost::lock_guard<boost::mutex> lock(discovery->lock);
+
+    guint id = send(discovery, step);
+    if (id) {
+        step->id = id;
+        discovery->sent[id] = step;
+    }
+
+    return id;
+}
+
+static void
+discovery_send(Discovery* discovery, size_t service, size_t characteristic,
+        guint (*send)(Discovery*, DiscoveryStep*)) {
+    // Nobody waits for the result any more, stop here
+    {
+        boost::lock_guard<boost::mutex> lock(discovery->lock);
+        if (discovery->abandoned)
+            return;
+    }
+
+    DiscoveryStep* step =
+        new DiscoveryStep{discovery, service, characteristic, 0};
+
+    discovery->pending++;
+    if (!discovery_send_step(discovery, step, send)) {
+        delete step;
+        discovery_failed(discovery, ATT_ECODE_IO);
+        discovery->pending--;
+    }
+}
+
+static guint
+send_included(Discovery* discovery, DiscoveryStep* step) {
+    const DiscoveredService& service = discovery->services[step->service];
+    return gatt_find_included(discovery->attrib, service.start, service.end,
+            discover_all_included_cb, step);
+}
+
+static guint
+send_characteristics(Discovery* discovery, DiscoveryStep* step) {
+    const DiscoveredService& service = discovery->services[step->service];
+    return gatt_discover_char(discovery->attrib, service.start, service.end,
+            NULL, discover_all_char_cb, step);
+}
+
+// Descriptors sit between the value handle and the next declaration
+static uint16_t
+descriptors_end(const DiscoveredService& service, size_t characteristic) {
+    if (characteristic + 1 < service.characteristics.size())
+        return service.characteristics[characteristic + 1].handle - 1;
+    return service.end;
+}
+
+static guint
+send_descriptors(Discovery* discovery, DiscoveryStep* step) {
+    const DiscoveredService& service = discovery->services[step->service];
+    const DiscoveredCharacteristic& chr =
+        service.characteristics[step->characteristic];
+
+    return gatt_discover_desc(discovery->attrib, chr.value_handle + 1,
+            descriptors_end(service, step->characteristic), NULL,
+            discover_all_desc_cb, step);
+}
+
+static void
+discover_all_primary_cb(uint8_t status, GSList* services, void* userp) {
+    DiscoveryStep* step = (DiscoveryStep*)userp;
+    Discovery* discovery = step->discovery;
+    discovery_step_free(step);
+
+    if (!discovery_failed(discovery, status)) {
+        for (GSList* l = services; l; l = l->next) {
+            struct gatt_primary* prim = (gatt_primary*)l->data;
+            DiscoveredService service;
+            service.uuid = prim->uuid;
+            service.start = prim->range.start;
+            service.end = prim->range.end;
+            discovery->services.push_back(service);
+        }
+
+        for (size_t i = 0; i < discovery->services.size(); i++) {
+            discovery_send(discovery, i, 0, send_included);
+            discovery_send(discovery, i, 0, send_characteristics);
+        }
+    }
+
+    discovery_step_done(discovery);
+}
+
+static void
+discover_all_included_cb(uint8_t status, GSList* includes, void* userp) {
+    DiscoveryStep* step = (DiscoveryStep*)userp;
+    Discovery* discovery = step->discovery;
+    DiscoveredService& service = discovery->services[step->service];
+    discovery_step_free(step);
+
+    if (!discovery_failed(discovery, status)) {
+        for (GSList* l = includes; l; l = l->next) {
+            struct gatt_included* incl = (gatt_included*)l->data;
+            service.includes.push_back(DiscoveredInclude{incl->handle,
+                    incl->range.start, incl->range.end, incl->uuid});
+        }
+    }
+
+    discovery_step_done(discovery);
+}
+
+static void
+discover_all_char_cb(uint8_t status, GSList* characteristics, void* userp) {
+    DiscoveryStep* step = (DiscoveryStep*)userp;
+    Discovery* discovery = step->discovery;
+    size_t index = step->service;
+    DiscoveredService& service = discovery->services[index];
+    discovery_step_free(step);
+
+    if (!discovery_failed(discovery, status)) {
+        for (GSList* l = characteristics; l; l = l->next) {
+            struct gatt_char* chars = (gatt_char*)l->data;
+            DiscoveredCharacteristic chr;
+            chr.uuid = chars->uuid;
+            chr.handle = chars->handle;
+            chr.properties = chars->properties;
+            chr.value_handle = chars->value_handle;
+            service.characteristics.push_back(chr);
+        }
+
+        // The vector is complete, steps can point into it from now on
+        for (size_t i = 0; i < service.characteristics.size(); i++) {
+            if (service.characteristics[i].value_handle <
+                    descriptors_end(service, i))
+                discovery_send(discovery, index, i, send_descriptors);
+        }
+    }
+
+    discovery_step_done(discovery);
+}
+
+static void
+discover_all_desc_cb(uint8_t status, GSList* descriptors, void* userp) {
+    DiscoveryStep* step = (DiscoveryStep*)userp;
+    Discovery* discovery = step->discovery;
+    DiscoveredCharacteristic& chr =
+        discovery->services[step->service].characteristics[step->characteristic];
+    discovery_step_free(step);
+
+    if (!discovery_failed(discovery, status)) {
+        for (GSList* l = descriptors; l; l = l->next) {
+            struct gatt_desc* desc = (gatt_desc*)l->data;
+            chr.descriptors.push_back(DiscoveredDescriptor{desc->handle,
+                    desc->uuid});
+        }
+    }
+
+    discovery_step_done(discovery);
+}
+
+static guint
+send_primary(Discovery* discovery, DiscoveryStep* step) {
+    return gatt_discover_primary(discovery->attrib, NULL,
+            discover_all_primary_cb, step);
+}
+
+// The caller gets a reference, to drop with discovery_unref()
+Discovery*
+GATTRequester::start_discovery(GATTResponse* response, bool keep, guint* id) {
+    check_connected();
+
+    Discovery* discovery = new Discovery();
+    discovery->attrib = g_attrib_ref(_attrib);
+    discovery->response = response;
+    discovery->keep = keep;
+    discovery->pending = 0;
+    discovery->status = 0;
+
+    // The first step may complete on the loop before this returns
+    DiscoveryStep* step = new DiscoveryStep{discovery, 0, 0, 0};
+    discovery->pending = 1;
+
+    guint first = discovery_send_step(discovery, step, send_primary);
+    if (!first) {
+        delete step;
+        g_attrib_unref(discovery->attrib);
+        delete discovery;
+        throw std::runtime_error("Discover all failed");
+    }
+
+    if (id != NULL)
+        *id = first;
+    return discovery;
+}
+
+guint
+GATTRequester::discover_all_async(GATTResponse* response) {
+    guint id;
+    discovery_unref(start_discovery(response, false, &id));
+    return id;
+}
+
+// Rebuilds the nested structure from a cached table
+static std::vector<DiscoveredService>
+discovered_from_cache(const GATTCache& cache) {
+    std::vector<DiscoveredService> services;
+
+    for (auto e = cache.begin(); e != cache.end(); e++) {
+        if (e->type != GATTCache::PRIMARY_SERVICE)
+            continue;
+
+        DiscoveredService service;
+        service.uuid = GATTCache::uuid(*e);
+        service.start = e->handle;
+        service.end = e->end;
+        services.push_back(service);
+    }
+
+    for (auto& service : services) {
+        for (auto e = cache.begin(); e != cache.end(); e++) {
+            if (e->type == GATTCache::INCLUDED_SERVICE &&
+                    e->declaration >= service.start &&
+                    e->declaration <= service.end)
+                service.includes.push_back(DiscoveredInclude{e->declaration,
+                        e->handle, e->end, GATTCache::uuid(*e)});
+
+            if (e->type == GATTCache::CHARACTERISTIC &&
+                    e->handle >= service.start && e->handle <= service.end) {
+                DiscoveredCharacteristic chr;
+                chr.uuid = GATTCache::uuid(*e);
+                chr.handle = e->handle;
+                chr.properties = e->properties;
+                chr.value_handle = e->end;
+                service.characteristics.push_back(chr);
+            }
+        }
+
+        for (size_t i = 0; i < service.characteristics.size(); i++) {
+            DiscoveredCharacteristic& chr = service.characteristics[i];
+            uint16_t end = descriptors_end(service, i);
+
+            for (auto e = cache.begin(); e != cache.end(); e++) {
+                if (e->type == GATTCache::DESCRIPTOR &&
+                        e->handle > chr.value_handle && e->handle <= end)
+                    chr.descriptors.push_back(DiscoveredDescriptor{e->handle,
+                            GATTCache::uuid(*e)});
+            }
+        }
+    }
+
+    return services;
+}
+
+static std::vector<GATTCache::Entry>
+discovered_to_cache(const std::vector<DiscoveredService>& services) {
+    std::vector<GATTCache::Entry> entries;
+
+    for (const auto& service : services) {
+        GATTCache::Entry entry = {GATTCache::PRIMARY_SERVICE, 0,
+            service.start, service.end, 0};
+        GATTCache::set_uuid(entry, service.uuid);
+        entries.push_back(entry);
+
+        for (const auto& include : service.includes) {
+            entry = {GATTCache::INCLUDED_SERVICE, 0, include.start,
+                include.end, include.handle};
+            GATTCache::set_uuid(entry, include.uuid);
+            entries.push_back(entry);
+        }
+
+        for (const auto& chr : service.characteristics) {
+            entry = {GATTCache::CHARACTERISTIC, chr.properties, chr.handle,
+                chr.value_handle, 0};
+            GATTCache::set_uuid(entry, chr.uuid);
+            entries.push_back(entry);
+
+            for (const auto& desc : chr.descriptors) {
+                entry = {GATTCache::DESCRIPTOR, 0, desc.handle, 0, 0};
+                GATTCache::set_uuid(entry, desc.uuid);
+                entries.push_back(entry);
+            }
+        }
+    }
+
+    return entries;
+}
+
+#define CACHE_FULL_DISCOVERY (GATTCache::HAS_PRIMARY | \
+        GATTCache::HAS_INCLUDES | GATTCache::HAS_CHARACTERISTICS | \
+        GATTCache::HAS_DESCRIPTORS)
+
+boost::python::list
+GATTRequester::discover_all() {
+    if (check_cache() &&
+            (_cache->contents() & CACHE_FULL_DISCOVERY) == CACHE_FULL_DISCOVERY)
+        return discovered_to_python(discovered_from_cache(*_cache));
+
+    GATTResponse response;
+    Discovery* discovery = start_discovery(&response, true);
+    bool answered;
+
+    try {
+        answered = response.wait(5 * MAX_WAIT_FOR_PACKET);
+    } catch (std::runtime_error&) {
+        discovery_unref(discovery);
+        throw;
+    }
+
+    if (not answered) {
+        discovery_abandon(discovery);
+        discovery_unref(discovery);
+        _timeouts++;
+        throw std::runtime_error("discover_all timed out");
+    }
+
+    if (GATTCache::enabled())
+        cache_entries(CACHE_FULL_DISCOVERY,
+                discovered_to_cache(discovery->services));
+
+    boost::python::list services = discovered_to_python(discovery->services);
+    discovery_unref(discovery);
+    return services;
+}
+
+static boost::python::dict
+histogram_stats(const struct histogram* hist) {
+    boost::python::dict stats;
+    stats["count"] = histogram_count(hist);
+    stats["min"] = histogram_min(hist);
+    stats["mean"] = histogram_mean(hist);
+    stats["p50"] = histogram_percentile(hist, 50);
+    stats["p90"] = histogram_percentile(hist, 90);
+    stats["p99"] = histogram_percentile(hist, 99);
+    stats["p999"] = histogram_percentile(hist, 99.9);
+    stats["max"] = histogram_max(hist);
+    return stats;
 }
 
-void GATTRequester::check_connected() {
-    if (_state != STATE_CONNECTED)
-        throw std::runtime_error("Not connected");
+// Snapshot of the connection counters. Latencies are in microseconds,
+// keyed by request opcode and then by stage.
+boost::python::dict
+GATTRequester::stats() {
+    static const char* stages[GATTRIB_LATENCY_STAGES] = {
+        "queue", "response", "callback", "total"
+    };
+
+    boost::python::dict result;
+    result["notifications"] = (unsigned long)_notifications;
+    result["indications"] = (unsigned long)_indications;
+    result["wait_timeouts"] = (unsigned long)_timeouts;
+    result["connect_latency_us"] = (long)_connect_latency;
+    {
+        boost::lock_guard<boost::mutex> lock(_recorder_lock);
+        unsigned long recorded = _recorded, dropped = _record_dropped;
+        if (_recorder) {
+            recorded += _recorder->recorded();
+            dropped += _recorder->dropped();
+        }
+        result["recorded"] = recorded;
+        result["record_dropped"] = dropped;
+    }
+
+    struct gattrib_stats counters;
+    if (_attrib == NULL || !g_attrib_get_stats(_attrib, &counters))
+        return result;
+
+    result["pdus_sent"] = counters.pdus_sent;
+    result["pdus_received"] = counters.pdus_received;
+    result["bytes_sent"] = counters.bytes_sent;
+    result["bytes_received"] = counters.bytes_received;
+    result["flushes"] = counters.flushes;
+    result["errors"] = counters.errors;
+    result["timeouts"] = counters.timeouts;
+    result["pool_allocs"] = counters.pool_allocs;
+    result["pool_reuses"] = counters.pool_reuses;
+    result["queue_depth"] = counters.requests_queued +
+        counters.responses_queued;
+
+    boost::python::dict latency;
+    for (int opcode = 0; opcode < 256; opcode++) {
+        boost::python::dict per_stage;
+
+        for (int stage = 0; stage < GATTRIB_LATENCY_STAGES; stage++) {
+            const struct histogram* hist = g_attrib_get_latency(_attrib,
+                    opcode, (enum gattrib_latency)stage);
+            if (hist != NULL && histogram_count(hist) > 0)
+                per_stage[stages[stage]] = histogram_stats(hist);
+        }
+
+        if (boost::python::len(per_stage) > 0)
+            latency[opcode] = per_stage;
+    }
+
+    result["latency"] = latency;
+    return result;
 }
+
+// Per-request deadline in milliseconds, the request fails with
+// ATT_ECODE_TIMEOUT but the connection stays usable
@@ -6,31 +6,30 @@
 #ifndef _MIBANDA_GATTLIB_H_
 #define _MIBANDA_GATTLIB_H_
 
-#define MAX_WAIT_FOR_PACKET 15 // seconds
+#define MAX_WAIT_FOR_PACKET 15000 // milliseconds
 
 #include <boost/python/list.hpp>
 #include <boost/python/tuple.hpp>
 #include <boost/python/dict.hpp>
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
+#include <pthread.h>
 #include <stdint.h>
 #include <glib.h>
 
 extern "C" {
-#include "lib/uuid.h"
-#include "attrib/att.h"
-#include "attrib/gattrib.h"
-#include "attrib/gatt.h"
-#include "attrib/utils.h"
+#include "src/shared/histogram.h"
+#include "src/shared/spsc.h"
 }
 
 #include "event.hpp"
-
-class IOService {
-public:
-	IOService(bool run);
-	void start();
-	void operator()();
-};
+#include "client.h"
+#include "gattcache.h"
+#include "recorder.h"
 
 class GATTResponse {
 public:
@@ -39,9 +38,15 @@ public:
 
 	virtual void on_response(const std::string data);
 	virtual void on_response(boost::python::object data);
+	virtual void on_chunk(uint16_t offset, const std::string data);
 	boost::python::list received();
-	bool wait(uint16_t timeout);
-	void notify(uint8_t status);
+	uint8_t status() const;
+	bool wait(int timeout);
+	bool wait_until(boost::system_time const& deadline);
+	virtual void notify(uint8_t status);
+
+protected:
+	bool check_status();
 
 private:
 	uint8_t _status;
@@ -49,13 +54,19 @@ private:
 	Event _event;
 };
 
-void connect_cb(GIOChannel* channel, GError* err, gpointer user_data);
 void exchange_mtu_cb(guint8, const guint8*, guint16, gpointer);
 
-class GATTRequester {
+/*
+ * The Python face of GATTClient: plain reads, long reads and writes go
+ * through the client, with the results handed to a GATTResponse. Read
+ * Multiple, Read by Type, discovery, prepared writes and the CCCD lookup
+ * still drive the ATT engine on their own; porting them onto GATTClient
+ * is tracked as a follow-up of its own.
+ */
+class GATTRequester : public GATTClient {
 public:
 	GATTRequester(std::string address,
-			bool do_connect=true, std::string device="hci0");
+			bool do_connect=true, std::string device="hci0", int loop=-1);
 	virtual ~GATTRequester();
 
 	virtual void on_notification(const uint16_t handle, const std::string data);
@@ -64,48 +75,204 @@ public:
 	void connect(bool wait=false, std::string channel_type="public",
 			std::string security_level="low", int psm=0, int mtu=0);
 	static boost::python::object connect_kwarg(boost::python::tuple args, boost::python::dict kwargs);
-	bool is_connected();
+	void attach(int fd, int mtu=ATT_DEFAULT_LE_MTU);
 	void disconnect();
-	guint read_by_handle_async(uint16_t handle, GATTResponse* response);
+	guint read_by_handle_async(uint16_t handle, GATTResponse* response, int timeout=0);
 	boost::python::list read_by_handle(uint16_t handle);
-	guint read_by_uuid_async(std::string uuid, GATTResponse* response);
+	guint read_long_async(uint16_t handle, GATTResponse* response,
+			uint16_t offset=0, int timeout=0);
+	boost::python::list read_long(uint16_t handle, uint16_t offset=0,
+			uint16_t size_hint=0);
+	boost::python::list read_multiple_async(boost::python::list handles,
+			boost::python::list sizes, GATTResponse* response, int timeout=0);
+	boost::python::list read_multiple(boost::python::list handles,
+			boost::python::list sizes);
+	guint read_multiple_variable_async(boost::python::list handles,
+			GATTResponse* response, int timeout=0);
+	boost::python::list read_multiple_variable(boost::python::list handles);
+	boost::python::list read_handles(boost::python::list handles,
+			int timeout=0);
+	guint read_by_uuid_async(std::string uuid, GATTResponse* response, int timeout=0);
 	boost::python::list read_by_uuid(std::string uuid);
 
-	guint write_by_handle_async(uint16_t handle, std::string data, GATTResponse* response);
+	guint write_by_handle_async(uint16_t handle, std::string data, GATTResponse* response, int timeout=0);
     boost::python::list write_by_handle(uint16_t handle, std::string data);
     void write_cmd_by_handle(uint16_t handle, std::string data);
 
-	friend void connect_cb(GIOChannel*, GError*, gpointer);
-	friend gboolean disconnect_cb(GIOChannel* channel, GIOCondition cond, gpointer userp);
+	void subscribe(uint16_t value_handle, boost::python::object callback,
+			bool indications=false);
+	void unsubscribe(uint16_t value_handle);
+	void set_notification_batch(boost::python::object callback,
+			int max_count=64, int max_delay=10);
+
+	// Layout of each slot of the notification ring, the value follows
+	struct __attribute__((packed)) RingSlot {
+		uint16_t handle;
+		uint16_t length;
+		uint32_t flags;
+		int64_t timestamp;
+	};
+
+	enum RingFlags {
+		RING_TRUNCATED = 0x01,
+	};
+
+	void enable_ring(int slots=1024, int value_size=0);
+	void disable_ring();
+	boost::python::object ring_buffer(boost::python::object owner);
+	int ring_slot_size() const;
+	boost::python::tuple ring_poll();
+	void ring_release(int count);
+	unsigned long ring_dropped() const;
+
+	void record(std::string path,
+			boost::python::list handles=boost::python::list(),
+			unsigned long size=64 << 20, int segments=0);
+	void stop_recording();
+
 	friend void events_handler(const uint8_t* data, uint16_t size, gpointer userp);
+	friend void subscription_handler(const uint8_t* data, uint16_t size,
+			gpointer userp);
+	friend gboolean batch_timeout_cb(gpointer userp);
 
 	friend void exchange_mtu_cb(guint8, const guint8*, guint16, gpointer);
+	friend class GATTTransaction;
 	int exchange_mtu(int mtu);
-	int mtu() const;
+	double connect_latency() const;
+	boost::python::dict stats();
+
+	void invalidate_cache();
 
 	boost::python::list discover_primary();
 	guint discover_primary_async(GATTResponse* response);
 	boost::python::list discover_characteristics(int start = 0x0001, int end = 0xffff, std::string uuid = "");
+	boost::python::list discover_all();
+	guint discover_all_async(GATTResponse* response);
 	guint discover_characteristics_async(GATTResponse* response, int start = 0x0001, int end = 0xffff, std::string uuid = "");
+protected:
+	void connecting();
+	void attached();
+	void failed(const std::string& message);
+
 private:
 	void check_channel();
-	void check_connected();
+	std::vector<guint> send_read_multiple(boost::python::list handles,
+			boost::python::list sizes, GATTResponse* response, int timeout);
+	struct ReadVariable* send_read_variable(boost::python::list handles,
+			GATTResponse* response, int timeout);
+	bool check_cache();
+	void cache_entries(int contents,
+			const std::vector<GATTCache::Entry>& entries);
+	void cache_loaded(bool stored);
+	uint16_t find_cccd(uint16_t value_handle);
+	bool is_subscribed(uint16_t handle, uint8_t opcode) const;
+	void set_subscribed(uint16_t handle, uint8_t opcode);
+	void clear_subscribed(uint16_t handle);
+	void clear_subscriptions();
+	bool batch_notification(const uint8_t* data, uint16_t size);
+	bool ring_notification(const uint8_t* data, uint16_t size);
+	bool record_notification(uint16_t handle, const uint8_t* data,
+			uint16_t size);
+	bool is_recorded(uint16_t handle);
+	void flush_batch();
+	struct Discovery* start_discovery(GATTResponse* response, bool keep,
+			guint* id=NULL);
 
-    enum State {
-        STATE_DISCONNECTED,
-        STATE_CONNECTING,
-        STATE_CONNECTED,
-        STATE_ERROR_CONNECTING
-    } _state;
+	// Set by the loop once the link is up, or connecting failed
+	Event _ready;
+	std::atomic<bool> _conn_update{false};
+	gint64 _connect_start{0};
+	std::atomic<gint64> _connect_latency{0};
 
-	std::string _device;
-	std::string _address;
 	int _hci_socket{-1};
-	GIOChannel* _channel{nullptr};
-	GAttrib* _attrib{nullptr};
-	int _mtu{ATT_DEFAULT_LE_MTU};
+	std::atomic<unsigned long> _notifications{0};
+	std::atomic<unsigned long> _indications{0};
+	std::atomic<unsigned long> _timeouts{0};
+	std::shared_ptr<std::atomic<bool> > _read_vl_supported{
+		std::make_shared<std::atomic<bool> >(true)};
 	guint _notify_id{0};
 	guint _indicate_id{0};
+
+	enum CacheState {
+		CACHE_UNCHECKED,
+		CACHE_VALID,
+		CACHE_STALE
+	};
+
+	std::unique_ptr<GATTCache> _cache;
+	std::atomic<int> _cache_state{CACHE_UNCHECKED};
+	std::string _db_hash;
+	std::atomic<uint16_t> _service_changed{0};
+
+	// Value handle to (g_attrib event id, CCCD handle)
+	boost::mutex _subscriptions_lock;
+	std::map<uint16_t, std::pair<guint, uint16_t> > _subscriptions;
+	// Same handles as bitmaps, notifications then indications, checked
+	// by the loop on every event
+	std::atomic<uint64_t> _subscribed[2][65536 / 64] {};
+
+	// Notifications held for set_notification_batch(); values are packed
+	// in _batch_data, both buffers are reserved up front
+	struct BatchRecord {
+		uint16_t handle;
+		gint64 timestamp;
+		size_t offset;
+		size_t length;
+	};
+
+	boost::mutex _batch_lock;
+	boost::python::object _batch_callback;
+	std::atomic<bool> _batching{false};
+	size_t _batch_max{0};
+	int _batch_delay{0};
+	std::vector<BatchRecord> _batch;
+	std::vector<uint8_t> _batch_data;
+	std::vector<BatchRecord> _batch_spare;
+	std::vector<uint8_t> _batch_data_spare;
+	GSource* _batch_timer{nullptr};
+
+	// Notifications copied in place for enable_ring(); the loop produces,
+	// Python consumes. Allocated once and kept until destruction, as views
+	// of it may outlive disable_ring().
+	struct spsc_ring _ring{};
+	std::atomic<bool> _ring_enabled{false};
+	bool _ring_allocated{false};
+	size_t _ring_value_size{0};
+	std::atomic<unsigned long> _ring_dropped{0};
+
+	// Set by record(), notifications of its handles go to disk only
+	boost::mutex _recorder_lock;
+	std::unique_ptr<NotificationRecorder> _recorder;
+	std::atomic<bool> _recording{false};
+	unsigned long _recorded{0};
+	unsigned long _record_dropped{0};
+};
+
+/*
+ * Writes to several handles queued on the peer with Prepare Write
+ * requests, then applied all together by a single Execute Write. With
+ * verify, every echoed part is checked and any mismatch or error cancels
+ * the whole transaction, so nothing is written.
+ */
+class GATTTransaction {
+public:
+	GATTTransaction(GATTRequester& requester, bool verify=true);
+
+	void write(uint16_t handle, std::string data);
+	size_t size() const;
+	void clear();
+
+	boost::python::list commit_async(GATTResponse* response,
+			int timeout=0);
+	void commit();
+
+private:
+	std::vector<guint> send(GATTResponse* response, int timeout,
+			struct PreparedWrites** state=NULL);
+
+	GATTRequester& _requester;
+	bool _verify;
+	std::vector<std::pair<uint16_t, std::string> > _writes;
 };
 
 #endif // _MIBANDA_GATTLIB_H_
@@ -0,0 +1,244 @@
+// -*- mode: c++; coding: utf-8 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#include <boost/thread/thread.hpp>
+#include <stdexcept>
+#include <string.h>
+#include <sched.h>
+
+#include "ioservice.h"
+#include "event.hpp"
+
+// Loop running on the current thread, for timed_poll()
+static thread_local IOService* _current_service = NULL;
+
+// Time spent blocked in poll() is idle time, the rest counts as load
+gint
+timed_poll(GPollFD* fds, guint nfds, gint timeout) {
+    IOService* service = _current_service;
+    gint64 start = g_get_monotonic_time();
+    gint retval = g_poll(fds, nfds, timeout);
+
+    if (service != NULL) {
+        service->_idle_us += g_get_monotonic_time() - start;
+        service->_iterations++;
+    }
+
+    return retval;
+}
+
+IOService::IOService(bool run, GMainContext* context) :
+    _context(context != NULL ? context : g_main_context_default()) {
+
+    if (run)
+        start();
+}
+
+void
+IOService::start() {
+    boost::thread iothread(boost::ref(*this));
+}
+
+void
+IOService::operator()() {
+    _current_service = this;
+    _thread = pthread_self();
+    _started = g_get_monotonic_time();
+    _running = true;
+
+    // Best effort here, set_cpu() reports errors to the caller
+    if (_cpu >= 0) {
+        try {
+            apply_cpu();
+        } catch (std::runtime_error&) {
+        }
+    }
+
+    GMainLoop *event_loop = g_main_loop_new(_context, FALSE);
+
+    g_main_context_set_poll_func(_context, timed_poll);
+    g_main_loop_run(event_loop);
+    g_main_loop_unref(event_loop);
+
+    _running = false;
+}
+
+GMainContext*
+IOService::context() const {
+    return _context;
+}
+
+struct LoopCall {
+    std::function<void()> func;
+    Event done;
+};
+
+static gboolean
+loop_call_cb(gpointer userp) {
+    LoopCall* call = (LoopCall*)userp;
+    call->func();
+    call->done.set();
+    return false;
+}
+
+// Runs func on the loop thread and waits for it. Right away when called
+// from the loop itself, or if the loop does not run (yet).
+void
+IOService::invoke(std::function<void()> func) {
+    if (!_running || g_main_context_is_owner(_context)) {
+        func();
+        return;
+    }
+
+    LoopCall call{func};
+    GSource* source = g_idle_source_new();
+    g_source_set_priority(source, G_PRIORITY_HIGH);
+    g_source_set_callback(source, loop_call_cb, &call, NULL);
+    g_source_attach(source, _context);
+    g_source_unref(source);
+
+    call.done.wait(-1);
+}
+
+void
+IOService::set_cpu(int cpu) {
+    if (cpu >= CPU_SETSIZE)
+        throw std::runtime_error("Invalid CPU");
+
+    _cpu = cpu;
+    if (_running && cpu >= 0)
+        apply_cpu();
+}
+
+int
+IOService::cpu() const {
+    return _cpu;
+}
+
+void
+IOService::apply_cpu() {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(_cpu, &cpus);
+
+    int retval = pthread_setaffinity_np(_thread, sizeof(cpus), &cpus);
+    if (retval != 0) {
+        std::string msg = std::string("Could not set loop affinity: ") +
+            std::string(strerror(retval));
+        throw std::runtime_error(msg);
+    }
+}
+
+void
+IOService::acquire() {
+    _connections++;
+}
+
+void
+IOService::release() {
+    _connections--;
+}
+
+unsigned long
+IOService::connections() const {
+    return _connections;
+}
+
+unsigned long
+IOService::iterations() const {
+    return _iterations;
+}
+
+unsigned long
+IOService::busy_ms() const {
+    if (!_running)
+        return 0;
+
+    gint64 elapsed = g_get_monotonic_time() - _started;
+    return (elapsed - _idle_us) / 1000;
+}
+
+// Loops are never stopped: the pool lives as long as the library
+IOServicePool::IOServicePool() {
+    _loops.push_back(new IOService(true));
+}
+
+IOServicePool&
+IOServicePool::instance() {
+    static IOServicePool* pool = new IOServicePool();
+    return *pool;
+}
+
+void
+IOServicePool::resize(int count) {
+    boost::lock_guard<boost::mutex> lock(_lock);
+
+    if (count < (int)_loops.size())
+        throw std::runtime_error("Event loops can not be removed");
+
+    while ((int)_loops.size() < count) {
+        GMainContext* context = g_main_context_new();
+        _loops.push_back(new IOService(true, context));
+    }
+}
+
+int
+IOServicePool::size() {
+    boost::lock_guard<boost::mutex> lock(_lock);
+    return _loops.size();
+}
+
+IOService*
+IOServicePool::get(int index) {
+    boost::lock_guard<boost::mutex> lock(_lock);
+
+    if (index < 0 || index >= (int)_loops.size())
+        throw std::runtime_error("Invalid event loop");
+
+    return _loops[index];
+}
+
+// Picks a loop for a new connection and counts it there. An explicit
+// index bypasses the policy.
+int
+IOServicePool::assign(int index) {
+    boost::lock_guard<boost::mutex> lock(_lock);
+
+    if (index >= (int)_loops.size())
+        throw std::runtime_error("Invalid event loop");
+
+    if (index < 0 && _policy == ROUND_ROBIN)
+        index = _next++ % _loops.size();
+
+    if (index < 0) {
+        index = 0;
+        for (unsigned int i = 1; i < _loops.size(); i++)
+            if (_loops[i]->connections() < _loops[index]->connections())
+                index = i;
+    }
+
+    _loops[index]->acquire();
+    return index;
+}
+
+void
+IOServicePool::set_policy(std::string policy) {
+    boost::lock_guard<boost::mutex> lock(_lock);
+
+    if (policy == "round_robin")
+        _policy = ROUND_ROBIN;
+    else if (policy == "least_loaded")
+        _policy = LEAST_LOADED;
+    else
+        throw std::runtime_error("Invalid policy, use round_robin or least_loaded");
+}
+
+std::string
+IOServicePool::policy() {
+    boost::lock_guard<boost::mutex> lock(_lock);
+    return _policy == ROUND_ROBIN ? "round_robin" : "least_loaded";
+}
+
+// Start the default loop as soon as the library is loaded
+static IOServicePool& _pool = IOServicePool::instance();
@@ -0,0 +1,79 @@
+// -*- mode: c++; coding: utf-8; tab-width: 4 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#ifndef _IOSERVICE_H_
+#define _IOSERVICE_H_
+
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <glib.h>
+
+/*
+ * One GLib main loop on its own thread. The first loop runs the default
+ * context; extra loops created by IOServicePool each own a new context,
+ * and every connection assigned to a loop is served only by it.
+ */
+class IOService {
+public:
+	IOService(bool run, GMainContext* context=NULL);
+	void start();
+	void operator()();
+
+	GMainContext* context() const;
+	void invoke(std::function<void()> func);
+	void set_cpu(int cpu);
+	int cpu() const;
+
+	void acquire();
+	void release();
+	unsigned long connections() const;
+	unsigned long iterations() const;
+	unsigned long busy_ms() const;
+
+	friend gint timed_poll(GPollFD*, guint, gint);
+
+private:
+	void apply_cpu();
+
+	GMainContext* _context;
+	int _cpu{-1};
+	pthread_t _thread;
+	std::atomic<bool> _running{false};
+	std::atomic<unsigned long> _connections{0};
+	std::atomic<unsigned long> _iterations{0};
+	std::atomic<gint64> _started{0};
+	std::atomic<gint64> _idle_us{0};
+};
+
+class IOServicePool {
+public:
+	enum Policy {
+		ROUND_ROBIN,
+		LEAST_LOADED
+	};
+
+	static IOServicePool& instance();
+
+	void resize(int count);
+	int size();
+	IOService* get(int index);
+	int assign(int index=-1);
+
+	void set_policy(std::string policy);
+	std::string policy();
+
+private:
+	IOServicePool();
+
+	boost::mutex _lock;
+	std::vector<IOService*> _loops;
+	Policy _policy{ROUND_ROBIN};
+	unsigned int _next{0};
+};
+
+#endif // _IOSERVICE_H_
@@ -0,0 +1,331 @@
+// -*- mode: c++; coding: utf-8 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+#include "gattlib.h"
+#include "recorder.h"
+
+#define RECORD_MAGIC "GATR"
+#define RECORD_VERSION 1
+
+std::string
+NotificationRecorder::segment_path(const std::string& path,
+        uint32_t sequence) {
+    if (sequence == 0)
+        return path;
+    return path + "." + std::to_string(sequence);
+}
+
+// Sequences of the "<path>.N" segments found next to path
+static std::vector<uint32_t>
+numbered_segments(const std::string& path) {
+    std::vector<uint32_t> sequences;
+
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    std::string prefix = (slash == std::string::npos ? path :
+                          path.substr(slash + 1)) + ".";
+
+    DIR* d = opendir(dir.c_str());
+    if (d == NULL)
+        return sequences;
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, prefix.c_str(), prefix.size()) != 0)
+            continue;
+
+        char* end;
+        const char* digits = entry->d_name + prefix.size();
+        unsigned long sequence = strtoul(digits, &end, 10);
+        if (*digits == '\0' || *end != '\0' || sequence == 0)
+            continue;
+        sequences.push_back(sequence);
+    }
+
+    closedir(d);
+    return sequences;
+}
+
+NotificationRecorder::NotificationRecorder(const std::string& path,
+        size_t size, int segments) :
+    _path(path),
+    _size(size),
+    _segments(segments) {
+
+    if (_size < sizeof(RecordHeader) + sizeof(Record) + ATT_MAX_VALUE_LEN)
+        throw std::runtime_error("Record file size too small");
+
+    // Segments of an earlier log would read as the continuation of this one
+    for (uint32_t sequence : numbered_segments(path))
+        unlink(segment_path(path, sequence).c_str());
+
+    if (!open_segment()) {
+        std::string msg = std::string("Could not create record file: ") +
+            std::string(strerror(errno));
+        throw std::runtime_error(msg);
+    }
+}
+
+NotificationRecorder::~NotificationRecorder() {
+    close_segment();
+}
+
+// Only the given handles are recorded, or all of them if none is
+void
+NotificationRecorder::set_handles(const std::vector<uint16_t>& handles) {
+    _handles.reset();
+    for (uint16_t handle : handles)
+        _handles.set(handle);
+    _all = handles.empty();
+}
+
+bool
+NotificationRecorder::wants(uint16_t handle) const {
+    return _all || _handles.test(handle);
+}
+
+bool
+NotificationRecorder::open_segment() {
+    std::string path = segment_path(_path, _sequence);
+
+    _fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0)
+        return false;
+
+    // Reserve the blocks now, not on the first write to each page
+    if (posix_fallocate(_fd, 0, _size) != 0 && ftruncate(_fd, _size) < 0) {
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    void* map = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    _map = (uint8_t*)map;
+    _header = (RecordHeader*)_map;
+    memset(_header, 0, sizeof(RecordHeader));
+    memcpy(_header->magic, RECORD_MAGIC, 4);
+    _header->version = RECORD_VERSION;
+    _header->header_size = sizeof(RecordHeader);
+    _header->sequence = _sequence;
+    _header->realtime = g_get_real_time();
+    _header->monotonic = g_get_monotonic_time();
+    _used = sizeof(RecordHeader);
+    __atomic_store_n(&_header->used, _used, __ATOMIC_RELEASE);
+
+    if (_segments > 0 && _sequence >= (uint32_t)_segments)
+        unlink(segment_path(_path, _sequence - _segments).c_str());
+
+    return true;
+}
+
+// Cuts the preallocated tail, so a finished segment holds records only
+void
+NotificationRecorder::close_segment() {
+    if (_map == nullptr)
+        return;
+
+    munmap(_map, _size);
+    // If it fails, the tail is only zeros past 'used'
+    int ret = ftruncate(_fd, _used);
+    (void)ret;
+    close(_fd);
+
+    _map = nullptr;
+    _header = nullptr;
+    _fd = -1;
+}
+
+// Runs on the loop thread
+bool
+NotificationRecorder::append(uint16_t handle, const uint8_t* value,
+        size_t length) {
+    size_t needed = sizeof(Record) + length;
+
+    if (_map != nullptr && _used + needed > _size) {
+        close_segment();
+        _sequence++;
+        open_segment();
+    }
+
+    if (_map == nullptr) {
+        _dropped++;
+        return false;
+    }
+
+    Record record;
+    record.timestamp = g_get_monotonic_time();
+    record.handle = handle;
+    record.length = length;
+
+    memcpy(_map + _used, &record, sizeof(record));
+    memcpy(_map + _used + sizeof(record), value, length);
+    _used += needed;
+    __atomic_store_n(&_header->used, _used, __ATOMIC_RELEASE);
+
+    _recorded++;
+    return true;
+}
+
+unsigned long
+NotificationRecorder::recorded() const {
+    return _recorded;
+}
+
+unsigned long
+NotificationRecorder::dropped() const {
+    return _dropped;
+}
+
+// Older segments may have been removed, start from the first one left
+static uint32_t
+first_sequence(const std::string& path) {
+    if (access(path.c_str(), F_OK) == 0)
+        return 0;
+
+    uint32_t first = 0;
+    for (uint32_t sequence : numbered_segments(path)) {
+        if (first == 0 || sequence < first)
+            first = sequence;
+    }
+
+    return first;
+}
+
+RecordReader::RecordReader(const std::string& path) :
+    _path(path) {
+
+    if (!open_segment(first_sequence(path)))
+        throw std::runtime_error("Could not open record file");
+}
+
+RecordReader::~RecordReader() {
+    close_segment();
+}
+
+bool
+RecordReader::open_segment(uint32_t sequence) {
+    std::string path = NotificationRecorder::segment_path(_path, sequence);
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+            (size_t)st.st_size < sizeof(NotificationRecorder::RecordHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const NotificationRecorder::RecordHeader* header =
+        (const NotificationRecorder::RecordHeader*)map;
+    if (memcmp(header->magic, RECORD_MAGIC, 4) != 0 ||
+            header->version != RECORD_VERSION) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    close_segment();
+    _map = (uint8_t*)map;
+    _map_size = st.st_size;
+    _sequence = sequence;
+    _offset = header->header_size;
+    _clock_offset = header->realtime - header->monotonic;
+    return true;
+}
+
+void
+RecordReader::close_segment() {
+    if (_map != nullptr)
+        munmap(_map, _map_size);
+
+    _map = nullptr;
+    _map_size = 0;
+}
+
+// The value of the next record, or NULL if there is none yet. Moves to
+// the next segment once it exists, which means this one is complete.
+const uint8_t*
+RecordReader::next_record(NotificationRecorder::Record& record) {
+    for (;;) {
+        const NotificationRecorder::RecordHeader* header =
+            (const NotificationRecorder::RecordHeader*)_map;
+        uint64_t used = __atomic_load_n(&header->used, __ATOMIC_ACQUIRE);
+
+        if (_offset + sizeof(record) <= used && used <= _map_size) {
+            memcpy(&record, _map + _offset, sizeof(record));
+            const uint8_t* value = _map + _offset + sizeof(record);
+            _offset += sizeof(record) + record.length;
+            return value;
+        }
+
+        // The writer completes a segment before it starts the next one
+        std::string next =
+            NotificationRecorder::segment_path(_path, _sequence + 1);
+        if (access(next.c_str(), F_OK) != 0)
+            return NULL;
+        if (__atomic_load_n(&header->used, __ATOMIC_ACQUIRE) != used)
+            continue;
+        if (!open_segment(_sequence + 1))
+            return NULL;
+    }
+}
+
+// (timestamp, handle, data), StopIteration at the end of the log
+boost::python::tuple
+RecordReader::next() {
+    NotificationRecorder::Record record;
+    const uint8_t* value = next_record(record);
+
+    if (value == NULL) {
+        PyErr_SetNone(PyExc_StopIteration);
+        boost::python::throw_error_already_set();
+    }
+
+    return boost::python::make_tuple(record.timestamp + _clock_offset,
+            record.handle,
+            std::vector<char>((const char*)value,
+                              (const char*)value + record.length));
+}
+
+// Up to count records as a list, all those available if count is 0
+boost::python::list
+RecordReader::read(int count) {
+    boost::python::list result;
+    NotificationRecorder::Record record;
+    const uint8_t* value;
+    int n = 0;
+
+    while ((count <= 0 || n++ < count) &&
+           (value = next_record(record)) != NULL) {
+        result.append(boost::python::make_tuple(
+                record.timestamp + _clock_offset, record.handle,
+                std::vector<char>((const char*)value,
+                                  (const char*)value + record.length)));
+    }
+
+    return result;
+}
@@ -0,0 +1,101 @@
+// -*- mode: c++; coding: utf-8; tab-width: 4 -*-
+
+// This software is under the terms of Apache License v2 or later.
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <boost/python/list.hpp>
+#include <boost/python/tuple.hpp>
+#include <bitset>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Binary log of notifications, written by the event loop into a
+ * preallocated file mapped in memory. A segment starts with a RecordHeader
+ * and holds records back to back, each a Record followed by its value.
+ * When one is full, it is cut to its used size and the next one,
+ * "<path>.1", "<path>.2" and so on, is started; with a segment limit, the
+ * oldest ones are removed. 'used' is updated after each record, so a
+ * segment can be read while it is written.
+ */
+class NotificationRecorder {
+public:
+	struct RecordHeader {
+		char magic[4];
+		uint8_t version;
+		uint8_t reserved[3];
+		uint32_t header_size;
+		uint32_t sequence;		// Index of the segment
+		uint64_t used;			// Bytes of valid records, header included
+		int64_t realtime;		// Wall clock of monotonic time 'monotonic'
+		int64_t monotonic;
+	};
+
+	struct __attribute__((packed)) Record {
+		int64_t timestamp;		// Monotonic, in microseconds
+		uint16_t handle;
+		uint16_t length;
+	};
+
+	NotificationRecorder(const std::string& path, size_t size,
+			int segments);
+	virtual ~NotificationRecorder();
+
+	void set_handles(const std::vector<uint16_t>& handles);
+	bool wants(uint16_t handle) const;
+	bool append(uint16_t handle, const uint8_t* value, size_t length);
+
+	unsigned long recorded() const;
+	unsigned long dropped() const;
+
+	static std::string segment_path(const std::string& path,
+			uint32_t sequence);
+
+private:
+	bool open_segment();
+	void close_segment();
+
+	std::string _path;
+	size_t _size;
+	int _segments;
+	uint32_t _sequence{0};
+	int _fd{-1};
+	uint8_t* _map{nullptr};
+	RecordHeader* _header{nullptr};
+	uint64_t _used{0};
+	bool _all{true};
+	std::bitset<65536> _handles;
+	unsigned long _recorded{0};
+	unsigned long _dropped{0};
+};
+
+/*
+ * Iterates over the records of a log, segment after segment, as
+ * (timestamp, handle, data) tuples. Timestamps are microseconds since the
+ * epoch, derived from the monotonic clock of the writer.
+ */
+class RecordReader {
+public:
+	RecordReader(const std::string& path);
+	virtual ~RecordReader();
+
+	boost::python::tuple next();
+	boost::python::list read(int count);
+
+private:
+	bool open_segment(uint32_t sequence);
+	void close_segment();
+	const uint8_t* next_record(NotificationRecorder::Record& record);
+
+	std::string _path;
+	uint32_t _sequence{0};
+	uint8_t* _map{nullptr};
+	size_t _map_size{0};
+	uint64_t _offset{0};
+	int64_t _clock_offset{0};
+};
+
+#endif // _RECORDER_H_